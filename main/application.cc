@@ -11,6 +11,7 @@
 
 #include <cstring>
 #include <esp_log.h>
+#include <esp_heap_caps.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
 #include <arpa/inet.h>
@@ -57,6 +58,20 @@ Application::Application() {
         .skip_unhandled_events = true
     };
     esp_timer_create(&clock_timer_args, &clock_timer_handle_);
+
+#if CONFIG_USE_UPLINK_SPOOL
+    esp_timer_create_args_t uplink_spool_timer_args = {
+        .callback = [](void* arg) {
+            Application* app = (Application*)arg;
+            xEventGroupSetBits(app->event_group_, MAIN_EVENT_SEND_AUDIO);
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "uplink_spool_timer",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&uplink_spool_timer_args, &uplink_spool_timer_handle_);
+#endif
 }
 
 Application::~Application() {
@@ -64,6 +79,12 @@ Application::~Application() {
         esp_timer_stop(clock_timer_handle_);
         esp_timer_delete(clock_timer_handle_);
     }
+#if CONFIG_USE_UPLINK_SPOOL
+    if (uplink_spool_timer_handle_ != nullptr) {
+        esp_timer_stop(uplink_spool_timer_handle_);
+        esp_timer_delete(uplink_spool_timer_handle_);
+    }
+#endif
     vEventGroupDelete(event_group_);
 }
 
@@ -103,9 +124,9 @@ void Application::CheckNewVersion(Ota& ota) {
         retry_delay = 10; // 重置重试延迟时间
 
         if (ota.HasNewVersion()) {
-            Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "happy", Lang::Sounds::OGG_UPGRADE);
-
-            vTaskDelay(pdMS_TO_TICKS(3000));
+            // Stopping the audio service for the upgrade would cut the sound off
+            auto sound = Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "happy", Lang::Sounds::OGG_UPGRADE);
+            sound.Wait(OTA_ALERT_SOUND_TIMEOUT_MS);
 
             SetDeviceState(kDeviceStateUpgrading);
             
@@ -194,27 +215,33 @@ void Application::ShowActivationCode(const std::string& code, const std::string&
         digit_sound{'9', Lang::Sounds::OGG_9}
     }};
 
-    // This sentence uses 9KB of SRAM, so we need to wait for it to finish
-    Alert(Lang::Strings::ACTIVATION, message.c_str(), "happy", Lang::Sounds::OGG_ACTIVATION);
+    Alert(Lang::Strings::ACTIVATION, message.c_str(), "happy");
 
+    // One playlist, so the digits cannot be split up by other sounds or dropped one by one
+    SoundPlaylist playlist;
+    playlist.AddSound(Lang::Sounds::OGG_ACTIVATION);
+    playlist.AddSilence(ACTIVATION_CODE_PAUSE_MS);
     for (const auto& digit : code) {
         auto it = std::find_if(digit_sounds.begin(), digit_sounds.end(),
             [digit](const digit_sound& ds) { return ds.digit == digit; });
         if (it != digit_sounds.end()) {
-            audio_service_.PlaySound(it->sound);
+            playlist.AddSound(it->sound);
         }
     }
+    audio_service_.PlaySounds(playlist, kAudioPlaybackPriorityHigh);
 }
 
-void Application::Alert(const char* status, const char* message, const char* emotion, const std::string_view& sound) {
+SoundHandle Application::Alert(const char* status, const char* message, const char* emotion, const std::string_view& sound) {
     ESP_LOGW(TAG, "Alert %s: %s [%s]", status, message, emotion);
     auto display = Board::GetInstance().GetDisplay();
     display->SetStatus(status);
     display->SetEmotion(emotion);
     display->SetChatMessage("system", message);
-    if (!sound.empty()) {
-        audio_service_.PlaySound(sound);
+    if (sound.empty()) {
+        return SoundHandle();
     }
+    // Alerts must be heard right away, even in the middle of a conversation
+    return audio_service_.PlaySounds(SoundPlaylist().AddSound(sound), kAudioPlaybackPriorityHigh);
 }
 
 void Application::DismissAlert() {
@@ -320,6 +347,10 @@ void Application::StopListening() {
 
     Schedule([this]() {
         if (device_state_ == kDeviceStateListening) {
+#if CONFIG_USE_UPLINK_SPOOL
+            // The server must have the whole utterance before it is told that it ended
+            uplink_spool_.Flush(*protocol_, true);
+#endif
             protocol_->SendStopListening();
             SetDeviceState(kDeviceStateIdle);
         }
@@ -348,6 +379,32 @@ void Application::Start() {
     callbacks.on_vad_change = [this](bool speaking) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_VAD_CHANGE);
     };
+#if CONFIG_USE_END_OF_SPEECH_DETECTION
+    callbacks.on_end_of_speech = [this](uint32_t silence_ms, bool stopped) {
+        int64_t speech_end_time = esp_timer_get_time() - silence_ms * 1000LL;
+        Schedule([this, speech_end_time, silence_ms, stopped]() {
+            speech_end_time_ = speech_end_time;
+            speech_end_stopped_ = stopped;
+            OnEndOfSpeech(silence_ms, stopped);
+        });
+    };
+#endif
+#if CONFIG_USE_DOWNLINK_FLOW_CONTROL
+    callbacks.on_downlink_flow_change = [this](bool pause) {
+        Schedule([this, pause]() {
+            if (protocol_ && protocol_->IsAudioChannelOpened()) {
+                protocol_->SendDownlinkFlow(pause);
+            }
+        });
+    };
+#endif
+#if CONFIG_USE_ECHO_DELAY_ESTIMATOR
+    callbacks.on_echo_delay_change = [this]() {
+        Schedule([this]() {
+            audio_service_.SaveEchoDelay();
+        });
+    };
+#endif
     audio_service_.SetCallbacks(callbacks);
 
     /* Start the clock timer to update the status bar */
@@ -384,21 +441,40 @@ void Application::Start() {
     });
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
         if (device_state_ == kDeviceStateSpeaking) {
+#if CONFIG_USE_PHRASE_CACHE
+            phrase_cache_.Record(*packet);
+#endif
             audio_service_.PushPacketToDecodeQueue(std::move(packet));
         }
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveMode(false);
-        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
+        codec->ResetI2sHealth();
+        if (!codec->SupportsOutputSampleRate(protocol_->server_sample_rate())) {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
+        audio_service_.SetDownlinkBurst(protocol_->server_flow_control());
     });
-    protocol_->OnAudioChannelClosed([this, &board]() {
+    protocol_->OnAudioChannelClosed([this, codec, &board]() {
         board.SetPowerSaveMode(true);
+        auto health = codec->GetI2sHealth();
+        if (health.rx_overruns > 0 || health.tx_underruns > 0) {
+            ESP_LOGW(TAG, "Session had %lu I2S RX overruns and %lu TX underruns", health.rx_overruns, health.tx_underruns);
+        }
+#if CONFIG_USE_PHRASE_CACHE
+        phrase_cache_.CancelRecording();
+#endif
         Schedule([this]() {
             auto display = Board::GetInstance().GetDisplay();
             display->SetChatMessage("system", "");
+#if CONFIG_USE_UPLINK_SPOOL
+            if (device_state_ == kDeviceStateListening && !uplink_spool_.empty()) {
+                ESP_LOGW(TAG, "Channel closed with %lu ms spooled, kept for %d ms", uplink_spool_.depth_ms(),
+                    UPLINK_SPOOL_RECONNECT_MS);
+                uplink_spool_keep_until_ = esp_timer_get_time() + UPLINK_SPOOL_RECONNECT_MS * 1000LL;
+            }
+#endif
             SetDeviceState(kDeviceStateIdle);
         });
     });
@@ -415,6 +491,10 @@ void Application::Start() {
                     }
                 });
             } else if (strcmp(state->valuestring, "stop") == 0) {
+                audio_service_.MarkDownlinkSegmentEnd();
+#if CONFIG_USE_PHRASE_CACHE
+                phrase_cache_.CommitRecording();
+#endif
                 Schedule([this]() {
                     if (device_state_ == kDeviceStateSpeaking) {
                         if (listening_mode_ == kListeningModeManualStop) {
@@ -425,6 +505,18 @@ void Application::Start() {
                     }
                 });
             } else if (strcmp(state->valuestring, "sentence_start") == 0) {
+                // The previous sentence has ended
+                audio_service_.MarkDownlinkSegmentEnd();
+#if CONFIG_USE_PHRASE_CACHE
+                // The audio of the sentence follows this message only where both share a connection,
+                // so the recording must start here. Other transports do not advertise the cache
+                auto cache_key = cJSON_GetObjectItem(root, "cache_key");
+                if (cJSON_IsString(cache_key) && protocol_->IsAudioOrderedWithJson()) {
+                    phrase_cache_.BeginRecording(cache_key->valuestring);
+                } else {
+                    phrase_cache_.CommitRecording();
+                }
+#endif
                 auto text = cJSON_GetObjectItem(root, "text");
                 if (cJSON_IsString(text)) {
                     ESP_LOGI(TAG, "<< %s", text->valuestring);
@@ -433,7 +525,28 @@ void Application::Start() {
                     });
                 }
             }
+#if CONFIG_USE_PHRASE_CACHE
+        } else if (strcmp(type->valuestring, "phrase") == 0) {
+            auto key = cJSON_GetObjectItem(root, "key");
+            auto text = cJSON_GetObjectItem(root, "text");
+            if (!protocol_->IsAudioOrderedWithJson()) {
+                // The cache is not offered on this transport, nothing was recorded to play
+                ESP_LOGW(TAG, "Phrase message on a transport without the phrase cache");
+            } else if (cJSON_IsString(key) && PhraseCache::IsValidKey(key->valuestring)) {
+                Schedule([this, key = std::string(key->valuestring),
+                        message = std::string(cJSON_IsString(text) ? text->valuestring : "")]() {
+                    PlayCachedPhrase(key, message);
+                });
+            } else {
+                ESP_LOGW(TAG, "Phrase message requires a valid key");
+            }
+#endif
         } else if (strcmp(type->valuestring, "stt") == 0) {
+#if CONFIG_USE_END_OF_SPEECH_DETECTION
+            Schedule([this]() {
+                ReportEndOfSpeechLatency();
+            });
+#endif
             auto text = cJSON_GetObjectItem(root, "text");
             if (cJSON_IsString(text)) {
                 ESP_LOGI(TAG, ">> %s", text->valuestring);
@@ -519,7 +632,62 @@ void Application::OnClockTimer() {
         // SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(1000));
         // SystemInfo::PrintTaskList();
         SystemInfo::PrintHeapStats();
+        // Once the idle state has settled for 30 s, the number the memory budget is checked against
+        if (device_state_ != kDeviceStateIdle) {
+            idle_heap_checks_ = 0;
+        } else if (++idle_heap_checks_ == 3) {
+            ESP_LOGI(TAG, "Idle free sram: %u, largest block %u", heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+                heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+        }
+#if CONFIG_USE_LOW_MEMORY_PROFILE
+        audio_service_.PrintStackHighWaterMarks();
+#endif
+#if CONFIG_USE_UPLINK_SPOOL
+        if (uplink_spool_.max_depth_ms() > OPUS_FRAME_DURATION_MS) {
+            ESP_LOGI(TAG, "Uplink spool: depth %lu ms, max %lu ms, dropped %lu ms, gaps %lu", uplink_spool_.depth_ms(),
+                uplink_spool_.max_depth_ms(), uplink_spool_.dropped_ms(), uplink_spool_.gaps());
+        }
+#endif
     }
+
+#if CONFIG_USE_UPLINK_SPOOL
+    if (uplink_spool_keep_until_ != 0 && esp_timer_get_time() >= uplink_spool_keep_until_) {
+        Schedule([this]() {
+            // Nobody resumed the utterance in time
+            if (uplink_spool_keep_until_ != 0 && esp_timer_get_time() >= uplink_spool_keep_until_) {
+                uplink_spool_keep_until_ = 0;
+                uplink_spool_.Clear();
+            }
+        });
+    }
+#endif
+}
+
+void Application::SendAudioPackets() {
+#if CONFIG_USE_UPLINK_SPOOL
+    // Packets only go into the spool when sending fails or older ones are still waiting there,
+    // it keeps capturing while the channel is down and is sent in order once it is back
+    bool opened = protocol_->IsAudioChannelOpened();
+    while (auto packet = audio_service_.PopPacketFromSendQueue()) {
+        if (!uplink_spool_.empty() || !opened || !protocol_->SendAudio(*packet)) {
+            uplink_spool_.Push(std::move(packet));
+        }
+    }
+    if (!opened || uplink_spool_.empty()) {
+        return;
+    }
+    int wait_ms = uplink_spool_.Flush(*protocol_);
+    if (wait_ms > 0) {
+        esp_timer_stop(uplink_spool_timer_handle_);
+        esp_timer_start_once(uplink_spool_timer_handle_, wait_ms * 1000);
+    }
+#else
+    while (auto packet = audio_service_.PopPacketFromSendQueue()) {
+        if (!protocol_->SendAudio(*packet)) {
+            break;
+        }
+    }
+#endif
 }
 
 // Add a async task to MainLoop
@@ -550,11 +718,7 @@ void Application::MainEventLoop() {
         }
 
         if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (!protocol_->SendAudio(std::move(packet))) {
-                    break;
-                }
-            }
+            SendAudioPackets();
         }
 
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
@@ -586,6 +750,10 @@ void Application::OnWakeWordDetected() {
 
     if (device_state_ == kDeviceStateIdle) {
         audio_service_.EncodeWakeWord();
+#if CONFIG_USE_UPLINK_SPOOL
+        // The wake word starts a new utterance
+        uplink_spool_keep_until_ = 0;
+#endif
 
         if (!protocol_->IsAudioChannelOpened()) {
             SetDeviceState(kDeviceStateConnecting);
@@ -600,7 +768,7 @@ void Application::OnWakeWordDetected() {
 #if CONFIG_USE_AFE_WAKE_WORD || CONFIG_USE_CUSTOM_WAKE_WORD
         // Encode and send the wake word data to the server
         while (auto packet = audio_service_.PopWakeWordPacket()) {
-            protocol_->SendAudio(std::move(packet));
+            protocol_->SendAudio(*packet);
         }
         // Set the chat state to wake word detected
         protocol_->SendWakeWordDetected(wake_word);
@@ -617,12 +785,72 @@ void Application::OnWakeWordDetected() {
     }
 }
 
+void Application::OnEndOfSpeech(uint32_t silence_ms, bool stopped) {
+    if (!stopped || device_state_ != kDeviceStateListening || listening_mode_ != kListeningModeAutoStop) {
+        return;
+    }
+    // Same as a manual stop, the server replies without waiting for its own VAD
+#if CONFIG_USE_UPLINK_SPOOL
+    uplink_spool_.Flush(*protocol_, true);
+#endif
+    protocol_->SendStopListening();
+    SetDeviceState(kDeviceStateIdle);
+}
+
+void Application::ReportEndOfSpeechLatency() {
+    audio_service_.EnableEndOfSpeechDetection(false);
+    if (speech_end_time_ == 0) {
+        return;
+    }
+    uint32_t reply_ms = (esp_timer_get_time() - speech_end_time_) / 1000;
+    speech_end_time_ = 0;
+    if (!speech_end_stopped_) {
+        // The server ended the turn, its delay is the baseline
+        server_end_of_speech_ms_ = server_end_of_speech_ms_ == 0 ? reply_ms : (server_end_of_speech_ms_ * 3 + reply_ms) / 4;
+        if (end_of_speech_calibration_turns_ > 0) {
+            end_of_speech_calibration_turns_--;
+        }
+        ESP_LOGI(TAG, "Server ended the turn, stt %lu ms after the speech ended (average %lu ms)",
+            reply_ms, server_end_of_speech_ms_);
+    } else if (server_end_of_speech_ms_ > 0) {
+        ESP_LOGI(TAG, "Device ended the turn, stt %lu ms after the speech ended, %ld ms saved",
+            reply_ms, (int32_t)server_end_of_speech_ms_ - (int32_t)reply_ms);
+    } else {
+        ESP_LOGI(TAG, "Device ended the turn, stt %lu ms after the speech ended", reply_ms);
+    }
+}
+
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+#if CONFIG_USE_PHRASE_CACHE
+    phrase_cache_.CancelRecording();
+#endif
     protocol_->SendAbortSpeaking(reason);
 }
 
+#if CONFIG_USE_PHRASE_CACHE
+void Application::PlayCachedPhrase(const std::string& key, const std::string& text) {
+    // Played in place of the streamed audio of a reply, so only while speaking
+    bool hit = false;
+    if (device_state_ == kDeviceStateSpeaking && !aborted_) {
+        std::vector<std::unique_ptr<AudioStreamPacket>> packets;
+        if (phrase_cache_.Lookup(key, packets)) {
+            hit = audio_service_.PushPacketsToDecodeQueue(packets);
+            if (!hit) {
+                ESP_LOGW(TAG, "No room in the downlink buffer for phrase %s", key.c_str());
+            }
+        }
+    }
+    phrase_cache_.CountLookup(hit);
+    if (hit && !text.empty()) {
+        ESP_LOGI(TAG, "<< %s", text.c_str());
+        Board::GetInstance().GetDisplay()->SetChatMessage("assistant", text.c_str());
+    }
+    protocol_->SendPhraseResult(key, hit, phrase_cache_.hits(), phrase_cache_.misses());
+}
+#endif
+
 void Application::SetListeningMode(ListeningMode mode) {
     listening_mode_ = mode;
     SetDeviceState(kDeviceStateListening);
@@ -665,7 +893,21 @@ void Application::SetDeviceState(DeviceState state) {
             // Make sure the audio processor is running
             if (!audio_service_.IsAudioProcessorRunning()) {
                 // Send the start listening command
+#if CONFIG_USE_UPLINK_SPOOL
+                // A new turn, unless it resumes the utterance the dropped channel cut off
+                if (uplink_spool_keep_until_ == 0 || esp_timer_get_time() >= uplink_spool_keep_until_) {
+                    uplink_spool_.Clear();
+                } else {
+                    ESP_LOGI(TAG, "Resuming %lu ms of spooled audio", uplink_spool_.depth_ms());
+                }
+                uplink_spool_keep_until_ = 0;
+#endif
                 protocol_->SendStartListening(listening_mode_);
+#if CONFIG_USE_END_OF_SPEECH_DETECTION
+                speech_end_time_ = 0;
+                audio_service_.EnableEndOfSpeechDetection(listening_mode_ == kListeningModeAutoStop,
+                    end_of_speech_calibration_turns_ > 0);
+#endif
                 audio_service_.EnableVoiceProcessing(true);
                 audio_service_.EnableWakeWordDetection(false);
             }
@@ -768,6 +1010,6 @@ void Application::SetAecMode(AecMode mode) {
     });
 }
 
-void Application::PlaySound(const std::string_view& sound) {
-    audio_service_.PlaySound(sound);
+void Application::PlaySound(const std::string_view& sound, AudioPlaybackPriority priority, std::function<void()> on_complete) {
+    audio_service_.PlaySound(sound, priority, std::move(on_complete));
 }
\ No newline at end of file
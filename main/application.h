@@ -15,6 +15,8 @@
 #include "protocol.h"
 #include "ota.h"
 #include "audio_service.h"
+#include "uplink_spool.h"
+#include "phrase_cache.h"
 #include "device_state_event.h"
 
 #define MAIN_EVENT_SCHEDULE (1 << 0)
@@ -24,6 +26,13 @@
 #define MAIN_EVENT_ERROR (1 << 4)
 #define MAIN_EVENT_CHECK_NEW_VERSION_DONE (1 << 5)
 
+/* AutoStop turns left to the server first, to measure how long its own end-pointing takes */
+#define END_OF_SPEECH_CALIBRATION_TURNS 2
+/* Between the activation prompt and the digits of the code */
+#define ACTIVATION_CODE_PAUSE_MS 300
+/* Longest wait for the upgrade alert sound before the audio service is stopped */
+#define OTA_ALERT_SOUND_TIMEOUT_MS 5000
+
 enum AecMode {
     kAecOff,
     kAecOnDeviceSide,
@@ -46,7 +55,8 @@ public:
     bool IsVoiceDetected() const { return audio_service_.IsVoiceDetected(); }
     void Schedule(std::function<void()> callback);
     void SetDeviceState(DeviceState state);
-    void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
+    // The handle tells when the alert sound has been played, only wait on it outside the main loop
+    SoundHandle Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
     void DismissAlert();
     void AbortSpeaking(AbortReason reason);
     void ToggleChatState();
@@ -58,7 +68,8 @@ public:
     void SendMcpMessage(const std::string& payload);
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
-    void PlaySound(const std::string_view& sound);
+    void PlaySound(const std::string_view& sound, AudioPlaybackPriority priority = kAudioPlaybackPriorityNormal,
+        std::function<void()> on_complete = nullptr);
     AudioService& GetAudioService() { return audio_service_; }
 
 private:
@@ -75,16 +86,35 @@ private:
     AecMode aec_mode_ = kAecOff;
     std::string last_error_message_;
     AudioService audio_service_;
+#if CONFIG_USE_UPLINK_SPOOL
+    UplinkSpool uplink_spool_;
+    esp_timer_handle_t uplink_spool_timer_handle_ = nullptr;
+    // The channel dropped in the middle of an utterance, listening again before this time sends it first
+    int64_t uplink_spool_keep_until_ = 0;
+#endif
+#if CONFIG_USE_PHRASE_CACHE
+    PhraseCache phrase_cache_;
+#endif
 
     bool has_server_time_ = false;
     bool aborted_ = false;
     int clock_ticks_ = 0;
+    int idle_heap_checks_ = 0;
+    // End of speech timing, the reply delay of turns the server ended is the baseline for the time saved
+    int64_t speech_end_time_ = 0;
+    bool speech_end_stopped_ = false;
+    int end_of_speech_calibration_turns_ = END_OF_SPEECH_CALIBRATION_TURNS;
+    uint32_t server_end_of_speech_ms_ = 0;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
 
     void OnWakeWordDetected();
     void CheckNewVersion(Ota& ota);
     void ShowActivationCode(const std::string& code, const std::string& message);
     void OnClockTimer();
+    void SendAudioPackets();
+    void OnEndOfSpeech(uint32_t silence_ms, bool stopped);
+    void ReportEndOfSpeechLatency();
+    void PlayCachedPhrase(const std::string& key, const std::string& text);
     void SetListeningMode(ListeningMode mode);
 };
 
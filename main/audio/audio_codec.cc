@@ -3,7 +3,9 @@
 #include "settings.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <cstring>
+#include <algorithm>
 #include <driver/i2s_common.h>
 
 #define TAG "AudioCodec"
@@ -15,17 +17,198 @@ AudioCodec::~AudioCodec() {
 }
 
 void AudioCodec::OutputData(std::vector<int16_t>& data) {
+    uint32_t frames = data.size() / output_channels_;
+    uint32_t first_frame = output_position_.written();
+    if (software_reference_) {
+        std::lock_guard<std::mutex> lock(software_reference_mutex_);
+        if (software_reference_->output_sample_rate() != output_sample_rate_) {
+            software_reference_->Configure(input_sample_rate_, output_sample_rate_);
+        }
+        software_reference_->Write(data.data(), frames, output_channels_, first_frame);
+    }
+    if (output_position_tracked_) {
+        // The DMA played everything before this write came, the gap went out as silence
+        portENTER_CRITICAL(&clock_lock_);
+        if (output_stream_open_ && output_position_.queued() == 0) {
+            i2s_health_.tx_underruns++;
+            i2s_health_.tx_frames_starved += output_position_.silent() - tx_frames_silent_mark_;
+        }
+        tx_frames_silent_mark_ = output_position_.silent();
+        portEXIT_CRITICAL(&clock_lock_);
+        output_stream_open_ = true;
+    }
     Write(data.data(), data.size());
+    uint32_t counted = output_position_.written() - first_frame;
+    if (counted < frames) {
+        CountWrittenFrames(frames - counted);
+    }
+}
+
+void AudioCodec::CountWrittenFrames(uint32_t frames) {
+    portENTER_CRITICAL(&clock_lock_);
+    output_position_.AddWritten(frames);
+    portEXIT_CRITICAL(&clock_lock_);
+}
+
+void AudioCodec::EndOutputStream() {
+    output_stream_open_ = false;
+}
+
+I2sHealth AudioCodec::GetI2sHealth() {
+    portENTER_CRITICAL(&clock_lock_);
+    I2sHealth health = i2s_health_;
+    portEXIT_CRITICAL(&clock_lock_);
+    return health;
+}
+
+void AudioCodec::ResetI2sHealth() {
+    portENTER_CRITICAL(&clock_lock_);
+    i2s_health_ = {};
+    tx_frames_silent_mark_ = output_position_.silent();
+    portEXIT_CRITICAL(&clock_lock_);
+}
+
+// Called from the I2S ISR every time a TX DMA buffer has been shifted out
+bool IRAM_ATTR AudioCodec::OnTxDmaSent(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = (AudioCodec*)user_ctx;
+    codec->tx_dma_interrupts_++;
+    int loaded = -1;
+    bool need_yield = codec->OnOutputDmaSent(event, loaded);
+
+    portENTER_CRITICAL_ISR(&codec->clock_lock_);
+    codec->output_position_.OnSent(loaded);
+    if (codec->software_reference_) {
+        auto& clock = codec->output_clocks_[codec->output_clock_count_ % ECHO_REFERENCE_CLOCKS];
+        clock.time_us = esp_timer_get_time();
+        clock.played = codec->output_position_.played();
+        clock.queued = codec->output_position_.queued();
+        codec->output_clock_count_++;
+    }
+    portEXIT_CRITICAL_ISR(&codec->clock_lock_);
+    return need_yield;
+}
+
+bool IRAM_ATTR AudioCodec::OnRxDmaReceived(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = (AudioCodec*)user_ctx;
+    codec->rx_dma_interrupts_++;
+    portENTER_CRITICAL_ISR(&codec->clock_lock_);
+    codec->rx_dma_time_ = esp_timer_get_time();
+    codec->rx_frames_received_ += codec->dma_frame_num_;
+    portEXIT_CRITICAL_ISR(&codec->clock_lock_);
+    return false;
+}
+
+// The driver dropped the oldest unread RX buffer, the frames read next were captured later
+bool IRAM_ATTR AudioCodec::OnRxDmaOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = (AudioCodec*)user_ctx;
+    portENTER_CRITICAL_ISR(&codec->clock_lock_);
+    codec->rx_frames_dropped_ += codec->dma_frame_num_;
+    codec->i2s_health_.rx_overruns++;
+    codec->i2s_health_.rx_frames_lost += codec->dma_frame_num_;
+    portEXIT_CRITICAL_ISR(&codec->clock_lock_);
+    return false;
 }
 
 bool AudioCodec::InputData(std::vector<int16_t>& data) {
+    if (software_reference_) {
+        return InputDataWithReference(data);
+    }
     int samples = Read(data.data(), data.size());
     if (samples > 0) {
+        size_t frames = samples / input_channels_;
+        int64_t first_time = UpdateInputCaptureTime(frames);
+        input_capture_time_ = first_time == 0 ? 0 : first_time + (int64_t)(frames - 1) * 1000000 / input_sample_rate_;
         return true;
     }
     return false;
 }
 
+int64_t AudioCodec::UpdateInputCaptureTime(size_t frames) {
+    if (!input_position_tracked_) {
+        return 0;
+    }
+    portENTER_CRITICAL(&clock_lock_);
+    int64_t rx_time = rx_dma_time_;
+    uint32_t received = rx_frames_received_;
+    uint32_t dropped = rx_frames_dropped_;
+    portEXIT_CRITICAL(&clock_lock_);
+
+    // Index of the first frame in the RX DMA stream, the last received frame was captured at rx_time
+    uint32_t first = input_frames_read_ + dropped + input_frame_offset_;
+    input_frames_read_ += frames;
+    int32_t backlog = received - (first + frames);
+    if (backlog < 0 || backlog > dma_desc_num_ * dma_frame_num_) {
+        // Lost track of the stream, assume the read emptied the DMA buffers
+        if (software_reference_) {
+            ESP_LOGW(TAG, "Software reference resynced by %ld frames", backlog);
+        }
+        input_frame_offset_ += backlog;
+        first += backlog;
+    }
+    return rx_time - (int64_t)(received - first) * 1000000 / input_sample_rate_;
+}
+
+bool AudioCodec::InputDataWithReference(std::vector<int16_t>& data) {
+    size_t frames = data.size() / 2;
+    mic_buffer_.resize(frames);
+    if (Read(mic_buffer_.data(), frames) <= 0) {
+        return false;
+    }
+
+    EchoReferenceClock clocks[ECHO_REFERENCE_CLOCKS];
+    size_t clock_count = 0;
+    portENTER_CRITICAL(&clock_lock_);
+    if (output_clock_count_ - output_clock_read_ > ECHO_REFERENCE_CLOCKS) {
+        output_clock_read_ = output_clock_count_ - ECHO_REFERENCE_CLOCKS;
+    }
+    while (output_clock_read_ != output_clock_count_) {
+        clocks[clock_count++] = output_clocks_[output_clock_read_++ % ECHO_REFERENCE_CLOCKS];
+    }
+    portEXIT_CRITICAL(&clock_lock_);
+
+    int64_t capture_time = UpdateInputCaptureTime(frames);
+    input_capture_time_ = capture_time == 0 ? 0 : capture_time + (int64_t)(frames - 1) * 1000000 / input_sample_rate_;
+
+    for (size_t i = 0; i < frames; i++) {
+        data[i * 2] = mic_buffer_[i];
+    }
+    std::lock_guard<std::mutex> lock(software_reference_mutex_);
+    for (size_t i = 0; i < clock_count; i++) {
+        software_reference_->AddOutputClock(clocks[i]);
+    }
+    software_reference_->Read(data.data() + 1, frames, 2, capture_time);
+    return true;
+}
+
+void AudioCodec::ResyncInput() {
+    if (rx_handle_ == nullptr) {
+        return;
+    }
+    // Read without waiting until the DMA buffers are empty, the reads of the codec device go to the same channel
+    uint8_t discard[512];
+    size_t bytes_read = 0;
+    int limit = dma_desc_num_ * dma_frame_num_ * 8 / sizeof(discard) + 1;
+    for (int i = 0; i < limit; i++) {
+        if (i2s_channel_read(rx_handle_, discard, sizeof(discard), &bytes_read, 0) != ESP_OK || bytes_read == 0) {
+            break;
+        }
+    }
+    // The next read starts at the newest frame received
+    portENTER_CRITICAL(&clock_lock_);
+    input_frame_offset_ = rx_frames_received_ - rx_frames_dropped_ - input_frames_read_;
+    portEXIT_CRITICAL(&clock_lock_);
+}
+
+bool AudioCodec::EnableSoftwareReference() {
+    if (input_reference_ || input_channels_ != 1 || software_reference_) {
+        return false;
+    }
+    software_reference_ = std::make_unique<EchoReference>();
+    software_reference_->Configure(input_sample_rate_, output_sample_rate_);
+    ESP_LOGI(TAG, "Software echo reference enabled, %d Hz output to %d Hz input", output_sample_rate_, input_sample_rate_);
+    return true;
+}
+
 void AudioCodec::Start() {
     Settings settings("audio", false);
     output_volume_ = settings.GetInt("output_volume", output_volume_);
@@ -34,17 +217,78 @@ void AudioCodec::Start() {
         output_volume_ = 10;
     }
 
+    StartChannels();
+
+    EnableInput(true);
+    EnableOutput(true);
+    ESP_LOGI(TAG, "Audio codec started");
+}
+
+void AudioCodec::StartChannels() {
     if (tx_handle_ != nullptr) {
+        // New channels start with empty DMA buffers
+        ResetOutputPosition();
+        i2s_event_callbacks_t callbacks = {};
+        callbacks.on_sent = OnTxDmaSent;
+        esp_err_t err = i2s_channel_register_event_callback(tx_handle_, &callbacks, this);
+        if (err == ESP_OK) {
+            output_position_tracked_ = true;
+        } else {
+            output_position_tracked_ = false;
+            ESP_LOGW(TAG, "Failed to register TX DMA callback, playback position is not tracked: %s", esp_err_to_name(err));
+            if (software_reference_) {
+                ESP_LOGW(TAG, "Without the TX DMA clock the software reference stays silent");
+            }
+        }
         ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
     }
 
     if (rx_handle_ != nullptr) {
+        // New channels start with empty DMA buffers
+        portENTER_CRITICAL(&clock_lock_);
+        rx_frames_received_ = 0;
+        rx_frames_dropped_ = 0;
+        portEXIT_CRITICAL(&clock_lock_);
+        input_frames_read_ = 0;
+        input_frame_offset_ = 0;
+
+        i2s_event_callbacks_t callbacks = {};
+        callbacks.on_recv = OnRxDmaReceived;
+        callbacks.on_recv_q_ovf = OnRxDmaOverflow;
+        // Used to count interrupts and to date the captured frames, the input works without it
+        input_position_tracked_ = ESP_ERROR_CHECK_WITHOUT_ABORT(
+            i2s_channel_register_event_callback(rx_handle_, &callbacks, this)) == ESP_OK;
+        input_capture_time_ = 0;
         ESP_ERROR_CHECK(i2s_channel_enable(rx_handle_));
     }
+}
 
-    EnableInput(true);
-    EnableOutput(true);
-    ESP_LOGI(TAG, "Audio codec started");
+void AudioCodec::ResetOutputPosition() {
+    // Only resized by StartChannels, before the TX callback is registered
+    output_position_.Configure(dma_desc_num_, dma_frame_num_);
+    portENTER_CRITICAL(&clock_lock_);
+    output_position_.Reset();
+    portEXIT_CRITICAL(&clock_lock_);
+}
+
+bool AudioCodec::SetDmaGeometry(int desc_num, int frame_num) {
+    if (desc_num == dma_desc_num_ && frame_num == dma_frame_num_) {
+        return true;
+    }
+    int old_desc_num = dma_desc_num_;
+    int old_frame_num = dma_frame_num_;
+    dma_desc_num_ = desc_num;
+    dma_frame_num_ = frame_num;
+    if (!RecreateChannels()) {
+        dma_desc_num_ = old_desc_num;
+        dma_frame_num_ = old_frame_num;
+        return false;
+    }
+    // Whatever was queued in the old DMA buffers is gone
+    ResetOutputPosition();
+    output_stream_open_ = false;
+    ESP_LOGI(TAG, "Set DMA geometry to %d x %d frames", dma_desc_num_, dma_frame_num_);
+    return true;
 }
 
 void AudioCodec::SetOutputVolume(int volume) {
@@ -55,6 +299,29 @@ void AudioCodec::SetOutputVolume(int volume) {
     settings.SetInt("output_volume", output_volume_);
 }
 
+bool AudioCodec::SetOutputChannels(int channels) {
+    if (channels < 1 || channels > max_output_channels_) {
+        return false;
+    }
+    if (channels == output_channels_) {
+        return true;
+    }
+    bool enabled = output_enabled_;
+    if (enabled) {
+        EnableOutput(false);
+    }
+    output_channels_ = channels;
+    if (enabled) {
+        EnableOutput(true);
+    }
+    ESP_LOGI(TAG, "Set output channels to %d", output_channels_);
+    return true;
+}
+
+void AudioCodec::SetMaxOutputChannels(int channels) {
+    max_output_channels_ = std::clamp(channels, 1, 2);
+}
+
 void AudioCodec::EnableInput(bool enable) {
     if (enable == input_enabled_) {
         return;
@@ -68,5 +335,8 @@ void AudioCodec::EnableOutput(bool enable) {
         return;
     }
     output_enabled_ = enable;
+    if (!enable) {
+        output_stream_open_ = false;
+    }
     ESP_LOGI(TAG, "Set output enable to %s", enable ? "true" : "false");
 }
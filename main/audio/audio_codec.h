@@ -8,13 +8,25 @@
 #include <vector>
 #include <string>
 #include <functional>
+#include <memory>
+#include <mutex>
 
 #include "board.h"
+#include "dsp/echo_reference.h"
+#include "output_position.h"
 
 #define AUDIO_CODEC_DMA_DESC_NUM 6
 #define AUDIO_CODEC_DMA_FRAME_NUM 240
 #define AUDIO_CODEC_DEFAULT_MIC_GAIN 30.0
 
+// Lost audio at the I2S DMA since the last ResetI2sHealth, in frames (samples per channel)
+struct I2sHealth {
+    uint32_t rx_overruns;           // RX buffers the driver dropped because the input was read too late
+    uint32_t rx_frames_lost;
+    uint32_t tx_underruns;          // Times the output ran dry in the middle of a stream
+    uint32_t tx_frames_starved;     // Silence sent in their place
+};
+
 class AudioCodec {
 public:
     AudioCodec();
@@ -23,20 +35,59 @@ public:
     virtual void SetOutputVolume(int volume);
     virtual void EnableInput(bool enable);
     virtual void EnableOutput(bool enable);
+    // Switches the output between mono and interleaved stereo, reopening it if it is enabled
+    virtual bool SetOutputChannels(int channels);
+    // For boards that know whether both speakers are connected, like through a headphone jack.
+    // The next hello advertises it, a stereo output in use stays stereo until it powers down
+    void SetMaxOutputChannels(int channels);
+    // Whether SetOutputSampleRate can switch the output to this rate
+    virtual bool SupportsOutputSampleRate(int sample_rate) const { return sample_rate == output_sample_rate_; }
+    // Reclocks the output, the frames queued at the old rate are played out first
+    virtual bool SetOutputSampleRate(int sample_rate) { return sample_rate == output_sample_rate_; }
 
     virtual void OutputData(std::vector<int16_t>& data);
     virtual bool InputData(std::vector<int16_t>& data);
     virtual void Start();
 
     inline bool duplex() const { return duplex_; }
-    inline bool input_reference() const { return input_reference_; }
+    // A software reference adds the reference channel after the mic channels
+    inline bool input_reference() const { return input_reference_ || software_reference_ != nullptr; }
     inline int input_sample_rate() const { return input_sample_rate_; }
     inline int output_sample_rate() const { return output_sample_rate_; }
-    inline int input_channels() const { return input_channels_; }
+    inline int input_channels() const { return input_channels_ + (software_reference_ != nullptr ? 1 : 0); }
     inline int output_channels() const { return output_channels_; }
+    inline int max_output_channels() const { return max_output_channels_; }
     inline int output_volume() const { return output_volume_; }
     inline bool input_enabled() const { return input_enabled_; }
     inline bool output_enabled() const { return output_enabled_; }
+    // Playback position in frames (samples per channel), wraps around at 2^32. A frame counts as
+    // written when it enters the DMA ring, and as played once the DMA buffer that held it has been sent
+    inline uint32_t output_frames_written() const { return output_position_.written(); }
+    inline uint32_t output_frames_played() const { return output_position_.played(); }
+    inline bool output_position_tracked() const { return output_position_tracked_; }
+    // When the last frame returned by InputData was captured (esp_timer_get_time), 0 if unknown
+    inline int64_t input_capture_time() const { return input_capture_time_; }
+    inline int dma_desc_num() const { return dma_desc_num_; }
+    inline int dma_frame_num() const { return dma_frame_num_; }
+    // TX and RX DMA buffer interrupts since start, wraps around at 2^32
+    inline uint32_t dma_interrupts() const { return tx_dma_interrupts_ + rx_dma_interrupts_; }
+
+    I2sHealth GetI2sHealth();
+    void ResetI2sHealth();
+    // Nothing more is going to be written for now, the silence that follows is not an underrun
+    virtual void EndOutputStream();
+    // Drops the captured frames nobody read yet, so the next read is current again.
+    // Codecs that can recreate their channels override it to hold off RecreateChannels
+    virtual void ResyncInput();
+
+    // Rebuilds the echo reference from the played PCM, for codecs without a hardware loopback.
+    // Call before Start, returns false if the codec already has a reference channel
+    bool EnableSoftwareReference();
+    inline bool software_reference() const { return software_reference_ != nullptr; }
+
+    // Changes the number of DMA buffers and the frames per buffer, used for both directions.
+    // Returns false if the codec keeps the geometry it was created with
+    bool SetDmaGeometry(int desc_num, int frame_num);
 
 protected:
     i2s_chan_handle_t tx_handle_ = nullptr;
@@ -50,10 +101,58 @@ protected:
     int output_sample_rate_ = 0;
     int input_channels_ = 1;
     int output_channels_ = 1;
+    int max_output_channels_ = 1;
     int output_volume_ = 70;
+    // Updated by the writer and the TX ISR under clock_lock_
+    OutputPosition output_position_;
+    bool output_position_tracked_ = false;
+    int dma_desc_num_ = AUDIO_CODEC_DMA_DESC_NUM;
+    int dma_frame_num_ = AUDIO_CODEC_DMA_FRAME_NUM;
+    volatile uint32_t tx_dma_interrupts_ = 0;
+    volatile uint32_t rx_dma_interrupts_ = 0;
+
+    // Software echo reference, the DMA clocks are written by the ISRs under clock_lock_
+    std::unique_ptr<EchoReference> software_reference_;
+    std::mutex software_reference_mutex_;
+    portMUX_TYPE clock_lock_ = portMUX_INITIALIZER_UNLOCKED;
+    EchoReferenceClock output_clocks_[ECHO_REFERENCE_CLOCKS];
+    uint32_t output_clock_count_ = 0;
+    uint32_t output_clock_read_ = 0;
+    int64_t rx_dma_time_ = 0;
+    uint32_t rx_frames_received_ = 0;
+    uint32_t rx_frames_dropped_ = 0;
+    uint32_t input_frames_read_ = 0;
+    int32_t input_frame_offset_ = 0;
+    bool input_position_tracked_ = false;
+    int64_t input_capture_time_ = 0;
+    // The health counters are updated under clock_lock_
+    I2sHealth i2s_health_ = {};
+    uint32_t tx_frames_silent_mark_ = 0;
+    bool output_stream_open_ = false;
+    std::vector<int16_t> mic_buffer_;
 
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
+    // Runs in the I2S ISR after a TX DMA buffer is sent, returns true if a higher priority task was woken.
+    // A codec that refills the buffer itself sets loaded to the frames it put in
+    virtual bool OnOutputDmaSent(i2s_event_data_t* event, int& loaded) { return false; }
+    // Deletes and recreates the I2S channels with dma_desc_num_ and dma_frame_num_, then starts them again
+    virtual bool RecreateChannels() { return false; }
+    // Registers the DMA callbacks and enables the channels
+    void StartChannels();
+    // Everything written so far counts as played, for when the DMA buffers were dropped
+    void ResetOutputPosition();
+    // For a Write that counts its frames as they enter the DMA ring. OutputData counts the rest
+    // once Write returns, which is up to a whole write late
+    void CountWrittenFrames(uint32_t frames);
+
+private:
+    static bool OnTxDmaSent(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    static bool OnRxDmaReceived(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    static bool OnRxDmaOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    bool InputDataWithReference(std::vector<int16_t>& data);
+    // Accounts for frames just read, returns the capture time of the first one
+    int64_t UpdateInputCaptureTime(size_t frames);
 };
 
 #endif // _AUDIO_CODEC_H
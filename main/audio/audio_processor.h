@@ -6,13 +6,16 @@
 #include <functional>
 
 #include "audio_codec.h"
+#include "input_fanout.h"
 
 class AudioProcessor {
 public:
     virtual ~AudioProcessor() = default;
     
     virtual void Initialize(AudioCodec* codec, int frame_duration_ms) = 0;
-    virtual void Feed(std::vector<int16_t>&& data) = 0;
+    // GetFeedSize frames of the GetFeedView channels
+    virtual void Feed(const AudioSpan& data) = 0;
+    virtual AudioInputView GetFeedView() const { return kAudioInputViewMic; }
     virtual void Start() = 0;
     virtual void Stop() = 0;
     virtual bool IsRunning() = 0;
@@ -20,6 +23,8 @@ public:
     virtual void OnVadStateChange(std::function<void(bool speaking)> callback) = 0;
     virtual size_t GetFeedSize() = 0;
     virtual void EnableDeviceAec(bool enable) = 0;
+    // How far an output sample lags the input sample with the same index
+    virtual int GetOutputDelayMs() { return 0; }
 };
 
 #endif
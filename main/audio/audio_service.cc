@@ -1,6 +1,11 @@
 #include "audio_service.h"
+#include "settings.h"
 #include <esp_log.h>
+#include <esp_cpu.h>
 #include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
@@ -32,12 +37,54 @@ AudioService::~AudioService() {
 
 void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
+#if CONFIG_USE_SOFTWARE_ECHO_REFERENCE
+    /* Without a hardware loopback, the reference channel is rebuilt from the played PCM */
+    if (!codec_->input_reference()) {
+        codec_->EnableSoftwareReference();
+    }
+#endif
     codec_->Start();
 
     /* Setup the audio codec */
     opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
     opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+#if CONFIG_USE_OPUS_COMPLEXITY_CONTROLLER
+    opus_encoder_->SetComplexity(opus_complexity_controller_.Initialize(OPUS_FRAME_DURATION_MS));
+#else
     opus_encoder_->SetComplexity(0);
+#endif
+    playback_sample_rate_ = codec->output_sample_rate();
+    loudness_limiter_.Configure(playback_sample_rate_);
+    audio_decode_queue_.Initialize(Board::GetInstance().GetDownlinkBufferMs());
+
+    /* Playback EQ bands from Settings override the board default */
+    {
+        Settings settings("audio", false);
+        auto eq = settings.GetString("playback_eq", Board::GetInstance().GetAudioPlaybackEq());
+        if (!playback_eq_.Configure(eq, playback_sample_rate_)) {
+            ESP_LOGW(TAG, "Invalid playback EQ, disabled: %s", eq.c_str());
+        }
+#if CONFIG_USE_PLAYBACK_TIME_STRETCH
+        speaking_speed_ = std::clamp<int>(settings.GetInt("speaking_speed", 100), MIN_SPEAKING_SPEED, MAX_SPEAKING_SPEED);
+#endif
+    }
+    time_stretcher_.Configure(playback_sample_rate_);
+#if CONFIG_USE_END_OF_SPEECH_DETECTION
+    end_of_speech_detector_.Configure(CONFIG_END_OF_SPEECH_HANGOVER_MS, CONFIG_END_OF_SPEECH_MIN_SPEECH_MS);
+#endif
+
+#if CONFIG_USE_ECHO_DELAY_ESTIMATOR
+    if (codec->input_reference()) {
+        echo_delay_estimator_.Configure(16000);
+        Settings settings("audio", false);
+        int32_t delay_us = settings.GetInt("echo_delay_us", ECHO_DELAY_UNKNOWN);
+        if (delay_us != ECHO_DELAY_UNKNOWN) {
+            echo_delay_estimator_.SetDelay(delay_us / 1000.0f);
+            SetEchoDelayLine(echo_delay_estimator_.DelaySamples(16000) - ECHO_REFERENCE_LEAD_MS * 16);
+            ESP_LOGI(TAG, "Echo reference delay %.2f ms from settings", echo_delay_estimator_.delay_ms());
+        }
+    }
+#endif
 
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
@@ -60,7 +107,35 @@ void AudioService::Initialize(AudioCodec* codec) {
     wake_word_ = nullptr;
 #endif
 
+#if CONFIG_USE_AUDIO_DEBUGGER
+    audio_debugger_ = std::make_unique<AudioDebugger>();
+#endif
+
     audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
+#if CONFIG_USE_END_OF_SPEECH_DETECTION
+        if (end_of_speech_enabled_) {
+            if (end_of_speech_need_reset_) {
+                end_of_speech_need_reset_ = false;
+                end_of_speech_detector_.Reset();
+            }
+            if (end_of_speech_detector_.ended() && !end_of_speech_shadow_) {
+                /* The turn is over, the server gets no more audio */
+                return;
+            }
+            if (end_of_speech_detector_.Process(voice_detected_, data.size() / 16)) {
+                ESP_LOGI(TAG, "End of speech after %lu ms of speech and %lu ms of silence%s",
+                    end_of_speech_detector_.speech_ms(), end_of_speech_detector_.silence_ms(),
+                    end_of_speech_shadow_ ? " (shadow)" : "");
+                if (callbacks_.on_end_of_speech) {
+                    callbacks_.on_end_of_speech(end_of_speech_detector_.silence_ms(), !end_of_speech_shadow_);
+                }
+                if (!end_of_speech_shadow_) {
+                    return;
+                }
+            }
+        }
+#endif
+        FeedAudioDebugger(kAudioDebugTapProcessedInput, data, 16000, 1);
         PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
     });
 
@@ -104,28 +179,28 @@ void AudioService::Start() {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioInputTask();
         vTaskDelete(NULL);
-    }, "audio_input", 2048 * 3, this, 8, &audio_input_task_handle_, 1);
+    }, "audio_input", AUDIO_INPUT_TASK_STACK_SIZE, this, 8, &audio_input_task_handle_, 1);
 
     /* Start the audio output task */
     xTaskCreate([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioOutputTask();
         vTaskDelete(NULL);
-    }, "audio_output", 2048 * 2, this, 3, &audio_output_task_handle_);
+    }, "audio_output", AUDIO_OUTPUT_TASK_STACK_SIZE, this, 3, &audio_output_task_handle_);
 #else
     /* Start the audio input task */
     xTaskCreate([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioInputTask();
         vTaskDelete(NULL);
-    }, "audio_input", 2048 * 2, this, 8, &audio_input_task_handle_);
+    }, "audio_input", AUDIO_INPUT_TASK_STACK_SIZE, this, 8, &audio_input_task_handle_);
 
     /* Start the audio output task */
     xTaskCreate([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioOutputTask();
         vTaskDelete(NULL);
-    }, "audio_output", 2048, this, 3, &audio_output_task_handle_);
+    }, "audio_output", AUDIO_OUTPUT_TASK_STACK_SIZE, this, 3, &audio_output_task_handle_);
 #endif
 
     /* Start the opus codec task */
@@ -133,7 +208,7 @@ void AudioService::Start() {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->OpusCodecTask();
         vTaskDelete(NULL);
-    }, "opus_codec", 2048 * 13, this, 2, &opus_codec_task_handle_);
+    }, "opus_codec", OPUS_CODEC_TASK_STACK_SIZE, this, 2, &opus_codec_task_handle_);
 }
 
 void AudioService::Stop() {
@@ -143,12 +218,35 @@ void AudioService::Stop() {
         AS_EVENT_WAKE_WORD_RUNNING |
         AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    std::vector<std::shared_ptr<SoundCompletion>> dropped;
+    std::vector<std::function<void()>> pending_callbacks;
+    {
+        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+        DownlinkFlowEvent event;
+        audio_encode_queue_.clear();
+        audio_decode_queue_.Clear(event);
+        while (!audio_playback_queue_.empty()) {
+            if (audio_playback_queue_.front()->on_complete) {
+                pending_callbacks.push_back(std::move(audio_playback_queue_.front()->on_complete));
+            }
+            audio_playback_queue_.pop_front();
+        }
+        audio_testing_queue_.clear();
+        for (auto& sound : audio_sound_queue_) {
+            if (sound->last) {
+                dropped.push_back(sound->completion);
+            }
+        }
+        audio_sound_queue_.clear();
+        audio_queue_cv_.notify_all();
+    }
+    // Waiters on the playlists must not hang across an OTA upgrade
+    for (auto& callback : pending_callbacks) {
+        callback();
+    }
+    for (auto& completion : dropped) {
+        completion->Finish(kSoundDropped);
+    }
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
@@ -158,59 +256,159 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
         codec_->EnableInput(true);
     }
 
+    I2sHealth health = codec_->GetI2sHealth();
+    if (health.rx_overruns != rx_overruns_seen_) {
+        if (health.rx_overruns > rx_overruns_seen_) {
+            RecoverFromInputOverrun(health);
+        }
+        rx_overruns_seen_ = health.rx_overruns;
+    }
+
     if (codec_->input_sample_rate() != sample_rate) {
         data.resize(samples * codec_->input_sample_rate() / sample_rate * codec_->input_channels());
         if (!codec_->InputData(data)) {
             return false;
         }
+        input_block_capture_time_ = codec_->input_capture_time();
+        FeedAudioDebugger(kAudioDebugTapRawInput, data, codec_->input_sample_rate(), codec_->input_channels());
         if (codec_->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
+            // Scratch layout: mic, reference, resampled mic, resampled reference
+            size_t frames = data.size() / 2;
+            size_t resampled_frames = input_resampler_.GetOutputSamples(frames);
+            input_scratch_.resize(frames * 2 + resampled_frames * 2);
+            int16_t* mic_channel = input_scratch_.data();
+            int16_t* reference_channel = mic_channel + frames;
+            int16_t* resampled_mic = reference_channel + frames;
+            int16_t* resampled_reference = resampled_mic + resampled_frames;
+            for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
                 mic_channel[i] = data[j];
                 reference_channel[i] = data[j + 1];
             }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
+            input_resampler_.Process(mic_channel, frames, resampled_mic);
+            reference_resampler_.Process(reference_channel, frames, resampled_reference);
+            data.resize(resampled_frames * 2);
+            for (size_t i = 0, j = 0; i < resampled_frames; ++i, j += 2) {
                 data[j] = resampled_mic[i];
                 data[j + 1] = resampled_reference[i];
             }
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            input_scratch_.resize(input_resampler_.GetOutputSamples(data.size()));
+            input_resampler_.Process(data.data(), data.size(), input_scratch_.data());
+            data.assign(input_scratch_.begin(), input_scratch_.end());
         }
     } else {
         data.resize(samples * codec_->input_channels());
         if (!codec_->InputData(data)) {
             return false;
         }
+        input_block_capture_time_ = codec_->input_capture_time();
+        FeedAudioDebugger(kAudioDebugTapRawInput, data, codec_->input_sample_rate(), codec_->input_channels());
     }
 
     /* Update the last input time */
     last_input_time_ = std::chrono::steady_clock::now();
     debug_statistics_.input_count++;
 
-#if CONFIG_USE_AUDIO_DEBUGGER
-    // 音频调试：发送原始音频数据
-    if (audio_debugger_ == nullptr) {
-        audio_debugger_ = std::make_unique<AudioDebugger>();
+    if (codec_->input_sample_rate() != sample_rate) {
+        FeedAudioDebugger(kAudioDebugTapResampledInput, data, sample_rate, codec_->input_channels());
+    }
+#if CONFIG_USE_LATENCY_SELF_TEST
+    if (latency_capturing_) {
+        /* The raw mic channel, before the echo reference is aligned */
+        std::lock_guard<std::mutex> lock(latency_mutex_);
+        if (latency_capturing_ && sample_rate == latency_probe_.sample_rate()) {
+            latency_probe_.Capture(data.data(), data.size() / codec_->input_channels(), codec_->input_channels());
+            latency_blocks_.emplace_back(latency_probe_.captured(), esp_timer_get_time());
+            latency_capturing_ = !latency_probe_.full();
+        }
+    }
+#endif
+    if (codec_->input_reference() && codec_->input_channels() == 2) {
+        AlignEchoReference(data);
+    }
+    return true;
+}
+
+void AudioService::AlignEchoReference(std::vector<int16_t>& data) {
+#if CONFIG_USE_ECHO_DELAY_ESTIMATOR
+    /* Measure on the raw channels, so the estimate does not depend on the delay line */
+    if (echo_delay_estimator_.Feed(data)) {
+        int samples = echo_delay_estimator_.DelaySamples(16000) - ECHO_REFERENCE_LEAD_MS * 16;
+        if (abs(samples - echo_delay_samples_) >= ECHO_DELAY_UPDATE_MS * 16) {
+            ESP_LOGI(TAG, "Echo reference delay %.2f ms (coherence %.2f), delay line %d -> %d samples",
+                echo_delay_estimator_.delay_ms(), echo_delay_estimator_.coherence(), echo_delay_samples_, samples);
+            SetEchoDelayLine(samples);
+            echo_delay_us_ = lroundf(echo_delay_estimator_.delay_ms() * 1000);
+            echo_delay_need_save_ = true;
+        }
+    }
+
+    if (echo_delay_samples_ == 0) {
+        return;
     }
-    audio_debugger_->Feed(data);
+    int channel = echo_delay_samples_ > 0 ? 1 : 0;
+    size_t frames = data.size() / 2;
+    if (echo_delay_line_.capacity() < (size_t)abs(echo_delay_samples_) + frames) {
+        SetEchoDelayLine(echo_delay_samples_, frames);
+    }
+    // The line holds the delay, the block goes in and as much comes out
+    echo_delay_line_.Write(&data[channel], frames, 2);
+    echo_delay_line_.Read(&data[channel], frames, 2);
 #endif
+}
 
+void AudioService::SetEchoDelayLine(int samples, size_t block_frames) {
+    echo_delay_samples_ = samples;
+    echo_delay_line_.Configure(block_frames, abs(samples) + block_frames);
+    echo_delay_line_.WriteSilence(abs(samples));
+}
+
+bool AudioService::GetEchoReferenceDelay(float& delay_ms) const {
+    if (!echo_delay_estimator_.valid()) {
+        return false;
+    }
+    delay_ms = echo_delay_estimator_.delay_ms();
     return true;
 }
 
+void AudioService::PlayEchoChirp() {
+    /* A quiet linear sweep over the band the estimator looks at, with short fades */
+    const int sample_rate = codec_->output_sample_rate();
+    const int samples = sample_rate * ECHO_CHIRP_DURATION_MS / 1000;
+    const int fade = sample_rate / 100;
+    const float f0 = 300, f1 = 1800;
+    const float duration = ECHO_CHIRP_DURATION_MS / 1000.0f;
+    auto task = std::make_unique<AudioTask>();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    task->timestamp = 0;
+    task->priority = kAudioPlaybackPriorityHigh;
+    task->sample_rate = sample_rate;
+    task->pcm.resize(samples);
+    for (int i = 0; i < samples; i++) {
+        float t = (float)i / sample_rate;
+        float phase = 2 * M_PI * (f0 * t + (f1 - f0) * t * t / (2 * duration));
+        float gain = std::min(1.0f, (float)std::min(i, samples - 1 - i) / fade);
+        task->pcm[i] = (int16_t)(8000 * gain * sinf(phase));
+    }
+    ESP_LOGI(TAG, "Playing chirp to measure the echo reference delay");
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    PushTaskToPlaybackQueue(std::move(task));
+}
+
+void AudioService::FeedAudioDebugger(AudioDebugTap tap, const std::vector<int16_t>& data, int sample_rate, int channels) {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    // 音频调试：按采集点发送音频数据
+    if (audio_debugger_) {
+        audio_debugger_->Feed(tap, data, sample_rate, channels);
+    }
+#endif
+}
+
 void AudioService::AudioInputTask() {
     while (true) {
         EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
-            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING,
-            pdFALSE, pdFALSE, portMAX_DELAY);
+            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING | AS_EVENT_LATENCY_TEST_RUNNING |
+            AS_EVENT_INPUT_TAP_RUNNING, pdFALSE, pdFALSE, portMAX_DELAY);
 
         if (service_stopped_) {
             break;
@@ -221,64 +419,110 @@ void AudioService::AudioInputTask() {
             continue;
         }
 
+        /* Read one block for all the running consumers, sized for the wake word or the processor */
+        int samples = INPUT_BLOCK_MS * 16000 / 1000;
+        if ((bits & AS_EVENT_WAKE_WORD_RUNNING) && wake_word_->GetFeedSize() > 0) {
+            samples = wake_word_->GetFeedSize();
+        } else if ((bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) && audio_processor_->GetFeedSize() > 0) {
+            samples = audio_processor_->GetFeedSize();
+        }
+        if (!ReadAudioData(input_block_, 16000, samples)) {
+            ESP_LOGE(TAG, "Failed to read audio data, bits: %lx", bits);
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+        auto& frame = input_fanout_.Split(input_block_, codec_->input_channels(), codec_->input_reference(), 16000);
+
         /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
         if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
-                ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
-                EnableAudioTesting(false);
-                continue;
-            }
-            std::vector<int16_t> data;
-            int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
-            if (ReadAudioData(data, 16000, samples)) {
-                // If input channels is 2, we need to fetch the left channel data
-                if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
+            input_fanout_.Deliver(kInputConsumerTesting, kAudioInputViewMic, OPUS_FRAME_DURATION_MS * 16000 / 1000,
+                [this](const AudioSpan& data) {
+                    if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
+                        ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
+                        EnableAudioTesting(false);
+                        return;
                     }
-                    data = std::move(mono_data);
-                }
-                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
-                continue;
-            }
+                    PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::vector<int16_t>(data.begin(), data.end()));
+                });
+        } else {
+            input_fanout_.Reset(kInputConsumerTesting);
         }
 
         /* Feed the wake word */
         if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-            std::vector<int16_t> data;
-            int samples = wake_word_->GetFeedSize();
-            if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
+            input_fanout_.Deliver(kInputConsumerWakeWord, wake_word_->GetFeedView(), wake_word_->GetFeedSize(),
+                [this](const AudioSpan& data) {
                     wake_word_->Feed(data);
-                    continue;
-                }
-            }
+                });
+        } else {
+            input_fanout_.Reset(kInputConsumerWakeWord);
         }
 
         /* Feed the audio processor */
         if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
-            std::vector<int16_t> data;
-            int samples = audio_processor_->GetFeedSize();
-            if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    audio_processor_->Feed(std::move(data));
-                    continue;
-                }
-            }
+            input_fanout_.Deliver(kInputConsumerProcessor, audio_processor_->GetFeedView(), audio_processor_->GetFeedSize(),
+                [this](const AudioSpan& data) {
+#if CONFIG_USE_SERVER_AEC
+                    /* The samples held back for the next chunk were captured after this one */
+                    int64_t capture_time = input_block_capture_time_;
+                    if (capture_time != 0) {
+                        auto& block = input_fanout_.frame();
+                        size_t held = input_fanout_.buffered(kInputConsumerProcessor);
+                        if (audio_processor_->GetFeedView() == kAudioInputViewInterleaved) {
+                            held /= block.channels;
+                        }
+                        capture_time -= (int64_t)held * 1000000 / block.sample_rate;
+                    }
+                    RecordCaptureTimestamp(audio_processor_->GetFeedSize(), capture_time);
+#endif
+                    audio_processor_->Feed(data);
+                });
+        } else {
+            input_fanout_.Reset(kInputConsumerProcessor);
         }
 
-        ESP_LOGE(TAG, "Should not be here, bits: %lx", bits);
-        break;
+        /* Acoustic provisioning and other taps take the block as read */
+        if (bits & AS_EVENT_INPUT_TAP_RUNNING) {
+            std::lock_guard<std::mutex> lock(input_tap_mutex_);
+            if (input_tap_) {
+                input_tap_(frame);
+            }
+        }
     }
 
     ESP_LOGW(TAG, "Audio input task stopped");
 }
 
+void AudioService::SetInputTap(std::function<void(const AudioInputFrame& frame)> tap) {
+    std::lock_guard<std::mutex> lock(input_tap_mutex_);
+    input_tap_ = std::move(tap);
+    if (input_tap_) {
+        xEventGroupSetBits(event_group_, AS_EVENT_INPUT_TAP_RUNNING);
+    } else {
+        xEventGroupClearBits(event_group_, AS_EVENT_INPUT_TAP_RUNNING);
+    }
+}
+
 void AudioService::AudioOutputTask() {
     while (true) {
         std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
+        auto has_task = [this]() { return !audio_playback_queue_.empty() || service_stopped_; };
+#if CONFIG_USE_GAPLESS_PLAYBACK
+        if (segment_joiner_.holding()) {
+            /* Wait for the next frame as long as the output has something to play, then fade out */
+            int queued_ms = codec_->dma_desc_num() * codec_->dma_frame_num() * 1000 / codec_->output_sample_rate();
+            if (codec_->output_position_tracked()) {
+                queued_ms = (codec_->output_frames_written() - codec_->output_frames_played()) * 1000 / codec_->output_sample_rate();
+            }
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(queued_ms - SEGMENT_JOINER_GUARD_MS);
+            if (!audio_queue_cv_.wait_until(lock, deadline, has_task)) {
+                lock.unlock();
+                WriteHeldTail();
+                continue;
+            }
+        }
+#endif
+        audio_queue_cv_.wait(lock, has_task);
         if (service_stopped_) {
             break;
         }
@@ -288,65 +532,176 @@ void AudioService::AudioOutputTask() {
         audio_queue_cv_.notify_all();
         lock.unlock();
 
+#if CONFIG_USE_GAPLESS_PLAYBACK
+        /* The tail belongs to the old format, and the probe must start where it is written */
+        if (segment_joiner_.holding() && (task->sample_rate != codec_->output_sample_rate() ||
+                (task->channels == 2 && codec_->output_channels() == 1) || task->latency_probe)) {
+            WriteHeldTail();
+        }
+#endif
         if (!codec_->output_enabled()) {
             esp_timer_stop(audio_power_timer_);
             esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
             codec_->EnableOutput(true);
         }
-        codec_->OutputData(task->pcm);
+        if (task->sample_rate != codec_->output_sample_rate() && !codec_->SetOutputSampleRate(task->sample_rate)) {
+            ESP_LOGE(TAG, "Failed to switch the output to %d Hz", task->sample_rate);
+        }
+        if (task->channels == 2 && codec_->output_channels() == 1 && !codec_->SetOutputChannels(2)) {
+            // The second speaker went away after the frame was decoded
+            for (size_t i = 0; i < task->pcm.size() / 2; ++i) {
+                task->pcm[i] = (task->pcm[i * 2] + task->pcm[i * 2 + 1]) / 2;
+            }
+            task->pcm.resize(task->pcm.size() / 2);
+            task->channels = 1;
+        }
+        if (task->channels == 1 && codec_->output_channels() == 2) {
+            // The output stays stereo after music, play mono frames on both speakers
+            std::vector<int16_t> stereo(task->pcm.size() * 2);
+            for (size_t i = 0, j = 0; i < task->pcm.size(); ++i, j += 2) {
+                stereo[j] = stereo[j + 1] = task->pcm[i];
+            }
+            task->pcm = std::move(stereo);
+        }
+        FeedAudioDebugger(kAudioDebugTapSpeakerOutput, task->pcm, codec_->output_sample_rate(), codec_->output_channels());
+        uint32_t start_frame = codec_->output_frames_written();
+#if CONFIG_USE_SERVER_AEC
+        uint32_t frames = task->pcm.size() / codec_->output_channels();
+#endif
+#if CONFIG_USE_GAPLESS_PLAYBACK
+        if (!task->pcm.empty() && !task->latency_probe) {
+            segment_joiner_.Configure(codec_->output_sample_rate(), codec_->output_channels());
+            start_frame += segment_joiner_.Join(task->pcm);
+        }
+#endif
+#if CONFIG_USE_LATENCY_SELF_TEST
+        if (task->latency_probe) {
+            std::lock_guard<std::mutex> guard(latency_mutex_);
+            latency_write_time_ = esp_timer_get_time();
+            latency_output_queued_frames_ = codec_->output_position_tracked() ? start_frame - codec_->output_frames_played() :
+                codec_->dma_desc_num() * codec_->dma_frame_num();
+        }
+#endif
+        if (!task->pcm.empty()) {
+            codec_->OutputData(task->pcm);
+            CheckOutputUnderrun();
+            // The tail held after the last frame of a sound went out in front of this one
+            RunHeldTailCallbacks();
+        }
+        if (task->on_complete) {
+            if (segment_joiner_.holding()) {
+                held_tail_callbacks_.push_back(std::move(task->on_complete));
+            } else {
+                task->on_complete();
+            }
+        }
 
         /* Update the last output time */
         last_output_time_ = std::chrono::steady_clock::now();
         debug_statistics_.playback_count++;
 
+        lock.lock();
+        /* Nothing left to play, the silence until the next stream is not an underrun */
+        if (audio_playback_queue_.empty() && audio_decode_queue_.empty() && audio_sound_queue_.empty()) {
+            codec_->EndOutputStream();
+        }
 #if CONFIG_USE_SERVER_AEC
-        /* Record the timestamp for server AEC */
+        /* Record where the frame lands on the output timeline for server AEC */
         if (task->timestamp > 0) {
-            lock.lock();
-            timestamp_queue_.push_back(task->timestamp);
+            if (playback_timeline_.full()) {
+                playback_timeline_.pop_front();
+            }
+            playback_timeline_.push_back(PlaybackTimelineEntry{
+                .timestamp = task->timestamp,
+                .start_frame = start_frame,
+                .frames = frames,
+            });
         }
 #endif
     }
 
+    // The held tail is never written, its waiters must not hang
+    RunHeldTailCallbacks();
     ESP_LOGW(TAG, "Audio output task stopped");
 }
 
 void AudioService::OpusCodecTask() {
     while (true) {
         std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
+        auto can_work = [this]() {
             return service_stopped_ ||
                 (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
+                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE && IsDecodePrefetched()) ||
+                (CanDecodeSound() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) ||
+                (time_stretch_flush_pending_ && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
+        };
+        if (decode_prefetching_ && !audio_decode_queue_.empty()) {
+            /* Nothing is pushed when the prefetch times out, look again */
+            if (!audio_queue_cv_.wait_for(lock, std::chrono::milliseconds(GAPLESS_PREFETCH_TIMEOUT_MS / 4), can_work)) {
+                continue;
+            }
+        } else {
+            audio_queue_cv_.wait(lock, [this, &can_work]() {
+                return can_work() || (decode_prefetching_ && !audio_decode_queue_.empty());
+            });
+        }
         if (service_stopped_) {
             break;
         }
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
+        /* Decode the sound lane, it pauses the conversation while allowed to play */
+        if (CanDecodeSound() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
+            DecodeSound(lock);
+        } else if (time_stretch_flush_pending_ && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
+            FlushTimeStretch(lock);
+        } else if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE &&
+                IsDecodePrefetched()) {
+            /* Decode the audio from decode queue */
+            DownlinkFlowEvent event;
+            bool segment_end = false;
+            auto packet = audio_decode_queue_.Pop(event, &segment_end);
+            int buffered_ms = audio_decode_queue_.depth_ms();
+            bool stream_started = decode_stream_started_;
+            MoveTestingPacketsToDecodeQueue();
             audio_queue_cv_.notify_all();
             lock.unlock();
+            NotifyDownlinkFlow(event);
 
             auto task = std::make_unique<AudioTask>();
             task->type = kAudioTaskTypeDecodeToPlaybackQueue;
             task->timestamp = packet->timestamp;
 
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
+            SetDecodeSampleRate(packet->sample_rate, packet->channels, packet->frame_duration, stream_started);
             if (opus_decoder_->Decode(std::move(packet->payload), task->pcm)) {
-                // Resample if the sample rate is different
-                if (opus_decoder_->sample_rate() != codec_->output_sample_rate()) {
-                    int target_size = output_resampler_.GetOutputSamples(task->pcm.size());
-                    std::vector<int16_t> resampled(target_size);
-                    output_resampler_.Process(task->pcm.data(), task->pcm.size(), resampled.data());
-                    task->pcm = std::move(resampled);
+                FeedAudioDebugger(kAudioDebugTapDecodedOutput, task->pcm, opus_decoder_->sample_rate(), decode_channels_);
+                task->channels = decode_channels_;
+                if (task->channels == 2 && codec_->max_output_channels() < 2) {
+                    // Fold stereo down before resampling, a mono speaker cannot use it
+                    for (size_t i = 0; i < task->pcm.size() / 2; ++i) {
+                        task->pcm[i] = (task->pcm[i * 2] + task->pcm[i * 2 + 1]) / 2;
+                    }
+                    task->pcm.resize(task->pcm.size() / 2);
+                    task->channels = 1;
+                }
+                // Resample if the output cannot run at the stream rate
+                task->sample_rate = playback_sample_rate_;
+                if (opus_decoder_->sample_rate() != playback_sample_rate_) {
+                    if (task->channels == 2) {
+                        ResampleStereoOutput(task->pcm);
+                    } else {
+                        decode_scratch_.resize(output_resampler_.GetOutputSamples(task->pcm.size()));
+                        output_resampler_.Process(task->pcm.data(), task->pcm.size(), decode_scratch_.data());
+                        task->pcm.assign(decode_scratch_.begin(), decode_scratch_.end());
+                    }
+                }
+                // The voice DSP is tuned for mono speech, music is played as mastered
+                if (task->channels == 1) {
+                    ProcessTimeStretch(task->pcm, buffered_ms, segment_end);
+                    ProcessPlaybackDsp(task->pcm);
                 }
-
                 lock.lock();
-                audio_playback_queue_.push_back(std::move(task));
-                audio_queue_cv_.notify_all();
+                decode_stream_started_ = true;
+                PushTaskToPlaybackQueue(std::move(task));
             } else {
                 ESP_LOGE(TAG, "Failed to decode audio");
                 lock.lock();
@@ -365,10 +720,16 @@ void AudioService::OpusCodecTask() {
             packet->frame_duration = OPUS_FRAME_DURATION_MS;
             packet->sample_rate = 16000;
             packet->timestamp = task->timestamp;
+            auto start_time = esp_timer_get_time();
             if (!opus_encoder_->Encode(std::move(task->pcm), packet->payload)) {
                 ESP_LOGE(TAG, "Failed to encode audio");
                 continue;
             }
+#if CONFIG_USE_OPUS_COMPLEXITY_CONTROLLER
+            if (opus_complexity_controller_.OnFrameEncoded(esp_timer_get_time() - start_time)) {
+                opus_encoder_->SetComplexity(opus_complexity_controller_.complexity());
+            }
+#endif
 
             if (task->type == kAudioTaskTypeEncodeToSendQueue) {
                 {
@@ -390,18 +751,322 @@ void AudioService::OpusCodecTask() {
     ESP_LOGW(TAG, "Opus codec task stopped");
 }
 
-void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
+void AudioService::SetDecodeSampleRate(int sample_rate, int channels, int frame_duration, bool stream_started) {
+    if (opus_decoder_->sample_rate() == sample_rate && decode_channels_ == channels &&
+        opus_decoder_->duration_ms() == frame_duration) {
         return;
     }
+#if CONFIG_USE_GAPLESS_PLAYBACK
+    /* Opus decodes to any rate. Within a turn a new rate would restart the decoder and
+       reclock the output between two sentences, keep both as they are */
+    if (stream_started && decode_channels_ == channels && opus_decoder_->duration_ms() == frame_duration) {
+        return;
+    }
+#endif
 
     opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, channels, frame_duration);
+    decode_channels_ = channels;
+
+    /* Play at the stream rate if the codec can, resampling costs CPU on every frame */
+    if (codec_->SupportsOutputSampleRate(sample_rate)) {
+        SetPlaybackSampleRate(sample_rate);
+    } else {
+        SetPlaybackSampleRate(codec_->output_sample_rate());
+    }
+    if (opus_decoder_->sample_rate() != playback_sample_rate_) {
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), playback_sample_rate_);
+        output_resampler_.Configure(opus_decoder_->sample_rate(), playback_sample_rate_);
+        if (channels == 2) {
+            output_resampler_right_.Configure(opus_decoder_->sample_rate(), playback_sample_rate_);
+        }
+    }
+}
+
+/* The playback DSP runs at the rate of the frames, redesign it when that changes */
+void AudioService::SetPlaybackSampleRate(int sample_rate) {
+    if (sample_rate == playback_sample_rate_) {
+        return;
+    }
+    ESP_LOGI(TAG, "Playback sample rate %d -> %d", playback_sample_rate_, sample_rate);
+    playback_sample_rate_ = sample_rate;
+    std::string eq = playback_eq_.description();
+    playback_eq_.Configure(eq, sample_rate);
+    loudness_limiter_.Configure(sample_rate);
+    time_stretcher_.Configure(sample_rate);
+    playback_catching_up_ = false;
+}
+
+void AudioService::ResampleStereoOutput(std::vector<int16_t>& pcm) {
+    // Scratch layout: left, right, resampled left, resampled right
+    size_t frames = pcm.size() / 2;
+    size_t resampled_frames = output_resampler_.GetOutputSamples(frames);
+    decode_scratch_.resize(frames * 2 + resampled_frames * 2);
+    int16_t* left = decode_scratch_.data();
+    int16_t* right = left + frames;
+    int16_t* resampled_left = right + frames;
+    int16_t* resampled_right = resampled_left + resampled_frames;
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        left[i] = pcm[j];
+        right[i] = pcm[j + 1];
+    }
+    output_resampler_.Process(left, frames, resampled_left);
+    output_resampler_right_.Process(right, frames, resampled_right);
+    pcm.resize(resampled_frames * 2);
+    for (size_t i = 0, j = 0; i < resampled_frames; ++i, j += 2) {
+        pcm[j] = resampled_left[i];
+        pcm[j + 1] = resampled_right[i];
+    }
+}
+
+bool AudioService::CanDecodeSound() {
+    if (audio_sound_queue_.empty()) {
+        return false;
+    }
+    // A started sound is always finished, a normal one waits for the conversation lane to drain
+    auto& sound = audio_sound_queue_.front();
+    return sound->priority == kAudioPlaybackPriorityHigh || sound->started || audio_decode_queue_.empty();
+}
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
-        output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+/* After a gap the next segment waits until GAPLESS_PREFETCH_MS is buffered, or its first packet is that old */
+bool AudioService::IsDecodePrefetched() {
+#if CONFIG_USE_GAPLESS_PLAYBACK
+    if (!decode_prefetching_ || audio_decode_queue_.empty()) {
+        return !decode_prefetching_;
+    }
+    int64_t now = esp_timer_get_time();
+    if (decode_prefetch_start_time_ == 0) {
+        decode_prefetch_start_time_ = now;
+    }
+    if (audio_decode_queue_.depth_ms() < GAPLESS_PREFETCH_MS &&
+            now - decode_prefetch_start_time_ < GAPLESS_PREFETCH_TIMEOUT_MS * 1000) {
+        return false;
+    }
+    ESP_LOGD(TAG, "Prefetched %lu ms after a gap", audio_decode_queue_.depth_ms());
+    decode_prefetching_ = false;
+#endif
+    return true;
+}
+
+/* The output is about to run dry, write the held tail faded out */
+void AudioService::WriteHeldTail() {
+    if (!segment_joiner_.TakeFadedTail(output_tail_)) {
+        RunHeldTailCallbacks();
+        return;
+    }
+    codec_->OutputData(output_tail_);
+    last_output_time_ = std::chrono::steady_clock::now();
+    RunHeldTailCallbacks();
+
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    if (audio_playback_queue_.empty() && audio_decode_queue_.empty()) {
+        /* A gap in the conversation, buffer the start of the next segment before playing it */
+        if (decode_stream_started_) {
+            decode_prefetching_ = true;
+            decode_prefetch_start_time_ = 0;
+        }
+        if (audio_sound_queue_.empty()) {
+            codec_->EndOutputStream();
+        }
+    }
+}
+
+/* The on_complete callbacks of sounds whose tail was held by the segment joiner, in the output task */
+void AudioService::RunHeldTailCallbacks() {
+    for (auto& callback : held_tail_callbacks_) {
+        callback();
+    }
+    held_tail_callbacks_.clear();
+}
+
+void AudioService::DecodeSound(std::unique_lock<std::mutex>& lock) {
+    auto& sound = audio_sound_queue_.front();
+    bool first_packet = !sound->started;
+    sound->started = true;
+    if (!sound->ogg.empty()) {
+        // Only the sound at the front holds its packets, a long playlist costs one sound
+        if (ParseOggSound(sound->ogg, sound->packets) && sound->packets.size() > MAX_SOUND_PACKETS_IN_QUEUE) {
+            ESP_LOGW(TAG, "Sound of %u packets is too long, skip it", sound->packets.size());
+            sound->packets.clear();
+        }
+        sound->ogg = std::string_view();
+        if (sound->packets.empty()) {
+            // Nothing to play, the empty frame still carries the completion of the playlist
+            sound->packets.push_back(std::make_unique<AudioStreamPacket>());
+        }
+    }
+    auto packet = std::move(sound->packets.front());
+    sound->packets.pop_front();
+
+    auto task = std::make_unique<AudioTask>();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    task->timestamp = 0;
+    task->priority = sound->priority;
+    task->sample_rate = playback_sample_rate_;
+    if (sound->packets.empty()) {
+        if (sound->last) {
+            task->on_complete = [completion = sound->completion]() {
+                completion->Finish(kSoundPlayed);
+            };
+        }
+        audio_sound_queue_.pop_front();
+    }
+    audio_queue_cv_.notify_all();
+    lock.unlock();
+
+    if (packet->payload.empty()) {
+        // A silence of the playlist, it does not touch the decoder
+        task->pcm.assign(playback_sample_rate_ * packet->frame_duration / 1000, 0);
+        lock.lock();
+        PushTaskToPlaybackQueue(std::move(task));
+        return;
+    }
+
+    /* Sounds use their own decoder, so a paused conversation resumes without artifacts */
+    if (!sound_decoder_ || sound_decoder_->sample_rate() != packet->sample_rate ||
+        sound_decoder_->duration_ms() != packet->frame_duration) {
+        sound_decoder_ = std::make_unique<OpusDecoderWrapper>(packet->sample_rate, 1, packet->frame_duration);
+        sound_output_sample_rate_ = 0;
+    } else if (first_packet) {
+        sound_decoder_->ResetState();
+    }
+    /* Sounds follow the conversation rate, so the output is not reclocked between them */
+    if (sound_output_sample_rate_ != playback_sample_rate_) {
+        sound_output_sample_rate_ = playback_sample_rate_;
+        if (sound_decoder_->sample_rate() != sound_output_sample_rate_) {
+            sound_resampler_.Configure(sound_decoder_->sample_rate(), sound_output_sample_rate_);
+        }
+    }
+
+    if (sound_decoder_->Decode(std::move(packet->payload), task->pcm)) {
+        FeedAudioDebugger(kAudioDebugTapDecodedOutput, task->pcm, sound_decoder_->sample_rate(), 1);
+        if (sound_decoder_->sample_rate() != sound_output_sample_rate_) {
+            decode_scratch_.resize(sound_resampler_.GetOutputSamples(task->pcm.size()));
+            sound_resampler_.Process(task->pcm.data(), task->pcm.size(), decode_scratch_.data());
+            task->pcm.assign(decode_scratch_.begin(), decode_scratch_.end());
+        }
+        ProcessPlaybackDsp(task->pcm);
+    } else {
+        // Still queue the empty task, it may carry the completion callback
+        ESP_LOGE(TAG, "Failed to decode sound");
+        task->pcm.clear();
+    }
+    debug_statistics_.decode_count++;
+
+    lock.lock();
+    PushTaskToPlaybackQueue(std::move(task));
+}
+
+void AudioService::PushTaskToPlaybackQueue(std::unique_ptr<AudioTask> task) {
+    // High priority frames jump ahead of the queued conversation, but stay in order among themselves
+    size_t index = audio_playback_queue_.size();
+    if (task->priority == kAudioPlaybackPriorityHigh) {
+        while (index > 0 && audio_playback_queue_[index - 1]->priority != kAudioPlaybackPriorityHigh) {
+            --index;
+        }
+    }
+    if (!audio_playback_queue_.insert(index, std::move(task))) {
+        ESP_LOGW(TAG, "Playback queue full, frame dropped");
+        return;
+    }
+    audio_queue_cv_.notify_all();
+}
+
+void AudioService::ProcessPlaybackDsp(std::vector<int16_t>& pcm) {
+    if (pcm.empty()) {
+        return;
+    }
+    if (playback_dsp_need_reset_) {
+        playback_dsp_need_reset_ = false;
+        playback_eq_.Reset();
+        loudness_limiter_.Reset();
+    }
+
+    auto start_time = esp_timer_get_time();
+
+    /* EQ first, so the limiter catches the peaks it adds */
+    if (playback_eq_.enabled()) {
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
+        playback_eq_.Process(pcm);
+        uint32_t cycles = (esp_cpu_get_cycle_count() - start_cycles) / pcm.size();
+        if (cycles > debug_statistics_.playback_eq_max_cycles) {
+            debug_statistics_.playback_eq_max_cycles = cycles;
+            ESP_LOGD(TAG, "Playback EQ takes %lu cycles per sample with %d bands", cycles, playback_eq_.band_count());
+        }
+    }
+
+#if CONFIG_USE_PLAYBACK_LOUDNESS_LIMITER
+    loudness_limiter_.Process(pcm);
+#endif
+
+    uint32_t elapsed_us = esp_timer_get_time() - start_time;
+    if (elapsed_us > debug_statistics_.playback_dsp_max_us) {
+        debug_statistics_.playback_dsp_max_us = elapsed_us;
+        ESP_LOGD(TAG, "Playback DSP takes %lu us for %u samples", elapsed_us, pcm.size());
+    }
+}
+
+void AudioService::ProcessTimeStretch(std::vector<int16_t>& pcm, int buffered_ms, bool flush) {
+#if CONFIG_USE_PLAYBACK_TIME_STRETCH
+    if (time_stretch_need_reset_) {
+        time_stretch_need_reset_ = false;
+        time_stretcher_.Reset();
+        playback_catching_up_ = false;
+    }
+
+    if (!playback_catching_up_ && !downlink_burst_ && buffered_ms >= PLAYBACK_CATCHUP_START_MS) {
+        playback_catching_up_ = true;
+        ESP_LOGI(TAG, "Catching up with %d ms of buffered audio", buffered_ms);
+    } else if (playback_catching_up_ && buffered_ms <= PLAYBACK_CATCHUP_STOP_MS) {
+        playback_catching_up_ = false;
+        ESP_LOGI(TAG, "Caught up, %d ms of buffered audio", buffered_ms);
+    }
+    int speed = speaking_speed_;
+    if (playback_catching_up_) {
+        speed = speed * PLAYBACK_CATCHUP_SPEEDUP_PERCENT / 100;
+    }
+
+    // Stay out of the way at the original speed, the stretcher would only add latency
+    if (speed == 100 && time_stretcher_.empty()) {
+        return;
+    }
+
+    auto start_time = esp_timer_get_time();
+    time_stretcher_.SetSpeed(speed);
+    std::vector<int16_t> output;
+    output.reserve(pcm.size() * 100 / TIME_STRETCH_MIN_SPEED);
+    time_stretcher_.Process(pcm, output);
+    if (flush) {
+        // The sentence or the turn ended, play out what is left so its end is not held back.
+        // A queue that only runs dry keeps the state, flushing there would play the tail at 100%
+        time_stretcher_.Flush(output);
+    }
+    pcm = std::move(output);
+
+    uint32_t elapsed_us = esp_timer_get_time() - start_time;
+    if (elapsed_us > debug_statistics_.time_stretch_max_us) {
+        debug_statistics_.time_stretch_max_us = elapsed_us;
+        ESP_LOGD(TAG, "Time stretch takes %lu us at %d%% speed", elapsed_us, speed);
+    }
+#endif
+}
+
+/* The segment ended after its last packet was decoded, play out the tail on its own */
+void AudioService::FlushTimeStretch(std::unique_lock<std::mutex>& lock) {
+    time_stretch_flush_pending_ = false;
+    int buffered_ms = audio_decode_queue_.depth_ms();
+    lock.unlock();
+
+    auto task = std::make_unique<AudioTask>();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    task->timestamp = 0;
+    task->sample_rate = playback_sample_rate_;
+    ProcessTimeStretch(task->pcm, buffered_ms, true);
+    ProcessPlaybackDsp(task->pcm);
+
+    lock.lock();
+    if (!task->pcm.empty()) {
+        PushTaskToPlaybackQueue(std::move(task));
     }
 }
 
@@ -414,13 +1079,11 @@ void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t
     std::unique_lock<std::mutex> lock(audio_queue_mutex_);
 
     /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
-        }
-        timestamp_queue_.pop_front();
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+#if CONFIG_USE_SERVER_AEC
+        task->timestamp = GetCaptureTimestamp(encode_samples_);
+#endif
+        encode_samples_ += task->pcm.size();
     }
 
     audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
@@ -429,19 +1092,147 @@ void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
+    DownlinkFlowEvent event;
+    {
+        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
         if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
+            audio_queue_cv_.wait(lock, [this, &packet]() {
+                return service_stopped_ || audio_decode_queue_.CanPush(*packet);
+            });
+        }
+        if (!audio_decode_queue_.Push(packet, event)) {
+            audio_decode_queue_.CountDropped(packet->frame_duration);
             return false;
         }
+        audio_queue_cv_.notify_all();
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
+    NotifyDownlinkFlow(event);
+    ReportDownlinkOccupancy();
+    return true;
+}
+
+bool AudioService::PushPacketsToDecodeQueue(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    DownlinkFlowEvent flow = kDownlinkFlowNone;
+    {
+        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+        if (!audio_decode_queue_.CanPushAll(packets)) {
+            return false;
+        }
+        for (auto& packet : packets) {
+            DownlinkFlowEvent event;
+            audio_decode_queue_.Push(packet, event);
+            if (event != kDownlinkFlowNone) {
+                flow = event;
+            }
+        }
+        // A cached phrase is a whole sentence
+        audio_decode_queue_.MarkSegmentEnd();
+        audio_queue_cv_.notify_all();
+    }
+    NotifyDownlinkFlow(flow);
     return true;
 }
 
+void AudioService::MarkDownlinkSegmentEnd() {
+#if CONFIG_USE_PLAYBACK_TIME_STRETCH
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    if (!audio_decode_queue_.MarkSegmentEnd()) {
+        time_stretch_flush_pending_ = true;
+        audio_queue_cv_.notify_all();
+    }
+#endif
+}
+
+void AudioService::NotifyDownlinkFlow(DownlinkFlowEvent event) {
+    if (event == kDownlinkFlowNone) {
+        return;
+    }
+    ESP_LOGI(TAG, "Downlink buffer at %lu ms, %s the server", audio_decode_queue_.depth_ms(),
+        event == kDownlinkFlowPause ? "pausing" : "resuming");
+    if (callbacks_.on_downlink_flow_change) {
+        callbacks_.on_downlink_flow_change(event == kDownlinkFlowPause);
+    }
+}
+
+void AudioService::ReportDownlinkOccupancy() {
+    DownlinkOccupancy report;
+    {
+        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+        if (!audio_decode_queue_.GetOccupancyReport(report)) {
+            return;
+        }
+    }
+    ESP_LOGI(TAG, "Downlink buffer min %lu / avg %lu / max %lu ms of %lu, received %lu ms, dropped %lu ms, %lu pauses, copied %lu bytes per second of audio",
+        report.min_ms, report.average_ms, report.max_ms, audio_decode_queue_.capacity_ms(),
+        report.received_ms, report.dropped_ms, report.pauses,
+        report.received_ms > 0 ? (uint32_t)((uint64_t)report.copied_bytes * 1000 / report.received_ms) : 0);
+}
+
+void AudioService::PrintStackHighWaterMarks() {
+    // On ESP-IDF the high water mark is in bytes, the stacks are sized from the smallest one seen
+    const TaskHandle_t tasks[] = { audio_input_task_handle_, audio_output_task_handle_, opus_codec_task_handle_ };
+    const int sizes[] = { AUDIO_INPUT_TASK_STACK_SIZE, AUDIO_OUTPUT_TASK_STACK_SIZE, OPUS_CODEC_TASK_STACK_SIZE };
+    for (int i = 0; i < 3; i++) {
+        if (tasks[i] != nullptr) {
+            ESP_LOGI(TAG, "Stack of %s: %u of %d bytes never used", pcTaskGetName(tasks[i]),
+                uxTaskGetStackHighWaterMark(tasks[i]), sizes[i]);
+        }
+    }
+}
+
+void AudioService::RecoverFromInputOverrun(const I2sHealth& health) {
+    int64_t now = esp_timer_get_time();
+    if (now - overrun_log_time_ >= I2S_HEALTH_LOG_INTERVAL_MS * 1000) {
+        overrun_log_time_ = now;
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_input_time_).count();
+        ESP_LOGW(TAG, "I2S RX overrun, %lu this session (%lu ms lost), last read %lld ms ago, input bits %lx, %u stack bytes unused",
+            health.rx_overruns, health.rx_frames_lost * 1000 / codec_->input_sample_rate(), elapsed,
+            xEventGroupGetBits(event_group_) & (AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING |
+                AS_EVENT_AUDIO_PROCESSOR_RUNNING | AS_EVENT_LATENCY_TEST_RUNNING),
+            uxTaskGetStackHighWaterMark(nullptr));
+    }
+    /* The DMA buffers hold the oldest frames left, one gap now is better than a hole at every buffer that follows */
+    codec_->ResyncInput();
+}
+
+void AudioService::CheckOutputUnderrun() {
+    I2sHealth health = codec_->GetI2sHealth();
+    if (health.tx_underruns == tx_underruns_seen_) {
+        return;
+    }
+    bool underrun = health.tx_underruns > tx_underruns_seen_;
+    tx_underruns_seen_ = health.tx_underruns;
+    int64_t now = esp_timer_get_time();
+    if (!underrun || now - underrun_log_time_ < I2S_HEALTH_LOG_INTERVAL_MS * 1000) {
+        return;
+    }
+    underrun_log_time_ = now;
+
+    /* The codec task decodes what this task plays, it is the one that fell behind */
+    static const char* const states[] = { "running", "ready", "blocked", "suspended", "deleted", "invalid" };
+    eTaskState state = eTaskGetState(opus_codec_task_handle_);
+    size_t packets, tasks;
+    {
+        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+        packets = audio_decode_queue_.size();
+        tasks = audio_playback_queue_.size();
+    }
+    ESP_LOGW(TAG, "I2S TX underrun, %lu this session (%lu ms of silence), %u packets to decode, %u frames to play, %s %s with %u stack bytes unused",
+        health.tx_underruns, health.tx_frames_starved * 1000 / codec_->output_sample_rate(), packets, tasks,
+        pcTaskGetName(opus_codec_task_handle_), states[state], uxTaskGetStackHighWaterMark(opus_codec_task_handle_));
+}
+
+void AudioService::MoveTestingPacketsToDecodeQueue() {
+    // The recording may be longer than the buffer, it is moved over as the decoder makes room
+    if (xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_TESTING_RUNNING) {
+        return;
+    }
+    DownlinkFlowEvent event;
+    while (!audio_testing_queue_.empty() && audio_decode_queue_.Push(audio_testing_queue_.front(), event)) {
+        audio_testing_queue_.pop_front();
+    }
+}
+
 std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
     std::lock_guard<std::mutex> lock(audio_queue_mutex_);
     if (audio_send_queue_.empty()) {
@@ -487,6 +1278,13 @@ void AudioService::EnableWakeWordDetection(bool enable) {
         }
         wake_word_->Start();
         xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+#if CONFIG_USE_ECHO_DELAY_ESTIMATOR
+        /* Measure the echo delay once the input runs, if no estimate was saved */
+        if (codec_->input_reference() && !echo_delay_estimator_.valid() && !echo_chirp_played_) {
+            echo_chirp_played_ = true;
+            PlayEchoChirp();
+        }
+#endif
     } else {
         wake_word_->Stop();
         xEventGroupClearBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
@@ -503,24 +1301,71 @@ void AudioService::EnableVoiceProcessing(bool enable) {
 
         /* We should make sure no audio is playing */
         ResetDecoder();
+        {
+            /* The processor output restarts at sample 0 of the capture timeline */
+            std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+            capture_timeline_.clear();
+            capture_samples_ = 0;
+            encode_samples_ = 0;
+        }
+        UpdateDmaGeometry(true);
         audio_input_need_warmup_ = true;
         audio_processor_->Start();
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     } else {
         audio_processor_->Stop();
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+        UpdateDmaGeometry(false);
     }
 }
 
+void AudioService::EnableEndOfSpeechDetection(bool enable, bool shadow) {
+#if CONFIG_USE_END_OF_SPEECH_DETECTION
+    end_of_speech_shadow_ = shadow;
+    end_of_speech_need_reset_ = true;
+    end_of_speech_enabled_ = enable;
+#endif
+}
+
+void AudioService::UpdateDmaGeometry(bool realtime) {
+    /* Report the interrupt rate of the geometry that is being left */
+    int64_t now = esp_timer_get_time();
+    uint32_t interrupts = codec_->dma_interrupts();
+    if (dma_mode_start_time_ > 0 && now - dma_mode_start_time_ >= 1000000) {
+        ESP_LOGI(TAG, "DMA %d x %d frames: %lu interrupts/s over %lld s",
+            codec_->dma_desc_num(), codec_->dma_frame_num(),
+            (uint32_t)((uint64_t)(interrupts - dma_mode_start_interrupts_) * 1000000 / (now - dma_mode_start_time_)),
+            (now - dma_mode_start_time_) / 1000000);
+    }
+
+#if CONFIG_USE_ADAPTIVE_I2S_DMA
+    int desc_num = realtime ? REALTIME_DMA_DESC_NUM : IDLE_DMA_DESC_NUM;
+    int frame_num = realtime ? REALTIME_DMA_FRAME_NUM : IDLE_DMA_FRAME_NUM;
+    if (desc_num != codec_->dma_desc_num() || frame_num != codec_->dma_frame_num()) {
+        if (codec_->SetDmaGeometry(desc_num, frame_num)) {
+            /* A read waits for one buffer, a write for the whole ring once it is full */
+            ESP_LOGI(TAG, "%s DMA geometry, input %d ms, output %d ms, %d ms round trip",
+                realtime ? "Realtime" : "Idle",
+                frame_num * 1000 / codec_->input_sample_rate(),
+                desc_num * frame_num * 1000 / codec_->output_sample_rate(),
+                frame_num * 1000 / codec_->input_sample_rate() + desc_num * frame_num * 1000 / codec_->output_sample_rate());
+        }
+        interrupts = codec_->dma_interrupts();
+    }
+#endif
+    dma_mode_start_time_ = esp_timer_get_time();
+    dma_mode_start_interrupts_ = interrupts;
+}
+
 void AudioService::EnableAudioTesting(bool enable) {
     ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
     if (enable) {
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
     } else {
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
+        /* Move audio_testing_queue_ to audio_decode_queue_ */
         std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
+        MoveTestingPacketsToDecodeQueue();
         audio_queue_cv_.notify_all();
     }
 }
@@ -539,118 +1384,248 @@ void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
     callbacks_ = callbacks;
 }
 
-void AudioService::PlaySound(const std::string_view& ogg) {
+bool AudioService::PlaySound(const std::string_view& ogg, AudioPlaybackPriority priority, std::function<void()> on_complete) {
+    auto handle = PlaySounds(SoundPlaylist().AddSound(ogg), priority, std::move(on_complete));
+    return handle.result() != kSoundDropped;
+}
+
+SoundHandle AudioService::PlaySounds(const SoundPlaylist& playlist, AudioPlaybackPriority priority,
+    std::function<void()> on_complete) {
+    auto completion = std::make_shared<SoundCompletion>(std::move(on_complete));
+    SoundHandle handle(completion);
+    if (priority == kAudioPlaybackPriorityConversation) {
+        priority = kAudioPlaybackPriorityNormal;
+    }
+
     if (!codec_->output_enabled()) {
         esp_timer_stop(audio_power_timer_);
         esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
         codec_->EnableOutput(true);
     }
 
-    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
-    size_t size = ogg.size();
-    size_t offset = 0;
-
-    auto find_page = [&](size_t start)->size_t {
-        for (size_t i = start; i + 4 <= size; ++i) {
-            if (buf[i] == 'O' && buf[i+1] == 'g' && buf[i+2] == 'g' && buf[i+3] == 'S') return i;
+    // One entry per item, so each sound starts with a fresh decoder state
+    std::vector<std::unique_ptr<SoundPlayback>> sounds;
+    for (auto& item : playlist.items()) {
+        auto sound = std::make_unique<SoundPlayback>();
+        sound->priority = priority;
+        sound->completion = completion;
+        // Sounds are demuxed by DecodeSound, silence frames carry no payload
+        sound->ogg = item.ogg;
+        for (uint32_t ms = 0; item.ogg.empty() && ms < item.silence_ms; ms += OPUS_FRAME_DURATION_MS) {
+            auto packet = std::make_unique<AudioStreamPacket>();
+            packet->frame_duration = std::min<uint32_t>(OPUS_FRAME_DURATION_MS, item.silence_ms - ms);
+            sound->packets.push_back(std::move(packet));
         }
-        return static_cast<size_t>(-1);
-    };
-
-    bool seen_head = false;
-    bool seen_tags = false;
-    int sample_rate = 16000; // 默认值
+        if (!sound->ogg.empty() || !sound->packets.empty()) {
+            sounds.push_back(std::move(sound));
+        }
+    }
+    if (sounds.empty()) {
+        completion->Finish(kSoundDropped);
+        return handle;
+    }
+    sounds.back()->last = true;
+    completion->SetCancelHook([this, target = completion.get()]() {
+        CancelSounds(target);
+    });
 
-    while (true) {
-        size_t pos = find_page(offset);
-        if (pos == static_cast<size_t>(-1)) break;
-        offset = pos;
-        if (offset + 27 > size) break;
-
-        const uint8_t* page = buf + offset;
-        uint8_t page_segments = page[26];
-        size_t seg_table_off = offset + 27;
-        if (seg_table_off + page_segments > size) break;
-
-        size_t body_size = 0;
-        for (size_t i = 0; i < page_segments; ++i) body_size += page[27 + i];
-
-        size_t body_off = seg_table_off + page_segments;
-        if (body_off + body_size > size) break;
-
-        // Parse packets using lacing
-        size_t cur = body_off;
-        size_t seg_idx = 0;
-        while (seg_idx < page_segments) {
-            size_t pkt_len = 0;
-            size_t pkt_start = cur;
-            bool continued = false;
-            do {
-                uint8_t l = page[27 + seg_idx++];
-                pkt_len += l;
-                cur += l;
-                continued = (l == 255);
-            } while (continued && seg_idx < page_segments);
-
-            if (pkt_len == 0) continue;
-            const uint8_t* pkt_ptr = buf + pkt_start;
-
-            if (!seen_head) {
-                // 解析OpusHead包
-                if (pkt_len >= 19 && std::memcmp(pkt_ptr, "OpusHead", 8) == 0) {
-                    seen_head = true;
-                    
-                    // OpusHead结构：[0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
-                    // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
-                    if (pkt_len >= 12) {
-                        uint8_t version = pkt_ptr[8];
-                        uint8_t channel_count = pkt_ptr[9];
-                        
-                        if (pkt_len >= 16) {
-                            // 读取输入采样率 (little-endian)
-                            sample_rate = pkt_ptr[12] | (pkt_ptr[13] << 8) | 
-                                        (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
-                            ESP_LOGI(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d", 
-                                   version, channel_count, sample_rate);
-                        }
-                    }
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+        if (audio_sound_queue_.size() + sounds.size() > MAX_SOUNDS_IN_QUEUE) {
+            ESP_LOGW(TAG, "Sound queue is full, drop %u sounds", sounds.size());
+        } else {
+            queued = true;
+
+            // High priority sounds go after other high priority ones and the sound already playing
+            auto it = audio_sound_queue_.end();
+            if (priority == kAudioPlaybackPriorityHigh) {
+                it = audio_sound_queue_.begin();
+                while (it != audio_sound_queue_.end() && ((*it)->priority == kAudioPlaybackPriorityHigh || (*it)->started)) {
+                    ++it;
                 }
-                continue;
             }
-            if (!seen_tags) {
-                // Expect OpusTags in second packet
-                if (pkt_len >= 8 && std::memcmp(pkt_ptr, "OpusTags", 8) == 0) {
-                    seen_tags = true;
-                }
-                continue;
+            // The items stay together, nothing is inserted between them later
+            for (auto& sound : sounds) {
+                it = audio_sound_queue_.insert(it, std::move(sound)) + 1;
             }
-
-            // Audio packet (Opus)
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->sample_rate = sample_rate;
-            packet->frame_duration = 60;
-            packet->payload.resize(pkt_len);
-            std::memcpy(packet->payload.data(), pkt_ptr, pkt_len);
-            PushPacketToDecodeQueue(std::move(packet), true);
+            audio_queue_cv_.notify_all();
         }
+    }
+    if (!queued) {
+        completion->Finish(kSoundDropped);
+    }
+    return handle;
+}
 
-        offset = body_off + body_size;
+void AudioService::CancelSounds(SoundCompletion* completion) {
+    {
+        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+        for (auto it = audio_sound_queue_.begin(); it != audio_sound_queue_.end();) {
+            if ((*it)->completion.get() != completion) {
+                ++it;
+                continue;
+            }
+            it = audio_sound_queue_.erase(it);
+        }
+        audio_queue_cv_.notify_all();
     }
+    // Up to MAX_PLAYBACK_TASKS_IN_QUEUE decoded frames still play out
+    completion->Finish(kSoundCancelled);
 }
 
 bool AudioService::IsIdle() {
     std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() &&
+        audio_testing_queue_.empty() && audio_sound_queue_.empty();
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    opus_decoder_->ResetState();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    DownlinkFlowEvent event;
+    {
+        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+        opus_decoder_->ResetState();
+        decode_stream_started_ = false;
+        decode_prefetching_ = false;
+        playback_dsp_need_reset_ = true;
+        time_stretch_need_reset_ = true;
+        time_stretch_flush_pending_ = false;
+        playback_timeline_.clear();
+        audio_decode_queue_.Clear(event);
+        // Sounds have their own lane and survive a conversation reset
+        audio_playback_queue_.remove_if([](const std::unique_ptr<AudioTask>& task) {
+            return task->priority == kAudioPlaybackPriorityConversation;
+        });
+        audio_testing_queue_.clear();
+        audio_queue_cv_.notify_all();
+    }
+    // A server that was paused would never send the next reply
+    NotifyDownlinkFlow(event);
+}
+
+bool AudioService::SetSpeakingSpeed(int speed) {
+#if CONFIG_USE_PLAYBACK_TIME_STRETCH
+    if (speed < MIN_SPEAKING_SPEED || speed > MAX_SPEAKING_SPEED) {
+        return false;
+    }
+    speaking_speed_ = speed;
+    Settings settings("audio", true);
+    settings.SetInt("speaking_speed", speed);
+    ESP_LOGI(TAG, "Speaking speed set to %d%%", speed);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool AudioService::RunLatencyTest(LatencyTestReport& report) {
+#if CONFIG_USE_LATENCY_SELF_TEST
+    if (service_stopped_ || (xEventGroupGetBits(event_group_) & AS_EVENT_LATENCY_TEST_RUNNING)) {
+        return false;
+    }
+    report = LatencyTestReport();
+    {
+        std::lock_guard<std::mutex> lock(latency_mutex_);
+        latency_probe_.Configure(16000, LATENCY_TEST_LEAD_MS + LATENCY_TEST_MAX_MS + LATENCY_PROBE_DURATION_MS);
+    }
+    xEventGroupSetBits(event_group_, AS_EVENT_LATENCY_TEST_RUNNING);
+    ESP_LOGI(TAG, "Latency test: %d bursts, output %d Hz, input %d Hz, DMA %d x %d frames", LATENCY_TEST_BURSTS,
+        codec_->output_sample_rate(), codec_->input_sample_rate(), codec_->dma_desc_num(), codec_->dma_frame_num());
+
+    std::vector<float> round_trips;
+    float output_sum = 0, input_sum = 0;
+    for (int burst = 0; burst < LATENCY_TEST_BURSTS; burst++) {
+        {
+            std::lock_guard<std::mutex> lock(latency_mutex_);
+            latency_probe_.Reset();
+            latency_blocks_.clear();
+            latency_write_time_ = 0;
+            latency_capturing_ = true;
+        }
+
+        /* The mic window starts before the probe is queued, so its start cannot be missed */
+        vTaskDelay(pdMS_TO_TICKS(LATENCY_TEST_LEAD_MS / 2));
+        auto task = std::make_unique<AudioTask>();
+        task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+        task->timestamp = 0;
+        task->priority = kAudioPlaybackPriorityHigh;
+        task->sample_rate = codec_->output_sample_rate();
+        task->latency_probe = true;
+        LatencyProbe::Generate(task->sample_rate, task->pcm);
+        {
+            std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+            PushTaskToPlaybackQueue(std::move(task));
+        }
+
+        for (int waited = 0; latency_capturing_ && waited < LATENCY_TEST_TIMEOUT_MS; waited += 20) {
+            vTaskDelay(pdMS_TO_TICKS(20));
+        }
+        {
+            /* Keep the lock through the search, the input task re-checks the flag under it before touching the probe */
+            std::lock_guard<std::mutex> lock(latency_mutex_);
+            latency_capturing_ = false;
+            int64_t write_time = latency_write_time_;
+            uint32_t queued_frames = latency_output_queued_frames_;
+
+            float lag;
+            if (write_time == 0 || !latency_probe_.Find(0, latency_probe_.captured(), lag)) {
+                ESP_LOGW(TAG, "Latency test burst %d: probe not found (coherence %.2f)", burst, latency_probe_.coherence());
+            } else {
+                /* The mic block that carried the start of the probe, and when ReadAudioData returned it */
+                auto block = std::find_if(latency_blocks_.begin(), latency_blocks_.end(),
+                    [lag](const std::pair<size_t, int64_t>& b) { return b.first > lag; });
+                float round_trip = (block->second - write_time) / 1000.0f;
+                float output_buffer = queued_frames * 1000.0f / codec_->output_sample_rate();
+                float input_buffer = (block->first - lag) * 1000.0f / latency_probe_.sample_rate();
+                if (round_trip <= 0) {
+                    ESP_LOGW(TAG, "Latency test burst %d: probe found before it was played", burst);
+                } else {
+                    ESP_LOGI(TAG, "Latency test burst %d: round trip %.1f ms, output buffer %.1f ms, input buffer %.1f ms, coherence %.2f",
+                        burst, round_trip, output_buffer, input_buffer, latency_probe_.coherence());
+                    round_trips.push_back(round_trip);
+                    output_sum += output_buffer;
+                    input_sum += input_buffer;
+                }
+            }
+        }
+
+        /* Let the room go quiet before the next burst */
+        vTaskDelay(pdMS_TO_TICKS(LATENCY_TEST_GAP_MS));
+    }
+
+    {
+        /* Capturing stopped under this lock at the end of the last burst, so the probe is free to drop */
+        std::lock_guard<std::mutex> lock(latency_mutex_);
+        latency_probe_ = LatencyProbe();
+        latency_blocks_ = {};
+    }
+    xEventGroupClearBits(event_group_, AS_EVENT_LATENCY_TEST_RUNNING);
+
+    if (round_trips.empty()) {
+        ESP_LOGW(TAG, "Latency test failed, the probe was not heard");
+        return false;
+    }
+    report.bursts = round_trips.size();
+    float sum = 0, square_sum = 0;
+    report.min_ms = report.max_ms = round_trips[0];
+    for (auto value : round_trips) {
+        sum += value;
+        square_sum += value * value;
+        report.min_ms = std::min(report.min_ms, value);
+        report.max_ms = std::max(report.max_ms, value);
+    }
+    report.round_trip_ms = sum / report.bursts;
+    report.jitter_ms = sqrtf(std::max(0.0f, square_sum / report.bursts - report.round_trip_ms * report.round_trip_ms));
+    report.output_buffer_ms = output_sum / report.bursts;
+    report.input_buffer_ms = input_sum / report.bursts;
+    report.acoustic_ms = report.round_trip_ms - report.output_buffer_ms - report.input_buffer_ms;
+    ESP_LOGI(TAG, "Latency test: round trip %.1f ms (%.1f - %.1f, jitter %.1f) = output buffer %.1f + acoustic %.1f + input buffer %.1f ms, %d of %d bursts",
+        report.round_trip_ms, report.min_ms, report.max_ms, report.jitter_ms, report.output_buffer_ms,
+        report.acoustic_ms, report.input_buffer_ms, report.bursts, LATENCY_TEST_BURSTS);
+    return true;
+#else
+    return false;
+#endif
 }
 
 void AudioService::CheckAndUpdateAudioPowerState() {
@@ -662,8 +1637,101 @@ void AudioService::CheckAndUpdateAudioPowerState() {
     }
     if (output_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->output_enabled()) {
         codec_->EnableOutput(false);
+        codec_->SetOutputChannels(1);
     }
     if (!codec_->input_enabled() && !codec_->output_enabled()) {
         esp_timer_stop(audio_power_timer_);
     }
+
+    /* NVS writes can stall for a while, so neither the input task nor this timer task saves the delay */
+    if (callbacks_.on_echo_delay_change && echo_delay_need_save_.exchange(false)) {
+        callbacks_.on_echo_delay_change();
+    }
+}
+
+void AudioService::SaveEchoDelay() {
+#if CONFIG_USE_ECHO_DELAY_ESTIMATOR
+    Settings settings("audio", true);
+    settings.SetInt("echo_delay_us", echo_delay_us_);
+#endif
+}
+
+/* Must be called with audio_queue_mutex_ held */
+uint32_t AudioService::GetAudibleTimestamp() {
+    if (!codec_->output_position_tracked()) {
+        // Without DMA callbacks, the best guess is the frame most recently handed to the codec
+        return playback_timeline_.empty() ? 0 : playback_timeline_.back().timestamp;
+    }
+
+    uint32_t played = codec_->output_frames_played();
+    while (!playback_timeline_.empty()) {
+        auto& entry = playback_timeline_.front();
+        int32_t offset = (int32_t)(played - entry.start_frame);
+        if (offset < 0) {
+            // The next server frame has not reached the speaker yet
+            return 0;
+        }
+        if ((uint32_t)offset < entry.frames) {
+            return entry.timestamp + (uint32_t)offset * 1000 / codec_->output_sample_rate();
+        }
+        playback_timeline_.pop_front();
+    }
+    return 0;
+}
+
+void AudioService::RecordCaptureTimestamp(int samples, int64_t capture_time_us) {
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    capture_samples_ += samples;
+
+    uint32_t naive_timestamp = playback_timeline_.empty() ? 0 : playback_timeline_.back().timestamp;
+    uint32_t audible_timestamp = GetAudibleTimestamp();
+    uint32_t capture_timestamp = audible_timestamp;
+    if (audible_timestamp != 0 && capture_time_us != 0) {
+        /* Step back from now to when the chunk was captured, the server timestamps advance with the playout */
+        uint32_t age_ms = std::max<int64_t>(0, esp_timer_get_time() - capture_time_us) / 1000;
+        capture_timestamp = audible_timestamp > age_ms ? audible_timestamp - age_ms : 0;
+    }
+    if (capture_timeline_.full()) {
+        capture_timeline_.pop_front();
+    }
+    capture_timeline_.push_back(CaptureTimelineEntry{
+        .end_sample = capture_samples_,
+        .timestamp = capture_timestamp,
+    });
+
+    /* Report how far the old "last frame handed to OutputData" timestamp is from the actual playout */
+    if (naive_timestamp == 0 || audible_timestamp == 0) {
+        return;
+    }
+    int32_t error_ms = (int32_t)(naive_timestamp - audible_timestamp);
+    aec_alignment_.count++;
+    aec_alignment_.error_sum_ms += error_ms;
+    if (std::abs(error_ms) > std::abs(aec_alignment_.error_max_ms)) {
+        aec_alignment_.error_max_ms = error_ms;
+    }
+    if (aec_alignment_.count >= AEC_ALIGNMENT_REPORT_INTERVAL) {
+        ESP_LOGI(TAG, "Server AEC alignment: output-queue timestamps lead playout by %ld ms on average (max %ld ms), DMA resolution %d ms",
+            (long)(aec_alignment_.error_sum_ms / aec_alignment_.count), (long)aec_alignment_.error_max_ms,
+            codec_->dma_frame_num() * 1000 / codec_->output_sample_rate());
+        aec_alignment_ = AecAlignmentStatistics();
+    }
+}
+
+/* Must be called with audio_queue_mutex_ held */
+uint32_t AudioService::GetCaptureTimestamp(uint32_t start_sample) {
+    while (!capture_timeline_.empty() && (int32_t)(capture_timeline_.front().end_sample - start_sample) < 0) {
+        capture_timeline_.pop_front();
+    }
+    if (capture_timeline_.empty()) {
+        return 0;
+    }
+
+    auto& entry = capture_timeline_.front();
+    if (entry.timestamp == 0) {
+        return 0;
+    }
+    // Step back from the end of the captured chunk to the first sample of the frame, and to the
+    // input sample the processor computed it from
+    uint32_t lead_ms = (entry.end_sample - start_sample) * 1000 / 16000 + audio_processor_->GetOutputDelayMs();
+    return entry.timestamp > lead_ms ? entry.timestamp - lead_ms : 0;
 }
\ No newline at end of file
@@ -3,9 +3,11 @@
 
 #include <memory>
 #include <deque>
+#include <functional>
 #include <condition_variable>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -19,6 +21,20 @@
 #include "audio_codec.h"
 #include "audio_processor.h"
 #include "processors/audio_debugger.h"
+#include "dsp/loudness_limiter.h"
+#include "dsp/biquad_eq.h"
+#include "dsp/time_stretcher.h"
+#include "dsp/echo_delay_estimator.h"
+#include "dsp/latency_probe.h"
+#include "dsp/frame_aggregator.h"
+#include "dsp/segment_joiner.h"
+#include "opus_complexity_controller.h"
+#include "downlink_buffer.h"
+#include "fixed_queue.h"
+#include "input_fanout.h"
+#include "end_of_speech_detector.h"
+#include "sound_playlist.h"
+#include "ogg_sound.h"
 #include "wake_word.h"
 #include "protocol.h"
 
@@ -27,20 +43,101 @@
  * There are two types of audio data flow:
  * 1. (MIC) -> [Processors] -> {Encode Queue} -> [Opus Encoder] -> {Send Queue} -> (Server)
  * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
+ *    (Sounds) -> {Sound Queue} -> [Sound Decoder] -> {Playback Queue} -> (Speaker)
+ *
+ * Decoded audio is resampled to the codec output rate, unless the codec can switch its output
+ * to the stream rate (SupportsOutputSampleRate). Then the frames keep their rate and the output
+ * task reclocks the codec when the rate of the next frame differs.
+ *
+ * In music mode the server sends stereo packets. They skip the voice DSP and switch the codec
+ * output to stereo, mono frames are duplicated to both channels until the output powers down.
+ *
+ * The sound queue is a separate lane with its own decoder. High priority sounds preempt
+ * the conversation (the decode queue is paused and their PCM jumps ahead in the playback
+ * queue), normal priority sounds play when the conversation lane is empty.
  *
  * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
+ * The Decode Queue is a DownlinkBuffer, its depth comes from the board and it lives in PSRAM when
+ * there is some, so the server may send far ahead of playback.
  * 
  */
 
 #define OPUS_FRAME_DURATION_MS 60
 #define MAX_ENCODE_TASKS_IN_QUEUE 2
 #define MAX_PLAYBACK_TASKS_IN_QUEUE 2
-#define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+/* The chirp and the latency probe are queued past the limit, one of each at most */
+#define PLAYBACK_QUEUE_CAPACITY (MAX_PLAYBACK_TASKS_IN_QUEUE + 2)
+
+/*
+ * Queue capacities and task stacks are fixed at compile time. The low memory profile is for
+ * single core chips without PSRAM (the C3), where every KB of internal RAM counts: a shorter
+ * send queue, and the high water marks of the task stacks logged by PrintStackHighWaterMarks.
+ * See README.md for the internal RAM budget.
+ */
+#if CONFIG_USE_LOW_MEMORY_PROFILE
+#define MAX_SEND_PACKETS_IN_QUEUE (1200 / OPUS_FRAME_DURATION_MS)
+#else
 #define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+#endif
+/* The Opus encoder runs on this stack, it is not reduced until the high water marks of real hardware allow it */
+#define OPUS_CODEC_TASK_STACK_SIZE (2048 * 13)
+#if CONFIG_USE_AUDIO_PROCESSOR
+#define AUDIO_INPUT_TASK_STACK_SIZE (2048 * 3)
+#else
+#define AUDIO_INPUT_TASK_STACK_SIZE (2048 * 2)
+#endif
+/* The output task also runs the segment joiner, logs and calls the on_complete callbacks of sounds */
+#define AUDIO_OUTPUT_TASK_STACK_SIZE (2048 * 2)
+/* The playlist items waiting on the sound lane, each sound is demuxed when it reaches the front */
+#define MAX_SOUNDS_IN_QUEUE 24
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
-#define MAX_TIMESTAMPS_IN_QUEUE 3
+#define MAX_PLAYBACK_TIMELINE_ENTRIES 16
+#define MAX_CAPTURE_TIMELINE_ENTRIES 32
+#define AEC_ALIGNMENT_REPORT_INTERVAL 100
+
+/* Speed up the conversation a little while too much audio is buffered, until it is back near the target */
+#define PLAYBACK_CATCHUP_START_MS 1500
+#define PLAYBACK_CATCHUP_STOP_MS 500
+#define PLAYBACK_CATCHUP_SPEEDUP_PERCENT 115
+/* The reference is kept this far ahead of its echo, the AEC filter cannot model an echo that comes first */
+#define ECHO_REFERENCE_LEAD_MS 2
+#define ECHO_DELAY_UPDATE_MS 1
+#define ECHO_CHIRP_DURATION_MS 600
+#define ECHO_DELAY_UNKNOWN INT32_MIN
+
+/* Acoustic round-trip self test, the mic window covers the lead, the longest round trip and the probe */
+#define LATENCY_TEST_BURSTS 5
+#define LATENCY_TEST_LEAD_MS 100
+#define LATENCY_TEST_MAX_MS 400
+#define LATENCY_TEST_GAP_MS 300
+#define LATENCY_TEST_TIMEOUT_MS 2000
+
+/*
+ * Gapless playback: within a turn the decoder keeps its rate, the tail of each frame is held
+ * back so a gap fades out and in, and after a gap the next segment starts once this much is
+ * buffered, so it does not run dry again after its first packet.
+ */
+#define GAPLESS_PREFETCH_MS 120
+#define GAPLESS_PREFETCH_TIMEOUT_MS 200
+
+#define MIN_SPEAKING_SPEED 80
+#define MAX_SPEAKING_SPEED 150
+
+/*
+ * I2S DMA geometry per pipeline mode, where the codec supports changing it.
+ * Realtime duplex wants short buffers for latency, the rest of the time a few large
+ * buffers cut the DMA interrupts. At 16 kHz in / 24 kHz out that is 16 + 25 interrupts
+ * per second with 180 ms of input slack while idle, against 100 + 150 per second and
+ * 10 ms in / 40 ms out of buffering in realtime mode.
+ */
+#define IDLE_DMA_DESC_NUM 3
+#define IDLE_DMA_FRAME_NUM 960
+#define REALTIME_DMA_DESC_NUM 6
+#define REALTIME_DMA_FRAME_NUM 160
+/* An I2S overrun or underrun is logged with the state of the late task at most this often */
+#define I2S_HEALTH_LOG_INTERVAL_MS 5000
 
 #define AUDIO_POWER_TIMEOUT_MS 15000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
@@ -50,15 +147,39 @@
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_LATENCY_TEST_RUNNING       (1 << 4)
+#define AS_EVENT_INPUT_TAP_RUNNING          (1 << 5)
+
+/* Without a processor or wake word to size them, the input blocks are this long */
+#define INPUT_BLOCK_MS 30
+
+/* The input consumers, each keeps its own chunking state in the InputFanout */
+enum InputConsumer {
+    kInputConsumerWakeWord,
+    kInputConsumerProcessor,
+    kInputConsumerTesting,
+};
 
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
     std::function<void(const std::string&)> on_wake_word_detected;
     std::function<void(bool)> on_vad_change;
     std::function<void(void)> on_audio_testing_queue_full;
+    // The downlink buffer crossed a watermark, true asks the server to pause
+    std::function<void(bool)> on_downlink_flow_change;
+    // The utterance ended this long ago, and whether the rest of the turn is no longer encoded
+    std::function<void(uint32_t silence_ms, bool stopped)> on_end_of_speech;
+    // A new echo reference delay was measured, SaveEchoDelay should be called from a task that may block on NVS
+    std::function<void(void)> on_echo_delay_change;
 };
 
 
+enum AudioPlaybackPriority {
+    kAudioPlaybackPriorityConversation, // Server audio, cleared by ResetDecoder
+    kAudioPlaybackPriorityNormal,       // UI sounds, wait for the conversation lane
+    kAudioPlaybackPriorityHigh,         // Alerts, preempt the conversation lane
+};
+
 enum AudioTaskType {
     kAudioTaskTypeEncodeToSendQueue,
     kAudioTaskTypeEncodeToTestingQueue,
@@ -68,14 +189,63 @@ enum AudioTaskType {
 struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
+    int sample_rate = 0;
+    int channels = 1;
+    uint32_t timestamp;
+    AudioPlaybackPriority priority = kAudioPlaybackPriorityConversation;
+    bool latency_probe = false;
+    // Set on the last frame of a sound, called by the output task after it is played
+    std::function<void()> on_complete;
+};
+
+/* One item of a playlist, packets without payload are silence */
+struct SoundPlayback {
+    std::deque<std::unique_ptr<AudioStreamPacket>> packets;
+    std::string_view ogg;   // Not demuxed into packets yet
+    AudioPlaybackPriority priority;
+    std::shared_ptr<SoundCompletion> completion;
+    bool started = false;
+    bool last = false;      // The last item of its playlist
+};
+
+/* Where a decoded frame with a server timestamp lands on the codec output timeline */
+struct PlaybackTimelineEntry {
+    uint32_t timestamp;
+    uint32_t start_frame;
+    uint32_t frames;
+};
+
+/* The server timestamp that was audible when a mic chunk finished capturing */
+struct CaptureTimelineEntry {
+    uint32_t end_sample;
     uint32_t timestamp;
 };
 
+struct AecAlignmentStatistics {
+    uint32_t count = 0;
+    int64_t error_sum_ms = 0;
+    int32_t error_max_ms = 0;
+};
+
 struct DebugStatistics {
     uint32_t input_count = 0;
     uint32_t decode_count = 0;
     uint32_t encode_count = 0;
     uint32_t playback_count = 0;
+    uint32_t playback_dsp_max_us = 0;
+    uint32_t playback_eq_max_cycles = 0;    // Per sample
+    uint32_t time_stretch_max_us = 0;
+};
+
+struct LatencyTestReport {
+    int bursts = 0;                 // Bursts found in the mic signal
+    float round_trip_ms = 0;        // From OutputData until ReadAudioData returned the probe, mean
+    float min_ms = 0;
+    float max_ms = 0;
+    float jitter_ms = 0;            // Standard deviation of the round trip
+    float output_buffer_ms = 0;     // Audio queued in the output ahead of the probe
+    float input_buffer_ms = 0;      // From the probe start reaching the input to ReadAudioData returning it
+    float acoustic_ms = 0;          // The rest: converters, amplifier, speaker to mic
 };
 
 class AudioService {
@@ -91,6 +261,12 @@ public:
     const std::string& GetLastWakeWord() const;
     bool IsVoiceDetected() const { return voice_detected_; }
     bool IsIdle();
+    int GetEncoderComplexity() const { return opus_complexity_controller_.complexity(); }
+    int GetSpeakingSpeed() const { return speaking_speed_; }
+    // Capacity and watermarks are fixed after Initialize
+    const DownlinkBuffer& GetDownlinkBuffer() const { return audio_decode_queue_; }
+    // The measured lag of the echo behind the reference channel, false if not known yet
+    bool GetEchoReferenceDelay(float& delay_ms) const;
     bool IsWakeWordRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING; }
     bool IsAudioProcessorRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_PROCESSOR_RUNNING; }
 
@@ -98,14 +274,38 @@ public:
     void EnableVoiceProcessing(bool enable);
     void EnableAudioTesting(bool enable);
     void EnableDeviceAec(bool enable);
+    // Watches the VAD for the end of the utterance, in shadow mode it only reports it
+    void EnableEndOfSpeechDetection(bool enable, bool shadow = false);
+    // Speed of the conversation audio in percent, saved to Settings
+    bool SetSpeakingSpeed(int speed);
+    // Set when the server paces the downlink by the flow messages, its lead is not latency to catch up on
+    void SetDownlinkBurst(bool burst) { downlink_burst_ = burst; }
+    // Plays probe chirps and finds them in the mic input, blocks for a few seconds
+    bool RunLatencyTest(LatencyTestReport& report);
+    // Writes the last measured echo reference delay to Settings
+    void SaveEchoDelay();
+    // Called in the audio input task with the channel views of every block read, nullptr removes it.
+    // Keeps the input running while set
+    void SetInputTap(std::function<void(const AudioInputFrame& frame)> tap);
 
     void SetCallbacks(AudioServiceCallbacks& callbacks);
 
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
+    // Queues the packets of a whole phrase as conversation audio, or none of them if they do not fit
+    bool PushPacketsToDecodeQueue(std::vector<std::unique_ptr<AudioStreamPacket>>& packets);
+    // The server ended a sentence or the turn, the time stretcher plays out its tail after the last packet of it
+    void MarkDownlinkSegmentEnd();
     std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
-    void PlaySound(const std::string_view& sound);
+    // Never blocks, on_complete runs in the audio output task once the sound has been played or dropped
+    bool PlaySound(const std::string_view& sound, AudioPlaybackPriority priority = kAudioPlaybackPriorityNormal,
+        std::function<void()> on_complete = nullptr);
+    // Never blocks, queues the whole playlist or none of it. on_complete runs once it has ended in any way
+    SoundHandle PlaySounds(const SoundPlaylist& playlist, AudioPlaybackPriority priority = kAudioPlaybackPriorityNormal,
+        std::function<void()> on_complete = nullptr);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    // Logs the unused stack of the audio tasks, in bytes
+    void PrintStackHighWaterMarks();
 
 private:
     AudioCodec* codec_ = nullptr;
@@ -115,10 +315,23 @@ private:
     std::unique_ptr<AudioDebugger> audio_debugger_;
     std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
     std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
+    std::unique_ptr<OpusDecoderWrapper> sound_decoder_;
+    OpusComplexityController opus_complexity_controller_;
     OpusResampler input_resampler_;
     OpusResampler reference_resampler_;
     OpusResampler output_resampler_;
+    OpusResampler output_resampler_right_;
+    OpusResampler sound_resampler_;
+    BiquadEq playback_eq_;
+    LoudnessLimiter loudness_limiter_;
+    TimeStretcher time_stretcher_;
+    EchoDelayEstimator echo_delay_estimator_;
+    EndOfSpeechDetector end_of_speech_detector_;
+    LatencyProbe latency_probe_;
     DebugStatistics debug_statistics_;
+    InputFanout input_fanout_;
+    std::mutex input_tap_mutex_;
+    std::function<void(const AudioInputFrame& frame)> input_tap_;
 
     EventGroupHandle_t event_group_;
 
@@ -128,19 +341,72 @@ private:
     TaskHandle_t opus_codec_task_handle_ = nullptr;
     std::mutex audio_queue_mutex_;
     std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
+    DownlinkBuffer audio_decode_queue_;
+    FixedQueue<std::unique_ptr<AudioStreamPacket>, MAX_SEND_PACKETS_IN_QUEUE> audio_send_queue_;
     std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    FixedQueue<std::unique_ptr<AudioTask>, MAX_ENCODE_TASKS_IN_QUEUE> audio_encode_queue_;
+    FixedQueue<std::unique_ptr<AudioTask>, PLAYBACK_QUEUE_CAPACITY> audio_playback_queue_;
+    std::deque<std::unique_ptr<SoundPlayback>> audio_sound_queue_;
     // For server AEC
-    std::deque<uint32_t> timestamp_queue_;
+    FixedQueue<PlaybackTimelineEntry, MAX_PLAYBACK_TIMELINE_ENTRIES> playback_timeline_;
+    FixedQueue<CaptureTimelineEntry, MAX_CAPTURE_TIMELINE_ENTRIES> capture_timeline_;
+    uint32_t capture_samples_ = 0;
+    uint32_t encode_samples_ = 0;
+    AecAlignmentStatistics aec_alignment_;
 
     bool wake_word_initialized_ = false;
     bool audio_processor_initialized_ = false;
     bool voice_detected_ = false;
     bool service_stopped_ = true;
     bool audio_input_need_warmup_ = false;
+    bool playback_dsp_need_reset_ = false;
+    bool time_stretch_need_reset_ = false;
+    // The segment ended after its last packet was decoded, guarded by audio_queue_mutex_
+    bool time_stretch_flush_pending_ = false;
+    bool playback_catching_up_ = false;
+    bool downlink_burst_ = false;
+    bool end_of_speech_enabled_ = false;
+    bool end_of_speech_shadow_ = false;
+    bool end_of_speech_need_reset_ = false;
+    // Gapless playback, the prefetch state is guarded by audio_queue_mutex_
+    bool decode_stream_started_ = false;
+    bool decode_prefetching_ = false;
+    int64_t decode_prefetch_start_time_ = 0;
+    SegmentJoiner segment_joiner_;
+    std::vector<int16_t> output_tail_;
+    std::vector<std::function<void()>> held_tail_callbacks_;  // Played sounds waiting on the held tail
+    int decode_channels_ = 1;
+    // Rate of the PCM handed to the output task, the codec output follows it if it can
+    int playback_sample_rate_ = 0;
+    int sound_output_sample_rate_ = 0;
+    // Echo reference alignment, positive delays the reference channel, negative the mic channel
+    int echo_delay_samples_ = 0;
+    FrameAggregator echo_delay_line_;
+    // Reused per frame instead of temporary vectors, one for the input task and one for the codec task
+    std::vector<int16_t> input_block_;
+    int64_t input_block_capture_time_ = 0;
+    std::vector<int16_t> input_scratch_;
+    std::vector<int16_t> decode_scratch_;
+    // Set by the input task, the power timer hands the save over with on_echo_delay_change
+    std::atomic<bool> echo_delay_need_save_ = false;
+    std::atomic<int32_t> echo_delay_us_ = 0;
+    bool echo_chirp_played_ = false;
+    int speaking_speed_ = 100;
+    // Latency test state shared by the input and output tasks, the end of each mic block and when it was read.
+    // latency_mutex_ guards latency_probe_ and the fields below, the flag is only a lock-free hint for the input task
+    std::mutex latency_mutex_;
+    std::atomic<bool> latency_capturing_ = false;
+    std::vector<std::pair<size_t, int64_t>> latency_blocks_;
+    int64_t latency_write_time_ = 0;
+    uint32_t latency_output_queued_frames_ = 0;
+    // I2S health counts already handled, the codec resets them when a session starts
+    uint32_t rx_overruns_seen_ = 0;
+    uint32_t tx_underruns_seen_ = 0;
+    int64_t overrun_log_time_ = 0;
+    int64_t underrun_log_time_ = 0;
+    // Interrupt rate measurement of the current DMA geometry
+    int64_t dma_mode_start_time_ = 0;
+    uint32_t dma_mode_start_interrupts_ = 0;
 
     esp_timer_handle_t audio_power_timer_ = nullptr;
     std::chrono::steady_clock::time_point last_input_time_;
@@ -150,8 +416,36 @@ private:
     void AudioOutputTask();
     void OpusCodecTask();
     void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
-    void SetDecodeSampleRate(int sample_rate, int frame_duration);
+    // stream_started is decode_stream_started_, read under audio_queue_mutex_
+    void SetDecodeSampleRate(int sample_rate, int channels, int frame_duration, bool stream_started);
+    void SetPlaybackSampleRate(int sample_rate);
+    void ResampleStereoOutput(std::vector<int16_t>& pcm);
+    bool CanDecodeSound();
+    bool IsDecodePrefetched();
+    void WriteHeldTail();
+    void RunHeldTailCallbacks();
+    void DecodeSound(std::unique_lock<std::mutex>& lock);
+    void PushTaskToPlaybackQueue(std::unique_ptr<AudioTask> task);
+    void CancelSounds(SoundCompletion* completion);
+    void ProcessPlaybackDsp(std::vector<int16_t>& pcm);
+    void ProcessTimeStretch(std::vector<int16_t>& pcm, int buffered_ms, bool flush);
+    void FlushTimeStretch(std::unique_lock<std::mutex>& lock);
+    void AlignEchoReference(std::vector<int16_t>& data);
+    // The line is sized for the delay plus one input block, it starts out silent
+    void SetEchoDelayLine(int samples, size_t block_frames = 0);
+    void PlayEchoChirp();
+    void FeedAudioDebugger(AudioDebugTap tap, const std::vector<int16_t>& data, int sample_rate, int channels);
     void CheckAndUpdateAudioPowerState();
+    void UpdateDmaGeometry(bool realtime);
+    void RecoverFromInputOverrun(const I2sHealth& health);
+    void CheckOutputUnderrun();
+    void NotifyDownlinkFlow(DownlinkFlowEvent event);
+    void ReportDownlinkOccupancy();
+    void MoveTestingPacketsToDecodeQueue();
+    uint32_t GetAudibleTimestamp();
+    // capture_time_us is when the last of the samples was captured, 0 if unknown
+    void RecordCaptureTimestamp(int samples, int64_t capture_time_us);
+    uint32_t GetCaptureTimestamp(uint32_t start_sample);
 };
 
 #endif
\ No newline at end of file
@@ -3,9 +3,28 @@
 #include <esp_log.h>
 #include <cmath>
 #include <cstring>
+#include <algorithm>
 
 #define TAG "NoAudioCodec"
 
+#if CONFIG_USE_ASYNC_I2S_OUTPUT
+// The callback fills the DMA buffer itself, so the driver must clear it before the callback
+#define NO_AUDIO_CODEC_AUTO_CLEAR_BEFORE_CB true
+#define NO_AUDIO_CODEC_AUTO_CLEAR_AFTER_CB false
+#else
+#define NO_AUDIO_CODEC_AUTO_CLEAR_BEFORE_CB false
+#define NO_AUDIO_CODEC_AUTO_CLEAR_AFTER_CB true
+#endif
+
+NoAudioCodec::NoAudioCodec() {
+#if CONFIG_USE_ASYNC_I2S_OUTPUT
+    // All TX channels below use 32-bit mono slots, one int32_t per DMA frame
+    for (auto& slot : output_slots_) {
+        slot.resize(dma_frame_num_);
+    }
+#endif
+}
+
 NoAudioCodec::~NoAudioCodec() {
     if (rx_handle_ != nullptr) {
         ESP_ERROR_CHECK(i2s_channel_disable(rx_handle_));
@@ -15,6 +34,96 @@ NoAudioCodec::~NoAudioCodec() {
     }
 }
 
+void NoAudioCodec::CreateChannels() {
+    tx_chan_cfg_.dma_desc_num = rx_chan_cfg_.dma_desc_num = dma_desc_num_;
+    tx_chan_cfg_.dma_frame_num = rx_chan_cfg_.dma_frame_num = dma_frame_num_;
+    if (duplex_) {
+        ESP_ERROR_CHECK(i2s_new_channel(&tx_chan_cfg_, &tx_handle_, &rx_handle_));
+    } else {
+        ESP_ERROR_CHECK(i2s_new_channel(&tx_chan_cfg_, &tx_handle_, nullptr));
+        ESP_ERROR_CHECK(i2s_new_channel(&rx_chan_cfg_, nullptr, &rx_handle_));
+    }
+    ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &tx_std_cfg_));
+    ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &rx_std_cfg_));
+}
+
+bool NoAudioCodec::RecreateChannels() {
+    // Wait for the reader and the writer to leave the driver
+    std::lock_guard<std::mutex> output_lock(data_if_mutex_);
+    std::lock_guard<std::mutex> input_lock(input_mutex_);
+
+    for (auto handle : { tx_handle_, rx_handle_ }) {
+        if (handle != nullptr) {
+            ESP_ERROR_CHECK(i2s_channel_disable(handle));
+            ESP_ERROR_CHECK(i2s_del_channel(handle));
+        }
+    }
+    tx_handle_ = nullptr;
+    rx_handle_ = nullptr;
+
+#if CONFIG_USE_ASYNC_I2S_OUTPUT
+    for (auto& slot : output_slots_) {
+        slot.assign(dma_frame_num_, 0);
+    }
+    ResetOutputSlots();
+#else
+    output_dma_fill_ = 0;
+#endif
+
+    CreateChannels();
+    StartChannels();
+    return true;
+}
+
+void NoAudioCodec::ResyncInput() {
+    // RecreateChannels replaces rx_handle_ under the same lock
+    std::lock_guard<std::mutex> lock(input_mutex_);
+    AudioCodec::ResyncInput();
+}
+
+bool NoAudioCodec::SupportsOutputSampleRate(int sample_rate) const {
+#if CONFIG_USE_OUTPUT_SAMPLE_RATE_SWITCHING
+    if (!duplex_) {
+        return sample_rate >= NO_AUDIO_CODEC_MIN_OUTPUT_SAMPLE_RATE && sample_rate <= NO_AUDIO_CODEC_MAX_OUTPUT_SAMPLE_RATE;
+    }
+#endif
+    return AudioCodec::SupportsOutputSampleRate(sample_rate);
+}
+
+bool NoAudioCodec::SetOutputSampleRate(int sample_rate) {
+    if (sample_rate == output_sample_rate_) {
+        return true;
+    }
+    if (!SupportsOutputSampleRate(sample_rate)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+#if CONFIG_USE_ASYNC_I2S_OUTPUT
+    FlushOutputSlot();
+#endif
+    // Let the DMA play out the frames written at the old rate
+    for (int i = 0; i < NO_AUDIO_CODEC_DRAIN_TIMEOUT_MS / 10 && output_position_tracked_ &&
+            output_position_.queued() != 0; i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+
+    tx_std_cfg_.clk_cfg.sample_rate_hz = (uint32_t)sample_rate;
+    ESP_ERROR_CHECK(i2s_channel_disable(tx_handle_));
+    ESP_ERROR_CHECK(i2s_channel_reconfig_std_clock(tx_handle_, &tx_std_cfg_.clk_cfg));
+    ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
+#if !CONFIG_USE_ASYNC_I2S_OUTPUT
+    // The driver starts over with an empty buffer
+    output_dma_fill_ = 0;
+#endif
+    ResetOutputPosition();
+    // The slot was flushed above, with data_if_mutex_ held
+    AudioCodec::EndOutputStream();
+    ESP_LOGI(TAG, "Output sample rate switched from %d to %d", output_sample_rate_, sample_rate);
+    output_sample_rate_ = sample_rate;
+    return true;
+}
+
 NoAudioCodecDuplex::NoAudioCodecDuplex(int input_sample_rate, int output_sample_rate, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout, gpio_num_t din) {
     duplex_ = true;
     input_sample_rate_ = input_sample_rate;
@@ -23,13 +132,12 @@ NoAudioCodecDuplex::NoAudioCodecDuplex(int input_sample_rate, int output_sample_
     i2s_chan_config_t chan_cfg = {
         .id = I2S_NUM_0,
         .role = I2S_ROLE_MASTER,
-        .dma_desc_num = AUDIO_CODEC_DMA_DESC_NUM,
-        .dma_frame_num = AUDIO_CODEC_DMA_FRAME_NUM,
-        .auto_clear_after_cb = true,
-        .auto_clear_before_cb = false,
+        .dma_desc_num = (uint32_t)dma_desc_num_,
+        .dma_frame_num = (uint32_t)dma_frame_num_,
+        .auto_clear_after_cb = NO_AUDIO_CODEC_AUTO_CLEAR_AFTER_CB,
+        .auto_clear_before_cb = NO_AUDIO_CODEC_AUTO_CLEAR_BEFORE_CB,
         .intr_priority = 0,
     };
-    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, &tx_handle_, &rx_handle_));
 
     i2s_std_config_t std_cfg = {
         .clk_cfg = {
@@ -69,8 +177,9 @@ NoAudioCodecDuplex::NoAudioCodecDuplex(int input_sample_rate, int output_sample_
             }
         }
     };
-    ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
-    ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
+    tx_chan_cfg_ = rx_chan_cfg_ = chan_cfg;
+    tx_std_cfg_ = rx_std_cfg_ = std_cfg;
+    CreateChannels();
     ESP_LOGI(TAG, "Duplex channels created");
 }
 
@@ -80,17 +189,16 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
 
-    // Create a new channel for speaker
+    // Channel for speaker
     i2s_chan_config_t chan_cfg = {
         .id = (i2s_port_t)0,
         .role = I2S_ROLE_MASTER,
-        .dma_desc_num = AUDIO_CODEC_DMA_DESC_NUM,
-        .dma_frame_num = AUDIO_CODEC_DMA_FRAME_NUM,
-        .auto_clear_after_cb = true,
-        .auto_clear_before_cb = false,
+        .dma_desc_num = (uint32_t)dma_desc_num_,
+        .dma_frame_num = (uint32_t)dma_frame_num_,
+        .auto_clear_after_cb = NO_AUDIO_CODEC_AUTO_CLEAR_AFTER_CB,
+        .auto_clear_before_cb = NO_AUDIO_CODEC_AUTO_CLEAR_BEFORE_CB,
         .intr_priority = 0,
     };
-    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, &tx_handle_, nullptr));
 
     i2s_std_config_t std_cfg = {
         .clk_cfg = {
@@ -130,17 +238,19 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
             }
         }
     };
-    ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
+    tx_chan_cfg_ = chan_cfg;
+    tx_std_cfg_ = std_cfg;
 
-    // Create a new channel for MIC
+    // Channel for MIC
     chan_cfg.id = (i2s_port_t)1;
-    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, nullptr, &rx_handle_));
     std_cfg.clk_cfg.sample_rate_hz = (uint32_t)input_sample_rate_;
     std_cfg.gpio_cfg.bclk = mic_sck;
     std_cfg.gpio_cfg.ws = mic_ws;
     std_cfg.gpio_cfg.dout = I2S_GPIO_UNUSED;
     std_cfg.gpio_cfg.din = mic_din;
-    ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
+    rx_chan_cfg_ = chan_cfg;
+    rx_std_cfg_ = std_cfg;
+    CreateChannels();
     ESP_LOGI(TAG, "Simplex channels created");
 }
 
@@ -149,17 +259,16 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
 
-    // Create a new channel for speaker
+    // Channel for speaker
     i2s_chan_config_t chan_cfg = {
         .id = (i2s_port_t)0,
         .role = I2S_ROLE_MASTER,
-        .dma_desc_num = AUDIO_CODEC_DMA_DESC_NUM,
-        .dma_frame_num = AUDIO_CODEC_DMA_FRAME_NUM,
-        .auto_clear_after_cb = true,
-        .auto_clear_before_cb = false,
+        .dma_desc_num = (uint32_t)dma_desc_num_,
+        .dma_frame_num = (uint32_t)dma_frame_num_,
+        .auto_clear_after_cb = NO_AUDIO_CODEC_AUTO_CLEAR_AFTER_CB,
+        .auto_clear_before_cb = NO_AUDIO_CODEC_AUTO_CLEAR_BEFORE_CB,
         .intr_priority = 0,
     };
-    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, &tx_handle_, nullptr));
 
     i2s_std_config_t std_cfg = {
         .clk_cfg = {
@@ -199,18 +308,20 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
             }
         }
     };
-    ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
+    tx_chan_cfg_ = chan_cfg;
+    tx_std_cfg_ = std_cfg;
 
-    // Create a new channel for MIC
+    // Channel for MIC
     chan_cfg.id = (i2s_port_t)1;
-    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, nullptr, &rx_handle_));
     std_cfg.clk_cfg.sample_rate_hz = (uint32_t)input_sample_rate_;
     std_cfg.slot_cfg.slot_mask = mic_slot_mask;
     std_cfg.gpio_cfg.bclk = mic_sck;
     std_cfg.gpio_cfg.ws = mic_ws;
     std_cfg.gpio_cfg.dout = I2S_GPIO_UNUSED;
     std_cfg.gpio_cfg.din = mic_din;
-    ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
+    rx_chan_cfg_ = chan_cfg;
+    rx_std_cfg_ = std_cfg;
+    CreateChannels();
     ESP_LOGI(TAG, "Simplex channels created");
 }
 
@@ -221,13 +332,9 @@ NoAudioCodecSimplexPdm::NoAudioCodecSimplexPdm(int input_sample_rate, int output
 
     // Create a new channel for speaker
     i2s_chan_config_t tx_chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG((i2s_port_t)1, I2S_ROLE_MASTER);
-    tx_chan_cfg.dma_desc_num = AUDIO_CODEC_DMA_DESC_NUM;
-    tx_chan_cfg.dma_frame_num = AUDIO_CODEC_DMA_FRAME_NUM;
-    tx_chan_cfg.auto_clear_after_cb = true;
-    tx_chan_cfg.auto_clear_before_cb = false;
+    tx_chan_cfg.auto_clear_after_cb = NO_AUDIO_CODEC_AUTO_CLEAR_AFTER_CB;
+    tx_chan_cfg.auto_clear_before_cb = NO_AUDIO_CODEC_AUTO_CLEAR_BEFORE_CB;
     tx_chan_cfg.intr_priority = 0;
-    ESP_ERROR_CHECK(i2s_new_channel(&tx_chan_cfg, &tx_handle_, NULL));
-
 
     i2s_std_config_t tx_std_cfg = {
         .clk_cfg = {
@@ -253,11 +360,11 @@ NoAudioCodecSimplexPdm::NoAudioCodecSimplexPdm(int input_sample_rate, int output
             },
         },
     };
-    ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &tx_std_cfg));
+    tx_chan_cfg_ = tx_chan_cfg;
+    tx_std_cfg_ = tx_std_cfg;
 #if SOC_I2S_SUPPORTS_PDM_RX
-    // Create a new channel for MIC in PDM mode
-    i2s_chan_config_t rx_chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG((i2s_port_t)0, I2S_ROLE_MASTER);
-    ESP_ERROR_CHECK(i2s_new_channel(&rx_chan_cfg, NULL, &rx_handle_));
+    // Channel for MIC in PDM mode
+    rx_chan_cfg_ = I2S_CHANNEL_DEFAULT_CONFIG((i2s_port_t)0, I2S_ROLE_MASTER);
     i2s_pdm_rx_config_t pdm_rx_cfg = {
         .clk_cfg = I2S_PDM_RX_CLK_DEFAULT_CONFIG((uint32_t)input_sample_rate_),
         /* The data bit-width of PDM mode is fixed to 16 */
@@ -271,20 +378,31 @@ NoAudioCodecSimplexPdm::NoAudioCodecSimplexPdm(int input_sample_rate, int output
             },
         },
     };
-    ESP_ERROR_CHECK(i2s_channel_init_pdm_rx_mode(rx_handle_, &pdm_rx_cfg));
+    pdm_rx_cfg_ = pdm_rx_cfg;
 #else
     ESP_LOGE(TAG, "PDM is not supported");
 #endif
+    CreateChannels();
     ESP_LOGI(TAG, "Simplex channels created");
 }
 
-int NoAudioCodec::Write(const int16_t* data, int samples) {
-    std::lock_guard<std::mutex> lock(data_if_mutex_);
-    std::vector<int32_t> buffer(samples);
+void NoAudioCodecSimplexPdm::CreateChannels() {
+    tx_chan_cfg_.dma_desc_num = dma_desc_num_;
+    tx_chan_cfg_.dma_frame_num = dma_frame_num_;
+    ESP_ERROR_CHECK(i2s_new_channel(&tx_chan_cfg_, &tx_handle_, nullptr));
+    ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &tx_std_cfg_));
+#if SOC_I2S_SUPPORTS_PDM_RX
+    rx_chan_cfg_.dma_desc_num = dma_desc_num_;
+    rx_chan_cfg_.dma_frame_num = dma_frame_num_;
+    ESP_ERROR_CHECK(i2s_new_channel(&rx_chan_cfg_, nullptr, &rx_handle_));
+    ESP_ERROR_CHECK(i2s_channel_init_pdm_rx_mode(rx_handle_, &pdm_rx_cfg_));
+#endif
+}
 
+static void ConvertOutputSamples(const int16_t* data, int32_t* buffer, int samples, int output_volume) {
     // output_volume_: 0-100
     // volume_factor_: 0-65536
-    int32_t volume_factor = pow(double(output_volume_) / 100.0, 2) * 65536;
+    int32_t volume_factor = pow(double(output_volume) / 100.0, 2) * 65536;
     for (int i = 0; i < samples; i++) {
         int64_t temp = int64_t(data[i]) * volume_factor; // 使用 int64_t 进行乘法运算
         if (temp > INT32_MAX) {
@@ -295,13 +413,133 @@ int NoAudioCodec::Write(const int16_t* data, int samples) {
             buffer[i] = static_cast<int32_t>(temp);
         }
     }
+}
+
+#if CONFIG_USE_ASYNC_I2S_OUTPUT
+int NoAudioCodec::Write(const int16_t* data, int samples) {
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    output_task_ = xTaskGetCurrentTaskHandle();
+
+    const int period = output_slots_[0].size();
+    int offset = 0;
+    while (offset < samples) {
+        // Sleep until the DMA callback has drained the slot, one wakeup per DMA period
+        while (output_slot_ready_[output_slot_write_]) {
+            if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100)) == 0 && !output_enabled_) {
+                return offset;
+            }
+        }
+
+        // Convert while the other slot is being transferred. A partial period waits in the
+        // slot for the next write, so frames that do not fill periods play without gaps
+        auto& slot = output_slots_[output_slot_write_];
+        int count = std::min(period - output_slot_fill_, samples - offset);
+        ConvertOutputSamples(data + offset, slot.data() + output_slot_fill_, count, output_volume_);
+        output_slot_fill_ += count;
+        offset += count;
+        // Counted before the callback can take the slot, so it credits what the slot carries
+        CountWrittenFrames(count / output_channels_);
+        if (output_slot_fill_ == period) {
+            output_slot_frames_[output_slot_write_] = period;
+            output_slot_ready_[output_slot_write_] = true;
+            output_slot_write_ = (output_slot_write_ + 1) % NO_AUDIO_CODEC_OUTPUT_SLOTS;
+            output_slot_fill_ = 0;
+        }
+    }
+    return samples;
+}
+
+void NoAudioCodec::FlushOutputSlot() {
+    if (output_slot_fill_ == 0) {
+        return;
+    }
+    // The slot being filled is never ready, the callback does not touch it
+    auto& slot = output_slots_[output_slot_write_];
+    std::fill(slot.begin() + output_slot_fill_, slot.end(), 0);
+    output_slot_frames_[output_slot_write_] = output_slot_fill_;
+    output_slot_ready_[output_slot_write_] = true;
+    output_slot_write_ = (output_slot_write_ + 1) % NO_AUDIO_CODEC_OUTPUT_SLOTS;
+    output_slot_fill_ = 0;
+}
 
-    size_t bytes_written;
-    ESP_ERROR_CHECK(i2s_channel_write(tx_handle_, buffer.data(), samples * sizeof(int32_t), &bytes_written, portMAX_DELAY));
-    return bytes_written / sizeof(int32_t);
+void NoAudioCodec::ResetOutputSlots() {
+    portENTER_CRITICAL(&output_slot_lock_);
+    for (int i = 0; i < NO_AUDIO_CODEC_OUTPUT_SLOTS; i++) {
+        output_slot_ready_[i] = false;
+        output_slot_frames_[i] = 0;
+    }
+    output_slot_write_ = 0;
+    output_slot_read_ = 0;
+    output_slot_fill_ = 0;
+    portEXIT_CRITICAL(&output_slot_lock_);
 }
 
+void NoAudioCodec::EndOutputStream() {
+    {
+        std::lock_guard<std::mutex> lock(data_if_mutex_);
+        FlushOutputSlot();
+    }
+    AudioCodec::EndOutputStream();
+}
+
+void NoAudioCodec::EnableOutput(bool enable) {
+    if (!enable && output_enabled_) {
+        // Nothing queued is played once the output is off, the next stream starts clean
+        std::lock_guard<std::mutex> lock(data_if_mutex_);
+        ResetOutputSlots();
+        ResetOutputPosition();
+    }
+    AudioCodec::EnableOutput(enable);
+}
+
+bool IRAM_ATTR NoAudioCodec::OnOutputDmaSent(i2s_event_data_t* event, int& loaded) {
+    portENTER_CRITICAL_ISR(&output_slot_lock_);
+    if (!output_slot_ready_[output_slot_read_]) {
+        // Nothing converted yet, the buffer was cleared and plays silence
+        portEXIT_CRITICAL_ISR(&output_slot_lock_);
+        loaded = 0;
+        return false;
+    }
+
+    auto& slot = output_slots_[output_slot_read_];
+    size_t bytes = slot.size() * sizeof(int32_t);
+    memcpy(event->dma_buf, slot.data(), bytes < event->size ? bytes : event->size);
+    // The frames count as played when this DMA buffer has been sent again
+    loaded = output_slot_frames_[output_slot_read_];
+    output_slot_ready_[output_slot_read_] = false;
+    output_slot_read_ = (output_slot_read_ + 1) % NO_AUDIO_CODEC_OUTPUT_SLOTS;
+    portEXIT_CRITICAL_ISR(&output_slot_lock_);
+
+    BaseType_t need_yield = pdFALSE;
+    if (output_task_ != nullptr) {
+        vTaskNotifyGiveFromISR(output_task_, &need_yield);
+    }
+    return need_yield == pdTRUE;
+}
+#else
+int NoAudioCodec::Write(const int16_t* data, int samples) {
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    std::vector<int32_t> buffer(samples);
+    ConvertOutputSamples(data, buffer.data(), samples, output_volume_);
+
+    // One DMA buffer at a time, each counted before the driver waits for the buffer to be sent,
+    // so the TX callback credits the frames that refill it
+    const int period = dma_frame_num_ * output_channels_;
+    int offset = 0;
+    while (offset < samples) {
+        int count = std::min(period - output_dma_fill_, samples - offset);
+        CountWrittenFrames(count / output_channels_);
+        size_t bytes_written = 0;
+        ESP_ERROR_CHECK(i2s_channel_write(tx_handle_, buffer.data() + offset, count * sizeof(int32_t), &bytes_written, portMAX_DELAY));
+        offset += count;
+        output_dma_fill_ = (output_dma_fill_ + count) % period;
+    }
+    return samples;
+}
+#endif
+
 int NoAudioCodec::Read(int16_t* dest, int samples) {
+    std::lock_guard<std::mutex> lock(input_mutex_);
     size_t bytes_read;
 
     std::vector<int32_t> bit32_buffer(samples);
@@ -319,6 +557,7 @@ int NoAudioCodec::Read(int16_t* dest, int samples) {
 }
 
 int NoAudioCodecSimplexPdm::Read(int16_t* dest, int samples) {
+    std::lock_guard<std::mutex> lock(input_mutex_);
     size_t bytes_read;
 
     // PDM 解调后的数据位宽为 16 位，直接读取到目标缓冲区
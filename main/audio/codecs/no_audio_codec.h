@@ -5,17 +5,66 @@
 
 #include <driver/gpio.h>
 #include <driver/i2s_pdm.h>
+#include <freertos/task.h>
 #include <mutex>
 
+#if CONFIG_USE_ASYNC_I2S_OUTPUT
+#define NO_AUDIO_CODEC_OUTPUT_SLOTS 2
+#endif
+
+#define NO_AUDIO_CODEC_MIN_OUTPUT_SAMPLE_RATE 8000
+#define NO_AUDIO_CODEC_MAX_OUTPUT_SAMPLE_RATE 48000
+#define NO_AUDIO_CODEC_DRAIN_TIMEOUT_MS 300
+
 class NoAudioCodec : public AudioCodec {
 protected:
     std::mutex data_if_mutex_;
+    std::mutex input_mutex_;
+    // Kept to recreate the channels with another DMA geometry
+    i2s_chan_config_t tx_chan_cfg_ = {};
+    i2s_chan_config_t rx_chan_cfg_ = {};
+    i2s_std_config_t tx_std_cfg_ = {};
+    i2s_std_config_t rx_std_cfg_ = {};
+
+#if CONFIG_USE_ASYNC_I2S_OUTPUT
+    // Preconverted DMA periods, handed to the TX DMA buffers from the on_sent callback.
+    // A slot is only handed over full, or padded at the end of the stream
+    std::vector<int32_t> output_slots_[NO_AUDIO_CODEC_OUTPUT_SLOTS];
+    volatile bool output_slot_ready_[NO_AUDIO_CODEC_OUTPUT_SLOTS] = {};
+    int output_slot_frames_[NO_AUDIO_CODEC_OUTPUT_SLOTS] = {};
+    int output_slot_write_ = 0;
+    int output_slot_read_ = 0;
+    int output_slot_fill_ = 0;      // Frames already in the slot being written
+    portMUX_TYPE output_slot_lock_ = portMUX_INITIALIZER_UNLOCKED;
+    TaskHandle_t output_task_ = nullptr;
+
+    virtual bool OnOutputDmaSent(i2s_event_data_t* event, int& loaded) override;
+    // Hands the partly filled slot over, padded with silence. Called with data_if_mutex_ held
+    void FlushOutputSlot();
+    // Drops the slots that were not sent yet. Called with data_if_mutex_ held
+    void ResetOutputSlots();
+#else
+    int output_dma_fill_ = 0;       // Samples already in the DMA buffer the driver is filling
+#endif
 
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
+    virtual bool RecreateChannels() override;
+    // Creates the channels from the saved configs, duplex or one port per direction
+    virtual void CreateChannels();
 
 public:
+    NoAudioCodec();
     virtual ~NoAudioCodec();
+
+    // Only the simplex variants, a duplex port shares its clock with the mic
+    virtual bool SupportsOutputSampleRate(int sample_rate) const override;
+    virtual bool SetOutputSampleRate(int sample_rate) override;
+    virtual void ResyncInput() override;
+#if CONFIG_USE_ASYNC_I2S_OUTPUT
+    virtual void EnableOutput(bool enable) override;
+    virtual void EndOutputStream() override;
+#endif
 };
 
 class NoAudioCodecDuplex : public NoAudioCodec {
@@ -30,6 +79,14 @@ public:
 };
 
 class NoAudioCodecSimplexPdm : public NoAudioCodec {
+private:
+#if SOC_I2S_SUPPORTS_PDM_RX
+    i2s_pdm_rx_config_t pdm_rx_cfg_ = {};
+#endif
+
+protected:
+    virtual void CreateChannels() override;
+
 public:
     NoAudioCodecSimplexPdm(int input_sample_rate, int output_sample_rate, gpio_num_t spk_bclk, gpio_num_t spk_ws, gpio_num_t spk_dout, gpio_num_t mic_sck,  gpio_num_t mic_din);
     int Read(int16_t* dest, int samples);
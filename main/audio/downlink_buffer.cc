@@ -0,0 +1,239 @@
+#include "downlink_buffer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_memory_utils.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+
+#define TAG "DownlinkBuffer"
+
+DownlinkBuffer::~DownlinkBuffer() {
+    if (ring_ != nullptr) {
+        heap_caps_free(ring_);
+    }
+}
+
+bool DownlinkBuffer::Initialize(uint32_t capacity_ms) {
+    capacity_ms_ = capacity_ms;
+    capacity_bytes_ = (size_t)capacity_ms * DOWNLINK_BUFFER_BYTES_PER_SECOND / 1000;
+    ring_ = (uint8_t*)heap_caps_malloc(capacity_bytes_, MALLOC_CAP_SPIRAM);
+    if (ring_ == nullptr && capacity_ms_ > DOWNLINK_BUFFER_INTERNAL_MS) {
+        // A board may ask for more than internal RAM can spare
+        capacity_ms_ = DOWNLINK_BUFFER_INTERNAL_MS;
+        capacity_bytes_ = (size_t)capacity_ms_ * DOWNLINK_BUFFER_BYTES_PER_SECOND / 1000;
+    }
+    if (ring_ == nullptr) {
+        ring_ = (uint8_t*)heap_caps_malloc(capacity_bytes_, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (ring_ == nullptr) {
+        capacity_ms_ = 0;
+        capacity_bytes_ = 0;
+        ESP_LOGE(TAG, "Failed to allocate the buffer");
+        return false;
+    }
+    ESP_LOGI(TAG, "%lu ms (%u bytes) in %s, watermarks %lu / %lu ms", capacity_ms_, capacity_bytes_,
+        esp_ptr_external_ram(ring_) ? "PSRAM" : "internal RAM", high_watermark_ms(), low_watermark_ms());
+    DownlinkFlowEvent event;
+    Clear(event);
+    return true;
+}
+
+size_t DownlinkBuffer::RecordSize(size_t payload_size) {
+    // Keep the headers aligned
+    return (sizeof(Header) + payload_size + 3) & ~(size_t)3;
+}
+
+bool DownlinkBuffer::FindSpace(size_t size, size_t& offset) const {
+    if (count_ == 0) {
+        offset = 0;
+        return size <= capacity_bytes_;
+    }
+    if (wrapped_) {
+        offset = tail_;
+        return size <= head_ - tail_;
+    }
+    if (size <= capacity_bytes_ - tail_) {
+        offset = tail_;
+        return true;
+    }
+    offset = 0;
+    return size <= head_;
+}
+
+bool DownlinkBuffer::CanPush(const AudioStreamPacket& packet) const {
+    size_t offset;
+    return depth_ms_ + packet.frame_duration <= capacity_ms_ && FindSpace(RecordSize(packet.payload.size()), offset);
+}
+
+bool DownlinkBuffer::CanPushAll(const std::vector<std::unique_ptr<AudioStreamPacket>>& packets) const {
+    uint32_t duration = 0;
+    size_t bytes = 0;
+    size_t largest = 0;
+    for (auto& packet : packets) {
+        size_t size = RecordSize(packet->payload.size());
+        duration += packet->frame_duration;
+        bytes += size;
+        largest = std::max(largest, size);
+    }
+    // The end of the ring that is skipped on a wrap can waste up to a record, before and after
+    return depth_ms_ + duration <= capacity_ms_ && used_bytes_ + bytes + 2 * largest <= capacity_bytes_;
+}
+
+bool DownlinkBuffer::Push(std::unique_ptr<AudioStreamPacket>& packet, DownlinkFlowEvent& event) {
+    event = kDownlinkFlowNone;
+    size_t size = RecordSize(packet->payload.size());
+    size_t offset;
+    if (packet->payload.size() > UINT16_MAX || depth_ms_ + packet->frame_duration > capacity_ms_ ||
+        !FindSpace(size, offset)) {
+        return false;
+    }
+
+    UpdateOccupancy();
+    if (count_ == 0 && last_update_time_ - window_start_time_ >= DOWNLINK_BUFFER_REPORT_MS * 1000LL) {
+        // Audio arrives again after a pause, do not average the idle time into the report
+        ResetWindow(last_update_time_);
+    }
+
+    if (count_ > 0 && !wrapped_ && offset == 0) {
+        end_ = tail_;
+        wrapped_ = true;
+    }
+    Header header = {
+        .size = (uint16_t)packet->payload.size(),
+        .frame_duration = (uint16_t)packet->frame_duration,
+        .sample_rate = (uint16_t)packet->sample_rate,
+        .channels = (uint8_t)packet->channels,
+        .flags = 0,
+        .timestamp = packet->timestamp,
+    };
+    memcpy(ring_ + offset, &header, sizeof(header));
+    memcpy(ring_ + offset + sizeof(header), packet->payload.data(), header.size);
+    last_record_ = offset;
+    tail_ = offset + size;
+    copied_bytes_ += sizeof(header) + header.size;
+    used_bytes_ += size;
+    count_++;
+    depth_ms_ += header.frame_duration;
+    received_ms_ += header.frame_duration;
+    max_depth_ms_ = std::max(max_depth_ms_, depth_ms_);
+    packet.reset();
+
+    if (!paused_ && FillPercent() >= DOWNLINK_BUFFER_HIGH_PERCENT) {
+        paused_ = true;
+        pauses_++;
+        event = kDownlinkFlowPause;
+    }
+    return true;
+}
+
+bool DownlinkBuffer::MarkSegmentEnd() {
+    if (count_ == 0) {
+        return false;
+    }
+    ring_[last_record_ + offsetof(Header, flags)] |= kFlagSegmentEnd;
+    return true;
+}
+
+std::unique_ptr<AudioStreamPacket> DownlinkBuffer::Pop(DownlinkFlowEvent& event, bool* segment_end) {
+    event = kDownlinkFlowNone;
+    if (count_ == 0) {
+        return nullptr;
+    }
+    UpdateOccupancy();
+
+    Header header;
+    memcpy(&header, ring_ + head_, sizeof(header));
+    auto packet = std::make_unique<AudioStreamPacket>();
+    packet->sample_rate = header.sample_rate;
+    packet->frame_duration = header.frame_duration;
+    packet->channels = header.channels;
+    packet->timestamp = header.timestamp;
+    packet->payload.assign(ring_ + head_ + sizeof(header), ring_ + head_ + sizeof(header) + header.size);
+    copied_bytes_ += sizeof(header) + header.size;
+    if (segment_end != nullptr) {
+        *segment_end = (header.flags & kFlagSegmentEnd) != 0;
+    }
+
+    size_t size = RecordSize(header.size);
+    head_ += size;
+    used_bytes_ -= size;
+    count_--;
+    depth_ms_ -= header.frame_duration;
+    min_depth_ms_ = std::min(min_depth_ms_, depth_ms_);
+    if (count_ == 0) {
+        head_ = tail_ = 0;
+        wrapped_ = false;
+    } else if (wrapped_ && head_ >= end_) {
+        head_ = 0;
+        wrapped_ = false;
+    }
+
+    if (paused_ && FillPercent() <= DOWNLINK_BUFFER_LOW_PERCENT) {
+        paused_ = false;
+        event = kDownlinkFlowResume;
+    }
+    return packet;
+}
+
+void DownlinkBuffer::Clear(DownlinkFlowEvent& event) {
+    event = paused_ ? kDownlinkFlowResume : kDownlinkFlowNone;
+    UpdateOccupancy();
+    head_ = tail_ = 0;
+    wrapped_ = false;
+    used_bytes_ = 0;
+    count_ = 0;
+    depth_ms_ = 0;
+    min_depth_ms_ = 0;
+    paused_ = false;
+}
+
+int DownlinkBuffer::FillPercent() const {
+    if (capacity_ms_ == 0 || capacity_bytes_ == 0) {
+        return 100;
+    }
+    int time_percent = depth_ms_ * 100 / capacity_ms_;
+    int byte_percent = used_bytes_ * 100 / capacity_bytes_;
+    return std::max(time_percent, byte_percent);
+}
+
+void DownlinkBuffer::UpdateOccupancy() {
+    int64_t now = esp_timer_get_time();
+    if (window_start_time_ == 0) {
+        ResetWindow(now);
+        return;
+    }
+    weighted_depth_ += (uint64_t)depth_ms_ * (now - last_update_time_);
+    last_update_time_ = now;
+}
+
+void DownlinkBuffer::ResetWindow(int64_t now) {
+    window_start_time_ = now;
+    last_update_time_ = now;
+    weighted_depth_ = 0;
+    min_depth_ms_ = depth_ms_;
+    max_depth_ms_ = depth_ms_;
+    received_ms_ = 0;
+    dropped_ms_ = 0;
+    pauses_ = 0;
+    copied_bytes_ = 0;
+}
+
+bool DownlinkBuffer::GetOccupancyReport(DownlinkOccupancy& report) {
+    UpdateOccupancy();
+    int64_t elapsed = last_update_time_ - window_start_time_;
+    if (elapsed < DOWNLINK_BUFFER_REPORT_MS * 1000LL) {
+        return false;
+    }
+    report.min_ms = min_depth_ms_;
+    report.max_ms = max_depth_ms_;
+    report.average_ms = weighted_depth_ / elapsed;
+    report.received_ms = received_ms_;
+    report.dropped_ms = dropped_ms_;
+    report.pauses = pauses_;
+    report.copied_bytes = copied_bytes_;
+    ResetWindow(last_update_time_);
+    return true;
+}
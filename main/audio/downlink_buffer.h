@@ -0,0 +1,120 @@
+#ifndef DOWNLINK_BUFFER_H
+#define DOWNLINK_BUFFER_H
+
+#include "protocol.h"
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Holds the received Opus packets until the decoder takes them.
+ *
+ * The packets are copied into one byte ring, each after a small header, so a
+ * deep buffer costs no heap blocks per packet. The ring is allocated once in
+ * PSRAM, or in internal RAM when there is none. Its size is the capacity the
+ * board asks for (Board::GetDownlinkBufferMs) at DOWNLINK_BUFFER_BYTES_PER_SECOND.
+ *
+ * The fill level is the larger of the buffered duration and the used bytes,
+ * relative to the capacity. Crossing the high watermark asks the server to
+ * pause, falling to the low watermark lets it resume, so a server that honors
+ * it can send a whole sentence ahead and leave the radio idle.
+ */
+
+#define DOWNLINK_BUFFER_PSRAM_MS            30000
+#define DOWNLINK_BUFFER_INTERNAL_MS         2400
+#define DOWNLINK_BUFFER_SMALL_MS            1200    // for chips with little internal RAM, like the C3
+#define DOWNLINK_BUFFER_BYTES_PER_SECOND    6000    // 48 kbps of Opus with the packet headers
+#define DOWNLINK_BUFFER_HIGH_PERCENT        80
+#define DOWNLINK_BUFFER_LOW_PERCENT         40
+#define DOWNLINK_BUFFER_REPORT_MS           10000
+
+enum DownlinkFlowEvent {
+    kDownlinkFlowNone,
+    kDownlinkFlowPause,
+    kDownlinkFlowResume,
+};
+
+struct DownlinkOccupancy {
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint32_t average_ms;
+    uint32_t received_ms;
+    uint32_t dropped_ms;
+    uint32_t pauses;
+    uint32_t copied_bytes;      // Into the ring and back out to the packets, headers included
+};
+
+class DownlinkBuffer {
+public:
+    DownlinkBuffer() = default;
+    ~DownlinkBuffer();
+
+    bool Initialize(uint32_t capacity_ms);
+    // Returns false if the packet does not fit, it is left untouched
+    bool Push(std::unique_ptr<AudioStreamPacket>& packet, DownlinkFlowEvent& event);
+    // segment_end is set when the packet is the last one before a MarkSegmentEnd
+    std::unique_ptr<AudioStreamPacket> Pop(DownlinkFlowEvent& event, bool* segment_end = nullptr);
+    // Marks the last pushed packet as the end of a sentence or turn, returns false if it was already popped
+    bool MarkSegmentEnd();
+    bool CanPush(const AudioStreamPacket& packet) const;
+    // True if all the packets are sure to fit, whatever the wrap position of the ring
+    bool CanPushAll(const std::vector<std::unique_ptr<AudioStreamPacket>>& packets) const;
+    void Clear(DownlinkFlowEvent& event);
+    // Counts a packet that was thrown away because it did not fit
+    void CountDropped(uint32_t duration_ms) { dropped_ms_ += duration_ms; }
+    // Fills the report once every DOWNLINK_BUFFER_REPORT_MS while audio arrives
+    bool GetOccupancyReport(DownlinkOccupancy& report);
+
+    inline bool empty() const { return count_ == 0; }
+    inline size_t size() const { return count_; }
+    inline uint32_t depth_ms() const { return depth_ms_; }
+    inline uint32_t capacity_ms() const { return capacity_ms_; }
+    inline uint32_t high_watermark_ms() const { return capacity_ms_ * DOWNLINK_BUFFER_HIGH_PERCENT / 100; }
+    inline uint32_t low_watermark_ms() const { return capacity_ms_ * DOWNLINK_BUFFER_LOW_PERCENT / 100; }
+    inline bool paused() const { return paused_; }
+
+private:
+    struct Header {
+        uint16_t size;
+        uint16_t frame_duration;
+        uint16_t sample_rate;
+        uint8_t channels;
+        uint8_t flags;
+        uint32_t timestamp;
+    };
+    static const uint8_t kFlagSegmentEnd = 0x01;
+
+    uint8_t* ring_ = nullptr;
+    size_t capacity_bytes_ = 0;
+    uint32_t capacity_ms_ = 0;
+    size_t head_ = 0;               // Next record to read
+    size_t tail_ = 0;               // Where the next record is written
+    size_t end_ = 0;                // End of the older records while wrapped_ is set
+    size_t last_record_ = 0;        // The record pushed last, while count_ > 0
+    bool wrapped_ = false;          // The write position went back to the start of the ring
+    size_t used_bytes_ = 0;
+    size_t count_ = 0;
+    uint32_t depth_ms_ = 0;
+    bool paused_ = false;
+
+    // Occupancy over the current report window, weighted by time
+    int64_t window_start_time_ = 0;
+    int64_t last_update_time_ = 0;
+    uint64_t weighted_depth_ = 0;
+    uint32_t min_depth_ms_ = 0;
+    uint32_t max_depth_ms_ = 0;
+    uint32_t received_ms_ = 0;
+    uint32_t dropped_ms_ = 0;
+    uint32_t pauses_ = 0;
+    uint32_t copied_bytes_ = 0;
+
+    static size_t RecordSize(size_t payload_size);
+    bool FindSpace(size_t size, size_t& offset) const;
+    int FillPercent() const;
+    void UpdateOccupancy();
+    void ResetWindow(int64_t now);
+};
+
+#endif // DOWNLINK_BUFFER_H
@@ -0,0 +1,47 @@
+#ifndef BIQUAD_EQ_H
+#define BIQUAD_EQ_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+/*
+ * Playback equalizer made of a cascade of fixed-point biquads (direct form I).
+ *
+ * The cascade is described by a string, one band per ';' separated entry:
+ *     "type,frequency,gain_db,q"   e.g. "hp,180,0,0.707;peak,3000,4,1.2"
+ * Supported types: lp, hp, peak, lowshelf, highshelf (RBJ cookbook designs).
+ *
+ * Coefficients are Q28 so shelf and peak gains up to +12 dB fit, the state is
+ * kept in 32 bits between bands and the output is saturated to 16 bits once.
+ */
+
+#define BIQUAD_EQ_MAX_BANDS     6
+#define BIQUAD_EQ_COEF_SHIFT    28
+
+class BiquadEq {
+public:
+    BiquadEq() = default;
+
+    // An empty description disables the equalizer, returns false if it cannot be parsed
+    bool Configure(const std::string& description, int sample_rate);
+    void Reset();
+    void Process(std::vector<int16_t>& pcm);
+
+    inline bool enabled() const { return !bands_.empty(); }
+    inline int band_count() const { return bands_.size(); }
+    inline const std::string& description() const { return description_; }
+
+private:
+    struct Band {
+        int32_t b0, b1, b2, a1, a2;
+        int32_t x1, x2, y1, y2;
+    };
+
+    std::string description_;
+    std::vector<Band> bands_;
+
+    static bool DesignBand(const char* type, float frequency, float gain_db, float q, int sample_rate, Band& band);
+};
+
+#endif // BIQUAD_EQ_H
@@ -0,0 +1,152 @@
+#include "echo_delay_estimator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+void EchoDelayEstimator::Configure(int sample_rate) {
+    decimation_ = std::max(1, sample_rate / ECHO_DELAY_RATE);
+    max_lag_ = ECHO_DELAY_MAX_MS * ECHO_DELAY_RATE / 1000;
+    Reset();
+}
+
+void EchoDelayEstimator::Reset() {
+    mic_.clear();
+    reference_.clear();
+    correlation_.assign(2 * max_lag_ + 1, 0);
+    mic_energy_ = 0;
+    reference_energy_ = 0;
+    active_samples_ = 0;
+    last_mic_ = 0;
+    last_reference_ = 0;
+}
+
+void EchoDelayEstimator::SetDelay(float delay_ms) {
+    delay_ms_ = std::clamp<float>(delay_ms, -ECHO_DELAY_MAX_MS, ECHO_DELAY_MAX_MS);
+    valid_ = true;
+    has_candidate_ = false;
+}
+
+bool EchoDelayEstimator::Feed(const std::vector<int16_t>& data) {
+    if (decimation_ == 0) {
+        return false;
+    }
+
+    size_t start = mic_.size();
+    size_t frames = data.size() / 2;
+    int64_t reference_level = 0;
+    for (size_t i = 0; i + decimation_ <= frames; i += decimation_) {
+        int32_t m = 0, r = 0;
+        for (int j = 0; j < decimation_; j++) {
+            m += data[(i + j) * 2];
+            r += data[(i + j) * 2 + 1];
+        }
+        m /= decimation_;
+        r /= decimation_;
+        // The first difference whitens speech a little, so the peak gets narrower.
+        // Scaled to 15 bits, the products fit in 32 bits
+        mic_.push_back((m - last_mic_) >> 2);
+        reference_.push_back((r - last_reference_) >> 2);
+        last_mic_ = m;
+        last_reference_ = r;
+        reference_level += (int64_t)r * r;
+    }
+
+    size_t added = mic_.size() - start;
+    if (added == 0) {
+        return false;
+    }
+
+    // Only correlate while the reference carries playback, silence says nothing about the delay
+    if (reference_level / (int64_t)added >= ECHO_DELAY_ACTIVE_RMS * ECHO_DELAY_ACTIVE_RMS) {
+        const int span = 2 * max_lag_;
+        for (size_t n = std::max<size_t>(start, span); n < mic_.size(); n++) {
+            // Center sample m sees the reference from m - max_lag_ to m + max_lag_
+            size_t m = n - max_lag_;
+            int32_t x = mic_[m];
+            const int32_t* reference = &reference_[m - max_lag_];
+            for (int k = 0; k <= span; k++) {
+                correlation_[k] += x * reference[span - k];
+            }
+            mic_energy_ += x * x;
+            reference_energy_ += reference_[m] * reference_[m];
+            active_samples_++;
+        }
+    }
+
+    if (mic_.size() > (size_t)(2 * max_lag_)) {
+        size_t drop = mic_.size() - 2 * max_lag_;
+        mic_.erase(mic_.begin(), mic_.begin() + drop);
+        reference_.erase(reference_.begin(), reference_.begin() + drop);
+    }
+
+    if (active_samples_ < ECHO_DELAY_WINDOW_MS * ECHO_DELAY_RATE / 1000) {
+        return false;
+    }
+
+    float delay_ms;
+    bool measured = Measure(delay_ms);
+    std::fill(correlation_.begin(), correlation_.end(), 0);
+    mic_energy_ = 0;
+    reference_energy_ = 0;
+    active_samples_ = 0;
+    if (!measured) {
+        return false;
+    }
+
+    if (!valid_) {
+        delay_ms_ = delay_ms;
+        valid_ = true;
+    } else if (fabsf(delay_ms - delay_ms_) <= ECHO_DELAY_JUMP_MS) {
+        delay_ms_ += (delay_ms - delay_ms_) / 4;
+        has_candidate_ = false;
+    } else if (has_candidate_ && fabsf(delay_ms - candidate_ms_) <= ECHO_DELAY_JUMP_MS) {
+        delay_ms_ = delay_ms;
+        has_candidate_ = false;
+    } else {
+        candidate_ms_ = delay_ms;
+        has_candidate_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool EchoDelayEstimator::Measure(float& delay_ms) {
+    const int span = 2 * max_lag_;
+    int best = 0;
+    int64_t best_value = -1;
+    for (int k = 0; k <= span; k++) {
+        int64_t value = llabs(correlation_[k]);
+        if (value > best_value) {
+            best_value = value;
+            best = k;
+        }
+    }
+
+    int64_t side_value = 0;
+    for (int k = 0; k <= span; k++) {
+        if (abs(k - best) > 2) {
+            side_value = std::max<int64_t>(side_value, llabs(correlation_[k]));
+        }
+    }
+
+    float norm = sqrtf((float)mic_energy_ * (float)reference_energy_);
+    coherence_ = norm > 0 ? best_value / norm : 0;
+    if (coherence_ < ECHO_DELAY_MIN_COHERENCE || best_value < side_value * ECHO_DELAY_MIN_PEAK_RATIO) {
+        return false;
+    }
+
+    // Fit a parabola through the peak and its neighbours for a delay between lags
+    float offset = 0;
+    if (best > 0 && best < span) {
+        float y0 = llabs(correlation_[best - 1]);
+        float y1 = best_value;
+        float y2 = llabs(correlation_[best + 1]);
+        float curvature = y0 - 2 * y1 + y2;
+        if (curvature < 0) {
+            offset = 0.5f * (y0 - y2) / curvature;
+        }
+    }
+    delay_ms = (best - max_lag_ + offset) * 1000.0f / ECHO_DELAY_RATE;
+    return true;
+}
@@ -0,0 +1,65 @@
+#ifndef ECHO_DELAY_ESTIMATOR_H
+#define ECHO_DELAY_ESTIMATOR_H
+
+#include <vector>
+#include <cstdint>
+
+/*
+ * Measures how far the echo in the mic channel lags the reference channel.
+ *
+ * Both channels are decimated to ECHO_DELAY_RATE and pre-emphasized, then
+ * cross-correlated over +/- ECHO_DELAY_MAX_MS while the reference carries
+ * playback. After ECHO_DELAY_WINDOW_MS of active reference the correlation
+ * peak gives a new measurement, interpolated between lags. It is accepted if
+ * it is clearly above the rest of the correlation; a measurement far from
+ * the current estimate has to be seen twice before the estimate jumps.
+ *
+ * A positive delay means the echo arrives after the reference.
+ */
+
+#define ECHO_DELAY_RATE             4000
+#define ECHO_DELAY_MAX_MS           32
+#define ECHO_DELAY_WINDOW_MS        500
+#define ECHO_DELAY_ACTIVE_RMS       300     // Reference level that counts as playback
+#define ECHO_DELAY_MIN_COHERENCE    0.2f    // Normalized correlation at the peak
+#define ECHO_DELAY_MIN_PEAK_RATIO   1.5f    // Peak over the largest value away from it
+#define ECHO_DELAY_JUMP_MS          2.0f    // Farther than this needs a second measurement
+
+class EchoDelayEstimator {
+public:
+    EchoDelayEstimator() = default;
+
+    void Configure(int sample_rate);
+    void Reset();
+    // Interleaved mic / reference frames, returns true when the estimate changed
+    bool Feed(const std::vector<int16_t>& data);
+    // Starts from a saved estimate
+    void SetDelay(float delay_ms);
+
+    inline bool valid() const { return valid_; }
+    inline float delay_ms() const { return delay_ms_; }
+    inline float coherence() const { return coherence_; }
+    inline int DelaySamples(int sample_rate) const { return (int)(delay_ms_ * sample_rate / 1000 + (delay_ms_ >= 0 ? 0.5f : -0.5f)); }
+
+private:
+    int decimation_ = 0;
+    int max_lag_ = 0;
+    std::vector<int32_t> mic_;              // Decimated history, the last 2 * max_lag_ samples are kept
+    std::vector<int32_t> reference_;
+    std::vector<int64_t> correlation_;      // Indexed by lag + max_lag_
+    int64_t mic_energy_ = 0;
+    int64_t reference_energy_ = 0;
+    int active_samples_ = 0;
+    int32_t last_mic_ = 0;
+    int32_t last_reference_ = 0;
+
+    bool valid_ = false;
+    float delay_ms_ = 0;
+    float coherence_ = 0;
+    bool has_candidate_ = false;
+    float candidate_ms_ = 0;
+
+    bool Measure(float& delay_ms);
+};
+
+#endif // ECHO_DELAY_ESTIMATOR_H
@@ -0,0 +1,126 @@
+#include "echo_reference.h"
+
+#include <algorithm>
+#include <cmath>
+
+void EchoReference::Configure(int input_sample_rate, int output_sample_rate) {
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+    history_.assign((size_t)output_sample_rate * ECHO_REFERENCE_HISTORY_MS / 1000, 0);
+
+    // Low pass at the lower Nyquist rate, in cycles per output sample
+    const float cutoff = ECHO_REFERENCE_CUTOFF * std::min(input_sample_rate, output_sample_rate) / output_sample_rate;
+    const int half = ECHO_REFERENCE_TAPS / 2;
+    filter_.resize(ECHO_REFERENCE_PHASES * ECHO_REFERENCE_TAPS);
+    for (int p = 0; p < ECHO_REFERENCE_PHASES; p++) {
+        float* row = &filter_[p * ECHO_REFERENCE_TAPS];
+        float sum = 0;
+        for (int k = 0; k < ECHO_REFERENCE_TAPS; k++) {
+            // Distance of tap k from the interpolated position
+            float d = k - (half - 1) - (float)p / ECHO_REFERENCE_PHASES;
+            float x = 2 * cutoff * d;
+            float sinc = fabsf(x) < 1e-6f ? 1.0f : sinf(M_PI * x) / (M_PI * x);
+            float window = 0.5f + 0.5f * cosf(M_PI * d / half);
+            row[k] = sinc * window;
+            sum += row[k];
+        }
+        for (int k = 0; k < ECHO_REFERENCE_TAPS; k++) {
+            row[k] /= sum;
+        }
+    }
+    Reset();
+}
+
+void EchoReference::Reset() {
+    std::fill(history_.begin(), history_.end(), 0);
+    written_ = 0;
+    written_index_ = 0;
+    clocks_.clear();
+}
+
+void EchoReference::Write(const int16_t* data, size_t frames, int channels, uint32_t first_frame) {
+    if (history_.empty()) {
+        return;
+    }
+    size_t index = written_index_;
+    if (first_frame != written_) {
+        // The position jumped, the frames in between were never played
+        std::fill(history_.begin(), history_.end(), 0);
+        index = 0;
+    }
+    const size_t size = history_.size();
+    for (size_t i = 0; i < frames; i++) {
+        int32_t sum = 0;
+        for (int c = 0; c < channels; c++) {
+            sum += data[i * channels + c];
+        }
+        history_[index] = sum / channels;
+        if (++index == size) {
+            index = 0;
+        }
+    }
+    written_index_ = index;
+    written_ = first_frame + frames;
+}
+
+void EchoReference::AddOutputClock(const EchoReferenceClock& clock) {
+    if (!clocks_.empty() && clock.time_us <= clocks_.back().time_us) {
+        return;
+    }
+    clocks_.push_back(clock);
+    if (clocks_.size() > ECHO_REFERENCE_CLOCKS) {
+        clocks_.pop_front();
+    }
+}
+
+float EchoReference::Interpolate(double position) const {
+    // Position relative to written_, the history holds [-size, 0)
+    const int64_t size = history_.size();
+    const int half = ECHO_REFERENCE_TAPS / 2;
+    double base = floor(position);
+    int phase = (int)lround((position - base) * ECHO_REFERENCE_PHASES);
+    int64_t first = (int64_t)base - (half - 1);
+    if (phase == ECHO_REFERENCE_PHASES) {
+        phase = 0;
+        first++;
+    }
+    if (first + ECHO_REFERENCE_TAPS <= -size || first >= 0) {
+        return 0;
+    }
+
+    const float* row = &filter_[phase * ECHO_REFERENCE_TAPS];
+    float sum = 0;
+    for (int k = 0; k < ECHO_REFERENCE_TAPS; k++) {
+        int64_t index = first + k;
+        if (index < -size || index >= 0) {
+            continue;
+        }
+        sum += row[k] * history_[((int64_t)written_index_ + size + index) % size];
+    }
+    return sum;
+}
+
+void EchoReference::Read(int16_t* dest, size_t frames, size_t stride, int64_t capture_time_us) {
+    const double frame_us = 1e6 / input_sample_rate_;
+    size_t clock = 0;
+    for (size_t i = 0; i < frames; i++) {
+        dest[i * stride] = 0;
+        int64_t time_us = capture_time_us + (int64_t)(i * frame_us);
+        while (clock + 1 < clocks_.size() && clocks_[clock + 1].time_us <= time_us) {
+            clock++;
+        }
+        if (clocks_.empty() || time_us < clocks_[clock].time_us) {
+            continue;
+        }
+
+        const EchoReferenceClock& c = clocks_[clock];
+        double elapsed = (time_us - c.time_us) * (double)output_sample_rate_ / 1e6;
+        if (elapsed >= c.queued) {
+            // The queue ran dry, the output was sending silence
+            continue;
+        }
+        double position = (int32_t)(c.played - written_) + elapsed;
+        float value = Interpolate(position);
+        dest[i * stride] = (int16_t)std::clamp<float>(lroundf(value), INT16_MIN, INT16_MAX);
+    }
+}
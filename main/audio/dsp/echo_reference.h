@@ -0,0 +1,67 @@
+#ifndef ECHO_REFERENCE_H
+#define ECHO_REFERENCE_H
+
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Rebuilds the echo reference channel from the played PCM, for codecs that
+ * cannot capture their own output.
+ *
+ * The output side writes every frame it hands to the I2S driver, numbered by
+ * the output position, and reports the TX DMA clock: at time_us frame
+ * `played` started to play and `queued` more frames followed without a gap.
+ * The input side asks for the reference of a block of mic frames by the
+ * capture time of its first frame, taken from the RX DMA clock. Each mic
+ * frame is mapped through the latest TX clock before it to a fractional
+ * output position, and the played PCM is interpolated there with a windowed
+ * sinc that also band limits it for the input rate. Frames that were not
+ * playing at that time (silence sent on an empty queue) give zeros.
+ *
+ * What is left is the converter and acoustic delay, which the AEC filter and
+ * the echo delay estimator absorb. Nothing here depends on the device,
+ * tests/host/echo_reference_test drives it with synthetic clocks.
+ */
+
+#define ECHO_REFERENCE_HISTORY_MS   300     // Covers the output DMA queue plus the input backlog
+#define ECHO_REFERENCE_CLOCKS       32      // TX DMA interrupts kept, 200 ms at 160 frames / 24 kHz
+#define ECHO_REFERENCE_TAPS         16
+#define ECHO_REFERENCE_PHASES       32
+#define ECHO_REFERENCE_CUTOFF       0.45f   // of the lower sample rate
+
+struct EchoReferenceClock {
+    int64_t time_us;
+    uint32_t played;
+    uint32_t queued;
+};
+
+class EchoReference {
+public:
+    EchoReference() = default;
+
+    void Configure(int input_sample_rate, int output_sample_rate);
+    void Reset();
+    // Played PCM, first_frame is the output position of its first frame
+    void Write(const int16_t* data, size_t frames, int channels, uint32_t first_frame);
+    void AddOutputClock(const EchoReferenceClock& clock);
+    // Writes the reference of mic frames captured from capture_time_us on to every stride-th sample of dest
+    void Read(int16_t* dest, size_t frames, size_t stride, int64_t capture_time_us);
+
+    inline int input_sample_rate() const { return input_sample_rate_; }
+    inline int output_sample_rate() const { return output_sample_rate_; }
+
+private:
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+    std::vector<int16_t> history_;
+    uint32_t written_ = 0;          // Output position after the last written frame
+    size_t written_index_ = 0;      // Its slot in history_, the positions wrap at 2^32 and the slots do not
+    std::deque<EchoReferenceClock> clocks_;
+    std::vector<float> filter_;     // ECHO_REFERENCE_PHASES rows of ECHO_REFERENCE_TAPS
+
+    float Interpolate(double position) const;
+};
+
+#endif // ECHO_REFERENCE_H
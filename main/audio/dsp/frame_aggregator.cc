@@ -0,0 +1,101 @@
+#include "frame_aggregator.h"
+
+#include <algorithm>
+#include <cstring>
+
+void FrameAggregator::Configure(size_t frame_samples, size_t capacity) {
+    frame_samples_ = frame_samples;
+    buffer_.assign(std::max(capacity, frame_samples), 0);
+    Reset();
+}
+
+void FrameAggregator::Reserve(size_t capacity) {
+    if (capacity <= buffer_.size()) {
+        return;
+    }
+    // Unwrap the samples to the start of the new ring
+    std::vector<int16_t> buffer(capacity, 0);
+    size_t count = Read(buffer.data(), count_);
+    buffer_.swap(buffer);
+    head_ = 0;
+    count_ = count;
+}
+
+void FrameAggregator::Reset() {
+    head_ = 0;
+    count_ = 0;
+}
+
+size_t FrameAggregator::Write(const int16_t* data, size_t samples, size_t stride) {
+    if (buffer_.empty()) {
+        return 0;
+    }
+    const size_t size = buffer_.size();
+    samples = std::min(samples, size - count_);
+    size_t tail = (head_ + count_) % size;
+    for (size_t done = 0; done < samples;) {
+        // Up to the end of the ring, then from its start
+        size_t span = std::min(samples - done, size - tail);
+        int16_t* out = &buffer_[tail];
+        if (stride == 1) {
+            memcpy(out, data + done, span * sizeof(int16_t));
+        } else {
+            for (size_t i = 0; i < span; i++) {
+                out[i] = data[(done + i) * stride];
+            }
+        }
+        done += span;
+        tail = (tail + span) % size;
+    }
+    count_ += samples;
+    return samples;
+}
+
+size_t FrameAggregator::WriteSilence(size_t samples) {
+    if (buffer_.empty()) {
+        return 0;
+    }
+    const size_t size = buffer_.size();
+    samples = std::min(samples, size - count_);
+    size_t tail = (head_ + count_) % size;
+    for (size_t done = 0; done < samples;) {
+        size_t span = std::min(samples - done, size - tail);
+        std::fill_n(&buffer_[tail], span, 0);
+        done += span;
+        tail = (tail + span) % size;
+    }
+    count_ += samples;
+    return samples;
+}
+
+size_t FrameAggregator::Read(int16_t* dest, size_t samples, size_t stride) {
+    const size_t size = buffer_.size();
+    samples = std::min(samples, count_);
+    for (size_t done = 0; done < samples;) {
+        size_t span = std::min(samples - done, size - head_);
+        const int16_t* in = &buffer_[head_];
+        if (stride == 1) {
+            memcpy(dest + done, in, span * sizeof(int16_t));
+        } else {
+            for (size_t i = 0; i < span; i++) {
+                dest[(done + i) * stride] = in[i];
+            }
+        }
+        done += span;
+        head_ = (head_ + span) % size;
+    }
+    count_ -= samples;
+    if (count_ == 0) {
+        head_ = 0;
+    }
+    return samples;
+}
+
+bool FrameAggregator::ReadFrame(std::vector<int16_t>& frame) {
+    if (frame_samples_ == 0 || count_ < frame_samples_) {
+        return false;
+    }
+    frame.resize(frame_samples_);
+    Read(frame.data(), frame_samples_);
+    return true;
+}
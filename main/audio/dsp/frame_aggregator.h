@@ -0,0 +1,47 @@
+#ifndef FRAME_AGGREGATOR_H
+#define FRAME_AGGREGATOR_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * A sample ring that turns the chunks of a producer into frames of another size,
+ * like the 512 sample AFE fetches into 60 ms encoder frames.
+ *
+ * Reading a frame only moves the read position, nothing is shifted down as with
+ * erasing the front of a vector. The ring is allocated by Configure, and only
+ * grows again through Reserve, a write that does not fit is cut short. Writes and reads can step over interleaved
+ * samples, so one channel of a multi-channel buffer goes through without a copy.
+ */
+
+class FrameAggregator {
+public:
+    FrameAggregator() = default;
+
+    // capacity is in samples and should hold a frame plus the largest chunk
+    void Configure(size_t frame_samples, size_t capacity);
+    // Grows the ring to at least capacity samples, keeping what it holds
+    void Reserve(size_t capacity);
+    void Reset();
+    // Returns the number of samples taken, every stride-th sample of data is read
+    size_t Write(const int16_t* data, size_t samples, size_t stride = 1);
+    // Appends silence, for a delay line
+    size_t WriteSilence(size_t samples);
+    // Returns the number of samples read to every stride-th sample of dest
+    size_t Read(int16_t* dest, size_t samples, size_t stride = 1);
+    // Fills frame with the next frame_samples, false if there is no full frame yet
+    bool ReadFrame(std::vector<int16_t>& frame);
+
+    inline size_t available() const { return count_; }
+    inline size_t frame_samples() const { return frame_samples_; }
+    inline size_t capacity() const { return buffer_.size(); }
+
+private:
+    std::vector<int16_t> buffer_;
+    size_t frame_samples_ = 0;
+    size_t head_ = 0;   // Next sample to read
+    size_t count_ = 0;
+};
+
+#endif // FRAME_AGGREGATOR_H
@@ -0,0 +1,103 @@
+#include "latency_probe.h"
+
+#include <algorithm>
+#include <cmath>
+
+void LatencyProbe::Configure(int sample_rate, int capture_ms) {
+    sample_rate_ = sample_rate;
+    capacity_ = (size_t)sample_rate * capture_ms / 1000;
+    Generate(sample_rate, probe_);
+    probe_energy_ = 0;
+    for (auto sample : probe_) {
+        probe_energy_ += (int32_t)sample * sample;
+    }
+    Reset();
+}
+
+void LatencyProbe::Reset() {
+    capture_.clear();
+    capture_.reserve(capacity_);
+    coherence_ = 0;
+}
+
+void LatencyProbe::Capture(const int16_t* data, size_t samples, size_t stride) {
+    for (size_t i = 0; i < samples && capture_.size() < capacity_; i++) {
+        capture_.push_back(data[i * stride]);
+    }
+}
+
+bool LatencyProbe::Find(size_t min_lag, size_t max_lag, float& lag) {
+    const size_t length = probe_.size();
+    if (length == 0 || capture_.size() < length) {
+        return false;
+    }
+    max_lag = std::min(max_lag, capture_.size() - length);
+    if (min_lag > max_lag) {
+        return false;
+    }
+
+    correlation_.resize(max_lag - min_lag + 1);
+    size_t best = 0;
+    float best_value = -1;
+    for (size_t k = min_lag; k <= max_lag; k++) {
+        const int16_t* x = &capture_[k];
+        int64_t sum = 0;
+        for (size_t i = 0; i < length; i++) {
+            sum += (int32_t)x[i] * probe_[i];
+        }
+        // The speaker may invert the polarity, so only the magnitude counts
+        float value = fabsf((float)sum);
+        correlation_[k - min_lag] = value;
+        if (value > best_value) {
+            best_value = value;
+            best = k - min_lag;
+        }
+    }
+
+    const size_t guard = sample_rate_ * 2 / 1000;
+    float side_value = 0;
+    for (size_t k = 0; k < correlation_.size(); k++) {
+        if (k + guard < best || k > best + guard) {
+            side_value = std::max(side_value, correlation_[k]);
+        }
+    }
+
+    int64_t window_energy = 0;
+    for (size_t i = 0; i < length; i++) {
+        int32_t x = capture_[min_lag + best + i];
+        window_energy += x * x;
+    }
+    float norm = sqrtf((float)probe_energy_ * (float)window_energy);
+    coherence_ = norm > 0 ? best_value / norm : 0;
+    if (coherence_ < LATENCY_PROBE_MIN_COHERENCE || best_value < side_value * LATENCY_PROBE_MIN_PEAK_RATIO) {
+        return false;
+    }
+
+    // Fit a parabola through the peak and its neighbours for a lag between samples
+    float offset = 0;
+    if (best > 0 && best + 1 < correlation_.size()) {
+        float y0 = correlation_[best - 1];
+        float y1 = best_value;
+        float y2 = correlation_[best + 1];
+        float curvature = y0 - 2 * y1 + y2;
+        if (curvature < 0) {
+            offset = 0.5f * (y0 - y2) / curvature;
+        }
+    }
+    lag = min_lag + best + offset;
+    return true;
+}
+
+void LatencyProbe::Generate(int sample_rate, std::vector<int16_t>& pcm) {
+    const int samples = sample_rate * LATENCY_PROBE_DURATION_MS / 1000;
+    const int fade = sample_rate * LATENCY_PROBE_FADE_MS / 1000;
+    const float duration = LATENCY_PROBE_DURATION_MS / 1000.0f;
+    const float sweep = (LATENCY_PROBE_END_HZ - LATENCY_PROBE_START_HZ) / (2 * duration);
+    pcm.resize(samples);
+    for (int i = 0; i < samples; i++) {
+        float t = (float)i / sample_rate;
+        float phase = 2 * M_PI * (LATENCY_PROBE_START_HZ * t + sweep * t * t);
+        float gain = std::min(1.0f, (float)std::min(i, samples - 1 - i) / fade);
+        pcm[i] = (int16_t)(LATENCY_PROBE_AMPLITUDE * gain * sinf(phase));
+    }
+}
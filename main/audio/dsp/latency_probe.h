@@ -0,0 +1,61 @@
+#ifndef LATENCY_PROBE_H
+#define LATENCY_PROBE_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Finds a known probe signal in a captured mic window, for the acoustic
+ * round-trip latency self test.
+ *
+ * The probe is a linear chirp over the band small speakers reproduce, with
+ * short fades, so it can be rendered exactly at any output rate. The mic is
+ * captured at the analysis rate; Find() cross-correlates the window with the
+ * probe over the allowed lags and interpolates the peak between samples.
+ * A peak is only accepted when its normalized correlation and its margin
+ * over the rest of the curve are high enough.
+ *
+ * Nothing here depends on the device, tests/host/latency_probe_test feeds it
+ * synthetic captures.
+ */
+
+#define LATENCY_PROBE_DURATION_MS       80
+#define LATENCY_PROBE_FADE_MS           5
+#define LATENCY_PROBE_START_HZ          500.0f
+#define LATENCY_PROBE_END_HZ            4000.0f
+#define LATENCY_PROBE_AMPLITUDE         12000
+#define LATENCY_PROBE_MIN_COHERENCE     0.2f    // Normalized correlation at the peak
+#define LATENCY_PROBE_MIN_PEAK_RATIO    1.5f    // Peak over the largest value 2 ms or more away
+
+class LatencyProbe {
+public:
+    LatencyProbe() = default;
+
+    // Sets the analysis rate and the capture capacity
+    void Configure(int sample_rate, int capture_ms);
+    void Reset();
+    // Appends mono mic samples, taking every stride-th sample of data
+    void Capture(const int16_t* data, size_t samples, size_t stride = 1);
+    // Searches lags from min_lag up to max_lag samples into the window for the start of the probe
+    bool Find(size_t min_lag, size_t max_lag, float& lag);
+
+    // The probe rendered at any sample rate
+    static void Generate(int sample_rate, std::vector<int16_t>& pcm);
+
+    inline bool full() const { return capture_.size() >= capacity_; }
+    inline size_t captured() const { return capture_.size(); }
+    inline int sample_rate() const { return sample_rate_; }
+    inline float coherence() const { return coherence_; }
+
+private:
+    int sample_rate_ = 0;
+    size_t capacity_ = 0;
+    std::vector<int16_t> probe_;
+    int64_t probe_energy_ = 0;
+    std::vector<int16_t> capture_;
+    std::vector<float> correlation_;       // Float halves the memory, the peak needs no more precision
+    float coherence_ = 0;
+};
+
+#endif // LATENCY_PROBE_H
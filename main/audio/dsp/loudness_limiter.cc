@@ -0,0 +1,173 @@
+#include "loudness_limiter.h"
+
+#include <algorithm>
+#include <climits>
+
+// Integer square root for the integrated mean square
+static uint32_t ISqrt(uint64_t value) {
+    uint64_t result = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)result;
+}
+
+static int Log2Floor(int value) {
+    int shift = 0;
+    while ((value >> (shift + 1)) > 0) {
+        shift++;
+    }
+    return shift;
+}
+
+void LoudnessLimiter::Configure(int sample_rate) {
+    sample_rate_ = sample_rate;
+    lookahead_ = std::max(1, sample_rate * LOUDNESS_LOOKAHEAD_MS / 1000);
+    // The attack reaches ~98% of the target gain within the look-ahead window
+    attack_shift_ = std::max(1, Log2Floor(lookahead_ / 4));
+    release_shift_ = std::max(1, Log2Floor(sample_rate * LOUDNESS_RELEASE_MS / 1000));
+
+    delay_line_.assign(lookahead_, 0);
+    peak_values_.assign(lookahead_ + 1, 0);
+    peak_positions_.assign(lookahead_ + 1, 0);
+    Reset();
+}
+
+void LoudnessLimiter::Reset() {
+    integrated_ms_ = 0;
+    normalize_gain_ = 32768;
+    hp_x1_ = 0;
+    hp_y1_ = 0;
+
+    limiter_gain_ = 32768;
+    std::fill(delay_line_.begin(), delay_line_.end(), 0);
+    delay_pos_ = 0;
+    peak_head_ = 0;
+    peak_count_ = 0;
+    position_ = 0;
+}
+
+int32_t LoudnessLimiter::MeasureMeanSquare(const std::vector<int16_t>& pcm) {
+    // First order high-pass (~130 Hz at 16 kHz) as a cheap stand-in for K-weighting,
+    // so that the bass a small speaker cannot reproduce does not dominate the measurement
+    int64_t sum = 0;
+    int32_t x1 = hp_x1_;
+    int32_t y1 = hp_y1_;
+    for (int16_t sample : pcm) {
+        int32_t y = sample - x1 + ((y1 * 31130) >> 15);
+        x1 = sample;
+        y1 = y;
+        sum += (int64_t)y * y;
+    }
+    hp_x1_ = x1;
+    hp_y1_ = y1;
+    return (int32_t)std::min<int64_t>(sum / (int64_t)pcm.size(), INT32_MAX);
+}
+
+void LoudnessLimiter::UpdateNormalizeGain(int32_t mean_square, int samples) {
+    if (mean_square < LOUDNESS_GATE_RMS * LOUDNESS_GATE_RMS) {
+        // Hold the gain during pauses
+        return;
+    }
+
+    if (integrated_ms_ == 0) {
+        integrated_ms_ = mean_square;
+    } else {
+        int64_t weight = (int64_t)samples * 1000 / sample_rate_;
+        integrated_ms_ += (mean_square - integrated_ms_) * weight / LOUDNESS_INTEGRATION_MS;
+    }
+
+    uint32_t rms = std::max<uint32_t>(1, ISqrt(integrated_ms_));
+    int32_t target = (int32_t)(((int64_t)LOUDNESS_TARGET_RMS << 15) / rms);
+    target = std::clamp<int32_t>(target, LOUDNESS_MIN_GAIN_Q15, LOUDNESS_MAX_GAIN_Q15);
+    normalize_gain_ += (target - normalize_gain_) / 4;
+}
+
+int16_t LoudnessLimiter::Limit(int32_t sample) {
+    const int capacity = lookahead_ + 1;
+    uint32_t level = sample < 0 ? -sample : sample;
+
+    // Expire the oldest peak once it has left the delay line. This comes before the
+    // push, so at most lookahead_ levels are queued when the new one goes in
+    if (peak_count_ > 0 && position_ - peak_positions_[peak_head_] > (uint32_t)lookahead_) {
+        if (++peak_head_ == capacity) {
+            peak_head_ = 0;
+        }
+        peak_count_--;
+    }
+
+    // Push the new level, dropping every queued level that can no longer be the window peak
+    while (peak_count_ > 0) {
+        int back = peak_head_ + peak_count_ - 1;
+        if (back >= capacity) {
+            back -= capacity;
+        }
+        if (peak_values_[back] > level) {
+            break;
+        }
+        peak_count_--;
+    }
+    int tail = peak_head_ + peak_count_;
+    if (tail >= capacity) {
+        tail -= capacity;
+    }
+    peak_values_[tail] = level;
+    peak_positions_[tail] = position_;
+    peak_count_++;
+
+    uint32_t peak = peak_values_[peak_head_];
+    int32_t target = 32768;
+    if (peak > LOUDNESS_LIMITER_THRESHOLD) {
+        target = (int32_t)(((int64_t)LOUDNESS_LIMITER_THRESHOLD << 15) / peak);
+    }
+    if (target < limiter_gain_) {
+        limiter_gain_ -= ((limiter_gain_ - target) >> attack_shift_) + 1;
+        if (limiter_gain_ < target) {
+            limiter_gain_ = target;
+        }
+    } else if (target > limiter_gain_) {
+        limiter_gain_ += ((target - limiter_gain_) >> release_shift_) + 1;
+        if (limiter_gain_ > target) {
+            limiter_gain_ = target;
+        }
+    }
+
+    int32_t delayed = delay_line_[delay_pos_];
+    delay_line_[delay_pos_] = sample;
+    if (++delay_pos_ == lookahead_) {
+        delay_pos_ = 0;
+    }
+    position_++;
+
+    int32_t output = (delayed * limiter_gain_) >> 15;
+    return (int16_t)std::clamp<int32_t>(output, INT16_MIN, INT16_MAX);
+}
+
+void LoudnessLimiter::Process(std::vector<int16_t>& pcm) {
+    if (lookahead_ == 0 || pcm.empty()) {
+        return;
+    }
+
+    int32_t mean_square = MeasureMeanSquare(pcm);
+    int32_t start_gain = normalize_gain_;
+    UpdateNormalizeGain(mean_square, pcm.size());
+
+    // Ramp the normalization gain across the frame to avoid zipper noise
+    int32_t step = (normalize_gain_ - start_gain) / (int32_t)pcm.size();
+    int32_t gain = start_gain;
+    for (auto& sample : pcm) {
+        // gain <= 2.0 in Q15, so the product always fits in 32 bits
+        sample = Limit((sample * gain) >> 15);
+        gain += step;
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef LOUDNESS_LIMITER_H
+#define LOUDNESS_LIMITER_H
+
+#include <vector>
+#include <cstdint>
+
+/*
+ * Playback loudness normalization followed by a look-ahead peak limiter.
+ *
+ * The normalizer measures the gated mean square of the high-passed signal,
+ * integrates it over LOUDNESS_INTEGRATION_MS and steers a gain towards
+ * LOUDNESS_TARGET_RMS. The limiter delays the signal by LOUDNESS_LOOKAHEAD_MS,
+ * so the gain is already reduced when a peak reaches the output.
+ *
+ * All processing is fixed point (Q15) and done in place on the playback frame.
+ */
+
+#define LOUDNESS_TARGET_RMS         4125    // -18 dBFS
+#define LOUDNESS_GATE_RMS           33      // -60 dBFS, silence does not pump the gain
+#define LOUDNESS_INTEGRATION_MS     3000
+#define LOUDNESS_MIN_GAIN_Q15       8192    // -12 dB
+#define LOUDNESS_MAX_GAIN_Q15       65536   // +6 dB
+#define LOUDNESS_LIMITER_THRESHOLD  29204   // -1 dBFS
+#define LOUDNESS_LOOKAHEAD_MS       3
+#define LOUDNESS_RELEASE_MS         60
+
+class LoudnessLimiter {
+public:
+    LoudnessLimiter() = default;
+
+    void Configure(int sample_rate);
+    void Reset();
+    void Process(std::vector<int16_t>& pcm);
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline int32_t normalize_gain() const { return normalize_gain_; }
+    inline int32_t limiter_gain() const { return limiter_gain_; }
+
+private:
+    int sample_rate_ = 0;
+
+    // Loudness normalization
+    int64_t integrated_ms_ = 0;
+    int32_t normalize_gain_ = 32768;
+    int32_t hp_x1_ = 0;
+    int32_t hp_y1_ = 0;
+
+    // Look-ahead limiter
+    int lookahead_ = 0;
+    int attack_shift_ = 0;
+    int release_shift_ = 0;
+    int32_t limiter_gain_ = 32768;
+    std::vector<int32_t> delay_line_;
+    int delay_pos_ = 0;
+    // Monotonic queue holding the running peak of the look-ahead window
+    std::vector<uint32_t> peak_values_;
+    std::vector<uint32_t> peak_positions_;
+    int peak_head_ = 0;
+    int peak_count_ = 0;
+    uint32_t position_ = 0;
+
+    int32_t MeasureMeanSquare(const std::vector<int16_t>& pcm);
+    void UpdateNormalizeGain(int32_t mean_square, int samples);
+    int16_t Limit(int32_t sample);
+};
+
+#endif // LOUDNESS_LIMITER_H
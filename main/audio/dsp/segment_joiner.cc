@@ -0,0 +1,62 @@
+#include "segment_joiner.h"
+
+#include <algorithm>
+
+void SegmentJoiner::Configure(int sample_rate, int channels) {
+    if (sample_rate == sample_rate_ && channels == channels_) {
+        return;
+    }
+    sample_rate_ = sample_rate;
+    channels_ = channels;
+    tail_frames_ = sample_rate * SEGMENT_JOINER_TAIL_MS / 1000;
+    tail_.reserve(tail_frames_ * channels);
+    Reset();
+}
+
+void SegmentJoiner::Reset() {
+    tail_.clear();
+    fade_in_ = false;
+}
+
+size_t SegmentJoiner::Join(std::vector<int16_t>& pcm) {
+    size_t prepended = tail_.size() / channels_;
+    if (!tail_.empty()) {
+        pcm.insert(pcm.begin(), tail_.begin(), tail_.end());
+        tail_.clear();
+    } else if (fade_in_) {
+        // Linear ramp in Q15, the first sample after the gap starts near zero
+        size_t frames = std::min(tail_frames_, pcm.size() / channels_);
+        for (size_t i = 0; i < frames; i++) {
+            int32_t gain = (int32_t)((i + 1) * 32768 / (frames + 1));
+            for (int c = 0; c < channels_; c++) {
+                pcm[i * channels_ + c] = (int16_t)((pcm[i * channels_ + c] * gain) >> 15);
+            }
+        }
+    }
+    fade_in_ = false;
+
+    // A frame no longer than the tail is written whole
+    if (pcm.size() / channels_ > tail_frames_) {
+        size_t samples = tail_frames_ * channels_;
+        tail_.assign(pcm.end() - samples, pcm.end());
+        pcm.resize(pcm.size() - samples);
+    }
+    return prepended;
+}
+
+bool SegmentJoiner::TakeFadedTail(std::vector<int16_t>& pcm) {
+    if (tail_.empty()) {
+        return false;
+    }
+    size_t frames = tail_.size() / channels_;
+    pcm.assign(tail_.begin(), tail_.end());
+    for (size_t i = 0; i < frames; i++) {
+        int32_t gain = (int32_t)((frames - i) * 32768 / (frames + 1));
+        for (int c = 0; c < channels_; c++) {
+            pcm[i * channels_ + c] = (int16_t)((pcm[i * channels_ + c] * gain) >> 15);
+        }
+    }
+    tail_.clear();
+    fade_in_ = true;
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef SEGMENT_JOINER_H
+#define SEGMENT_JOINER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Hides the edges of the gaps in the playback stream.
+ *
+ * The last SEGMENT_JOINER_TAIL_MS of every frame is held back and written in
+ * front of the next one, so frames that follow each other play unchanged. When
+ * no frame comes before the output runs dry, the held tail is taken faded out,
+ * and the first frame after the gap fades in, instead of the waveform jumping
+ * to silence and back. Frames are interleaved at the configured channel count.
+ */
+
+#define SEGMENT_JOINER_TAIL_MS      10      // Held back from every frame, also the fade length
+#define SEGMENT_JOINER_GUARD_MS     8       // The tail is written this long before the output runs dry
+
+class SegmentJoiner {
+public:
+    SegmentJoiner() = default;
+
+    // Drops the held tail if the format changes
+    void Configure(int sample_rate, int channels);
+    void Reset();
+    // Puts the held tail in front of pcm and holds back the end of pcm, returns the frames put in front
+    size_t Join(std::vector<int16_t>& pcm);
+    // Takes the held tail faded out, the output is about to run dry. False if nothing is held
+    bool TakeFadedTail(std::vector<int16_t>& pcm);
+
+    inline bool holding() const { return !tail_.empty(); }
+    inline int sample_rate() const { return sample_rate_; }
+    inline int channels() const { return channels_; }
+
+private:
+    int sample_rate_ = 0;
+    int channels_ = 1;
+    size_t tail_frames_ = 0;
+    std::vector<int16_t> tail_;
+    bool fade_in_ = false;
+};
+
+#endif // SEGMENT_JOINER_H
@@ -0,0 +1,120 @@
+#include "time_stretcher.h"
+
+#include <algorithm>
+#include <cmath>
+
+void TimeStretcher::Configure(int sample_rate) {
+    hop_ = std::max(16, sample_rate * TIME_STRETCH_HOP_MS / 1000);
+    search_ = sample_rate * TIME_STRETCH_SEARCH_MS / 1000;
+    fade_.resize(hop_);
+    for (int i = 0; i < hop_; i++) {
+        fade_[i] = (int16_t)((i * 32768 + hop_ / 2) / hop_);
+    }
+    Reset();
+}
+
+void TimeStretcher::Reset() {
+    input_.clear();
+    overlap_.clear();
+    analysis_pos_ = 0;
+    natural_pos_ = 0;
+}
+
+void TimeStretcher::SetSpeed(int speed) {
+    speed_ = std::clamp(speed, TIME_STRETCH_MIN_SPEED, TIME_STRETCH_MAX_SPEED);
+}
+
+int TimeStretcher::FindBestSegment(int nominal) {
+    auto score = [this](int start) {
+        // Samples are scaled down to 14 bits and decimated by 2, the sums fit easily in 64 bits
+        int64_t correlation = 0;
+        int64_t energy = 0;
+        for (int i = 0; i < hop_; i += 2) {
+            int32_t x = input_[start + i] >> 2;
+            int32_t t = overlap_[i] >> 2;
+            correlation += x * t;
+            energy += x * x;
+        }
+        // Normalized correlation keeping the sign, compared without a square root
+        float c = (float)correlation;
+        return c * fabsf(c) / (float)(energy + 1);
+    };
+
+    int low = std::max(0, nominal - search_);
+    int high = nominal + search_;
+    int best = nominal;
+    float best_score = score(nominal);
+    // Coarse search on even offsets, then refine around the winner
+    for (int start = low; start <= high; start += 2) {
+        float s = score(start);
+        if (s > best_score) {
+            best_score = s;
+            best = start;
+        }
+    }
+    int coarse = best;
+    for (int start = std::max(low, coarse - 1); start <= std::min(high, coarse + 1); start++) {
+        float s = score(start);
+        if (s > best_score) {
+            best_score = s;
+            best = start;
+        }
+    }
+    return best;
+}
+
+void TimeStretcher::Process(const std::vector<int16_t>& input, std::vector<int16_t>& output) {
+    if (hop_ == 0) {
+        output.insert(output.end(), input.begin(), input.end());
+        return;
+    }
+
+    input_.insert(input_.end(), input.begin(), input.end());
+    const uint32_t step = (uint64_t)hop_ * speed_ * 65536 / 100;
+    while (true) {
+        // At the original speed, follow the previous segment exactly so the input passes through
+        bool passthrough = speed_ == 100 && !overlap_.empty();
+        int nominal = passthrough ? natural_pos_ - hop_ : (int)(analysis_pos_ >> 16);
+        if (nominal + 2 * hop_ + (passthrough ? 0 : search_) > (int)input_.size()) {
+            break;
+        }
+
+        int start;
+        if (overlap_.empty()) {
+            start = nominal;
+            output.insert(output.end(), input_.begin() + start, input_.begin() + start + hop_);
+        } else {
+            start = passthrough ? nominal : FindBestSegment(nominal);
+            size_t offset = output.size();
+            output.resize(offset + hop_);
+            for (int i = 0; i < hop_; i++) {
+                int32_t mixed = overlap_[i] * (32768 - fade_[i]) + input_[start + i] * fade_[i];
+                output[offset + i] = (int16_t)(mixed >> 15);
+            }
+        }
+        overlap_.assign(input_.begin() + start + hop_, input_.begin() + start + 2 * hop_);
+        natural_pos_ = start + 2 * hop_;
+        if (passthrough) {
+            analysis_pos_ = (uint32_t)start << 16;
+        }
+        analysis_pos_ += step;
+    }
+
+    // Drop the input that neither the search nor a flush can reach anymore
+    int keep_from = std::min(std::max(0, (int)(analysis_pos_ >> 16) - search_), std::max(0, natural_pos_ - hop_));
+    if (keep_from > 0) {
+        input_.erase(input_.begin(), input_.begin() + keep_from);
+        analysis_pos_ -= (uint32_t)keep_from << 16;
+        natural_pos_ -= keep_from;
+    }
+}
+
+void TimeStretcher::Flush(std::vector<int16_t>& output) {
+    if (overlap_.empty()) {
+        output.insert(output.end(), input_.begin() + std::min<size_t>(analysis_pos_ >> 16, input_.size()), input_.end());
+    } else {
+        output.insert(output.end(), overlap_.begin(), overlap_.end());
+        output.insert(output.end(), input_.begin() + std::min<size_t>(natural_pos_, input_.size()), input_.end());
+    }
+    Reset();
+}
@@ -0,0 +1,52 @@
+#ifndef TIME_STRETCHER_H
+#define TIME_STRETCHER_H
+
+#include <vector>
+#include <cstdint>
+
+/*
+ * WSOLA (waveform similarity overlap-add) time-scale modification.
+ *
+ * The output is built from segments of 2 * hop samples cross-faded over one hop.
+ * The input advances by hop * speed per output hop, and each new segment is
+ * moved within +/- TIME_STRETCH_SEARCH_MS to the position whose start matches
+ * the tail of the previous segment best, so the pitch is preserved.
+ *
+ * At 100% speed the segments line up exactly and the input is passed through
+ * unchanged, only delayed by one segment plus the search range.
+ */
+
+#define TIME_STRETCH_HOP_MS         10
+#define TIME_STRETCH_SEARCH_MS      4
+#define TIME_STRETCH_MIN_SPEED      50
+#define TIME_STRETCH_MAX_SPEED      200
+
+class TimeStretcher {
+public:
+    TimeStretcher() = default;
+
+    void Configure(int sample_rate);
+    void Reset();
+    // Speed in percent, 100 is the original speed
+    void SetSpeed(int speed);
+    void Process(const std::vector<int16_t>& input, std::vector<int16_t>& output);
+    // Appends the buffered samples to output at the original speed and resets
+    void Flush(std::vector<int16_t>& output);
+
+    inline int speed() const { return speed_; }
+    inline bool empty() const { return input_.empty() && overlap_.empty(); }
+
+private:
+    int hop_ = 0;
+    int search_ = 0;
+    int speed_ = 100;
+    std::vector<int16_t> input_;
+    std::vector<int16_t> overlap_;          // Second half of the last segment, faded out in the next hop
+    std::vector<int16_t> fade_;             // Q15 fade-in ramp over one hop
+    uint32_t analysis_pos_ = 0;             // Nominal position of the next segment in input_, Q16
+    int natural_pos_ = 0;                   // Input position right after overlap_
+
+    int FindBestSegment(int nominal);
+};
+
+#endif // TIME_STRETCHER_H
@@ -0,0 +1,39 @@
+#include "end_of_speech_detector.h"
+
+void EndOfSpeechDetector::Configure(int hangover_ms, int min_speech_ms) {
+    hangover_ms_ = hangover_ms;
+    min_speech_ms_ = min_speech_ms;
+    Reset();
+}
+
+void EndOfSpeechDetector::Reset() {
+    speech_ms_ = 0;
+    silence_ms_ = 0;
+    ended_ = false;
+}
+
+bool EndOfSpeechDetector::Process(bool speaking, int frame_ms) {
+    if (ended_) {
+        return false;
+    }
+    if (speaking) {
+        speech_ms_ += frame_ms;
+        silence_ms_ = 0;
+        return false;
+    }
+    if (speech_ms_ == 0) {
+        return false;
+    }
+    silence_ms_ += frame_ms;
+    if (silence_ms_ < (uint32_t)hangover_ms_) {
+        return false;
+    }
+    if (speech_ms_ < (uint32_t)min_speech_ms_) {
+        // Too short to be an utterance, wait for the real one
+        speech_ms_ = 0;
+        silence_ms_ = 0;
+        return false;
+    }
+    ended_ = true;
+    return true;
+}
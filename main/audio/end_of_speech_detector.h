@@ -0,0 +1,36 @@
+#ifndef END_OF_SPEECH_DETECTOR_H
+#define END_OF_SPEECH_DETECTOR_H
+
+#include <cstdint>
+
+/*
+ * Ends an AutoStop turn on the device instead of waiting for the server VAD.
+ *
+ * Fed with the VAD state of every processed frame. Speech shorter than the
+ * minimum utterance is taken as a click or a cough and forgotten once the
+ * hangover has passed; after a real utterance the turn ends when the silence
+ * has lasted the hangover. It fires once per turn.
+ */
+
+class EndOfSpeechDetector {
+public:
+    EndOfSpeechDetector() = default;
+
+    void Configure(int hangover_ms, int min_speech_ms);
+    void Reset();
+    // Returns true on the frame that ends the utterance
+    bool Process(bool speaking, int frame_ms);
+
+    inline uint32_t speech_ms() const { return speech_ms_; }
+    inline uint32_t silence_ms() const { return silence_ms_; }
+    inline bool ended() const { return ended_; }
+
+private:
+    int hangover_ms_ = 0;
+    int min_speech_ms_ = 0;
+    uint32_t speech_ms_ = 0;
+    uint32_t silence_ms_ = 0;
+    bool ended_ = false;
+};
+
+#endif // END_OF_SPEECH_DETECTOR_H
@@ -0,0 +1,91 @@
+#ifndef FIXED_QUEUE_H
+#define FIXED_QUEUE_H
+
+#include <array>
+#include <utility>
+#include <cstddef>
+
+/*
+ * A queue with its capacity fixed at compile time and its slots stored inline.
+ *
+ * The audio queues are bounded anyway, a std::deque would still allocate its
+ * node map and a 512 byte block on the heap for each of them. Indexing starts
+ * at the front. Pushing into a full queue fails and leaves the item untouched.
+ */
+template <typename T, size_t N>
+class FixedQueue {
+public:
+    inline bool empty() const { return size_ == 0; }
+    inline bool full() const { return size_ == N; }
+    inline size_t size() const { return size_; }
+    static constexpr size_t capacity() { return N; }
+
+    inline T& front() { return items_[head_]; }
+    inline const T& front() const { return items_[head_]; }
+    inline T& back() { return items_[Slot(size_ - 1)]; }
+    inline const T& back() const { return items_[Slot(size_ - 1)]; }
+    inline T& operator[](size_t index) { return items_[Slot(index)]; }
+    inline const T& operator[](size_t index) const { return items_[Slot(index)]; }
+
+    bool push_back(T&& item) {
+        if (full()) {
+            return false;
+        }
+        items_[Slot(size_)] = std::move(item);
+        size_++;
+        return true;
+    }
+
+    // Inserts before the item at index, index == size() appends
+    bool insert(size_t index, T&& item) {
+        if (full() || index > size_) {
+            return false;
+        }
+        for (size_t i = size_; i > index; i--) {
+            items_[Slot(i)] = std::move(items_[Slot(i - 1)]);
+        }
+        items_[Slot(index)] = std::move(item);
+        size_++;
+        return true;
+    }
+
+    void pop_front() {
+        items_[head_] = T();
+        head_ = Slot(1);
+        size_--;
+    }
+
+    // Removes the items that match, keeping the order of the rest
+    template <typename Predicate>
+    void remove_if(Predicate predicate) {
+        size_t kept = 0;
+        for (size_t i = 0; i < size_; i++) {
+            if (!predicate(items_[Slot(i)])) {
+                if (kept != i) {
+                    items_[Slot(kept)] = std::move(items_[Slot(i)]);
+                }
+                kept++;
+            }
+        }
+        for (size_t i = kept; i < size_; i++) {
+            items_[Slot(i)] = T();
+        }
+        size_ = kept;
+    }
+
+    void clear() {
+        while (!empty()) {
+            pop_front();
+        }
+        head_ = 0;
+    }
+
+private:
+    std::array<T, N> items_ = {};
+    size_t head_ = 0;
+    size_t size_ = 0;
+
+    inline size_t Slot(size_t index) const { return (head_ + index) % N; }
+};
+
+#endif // FIXED_QUEUE_H
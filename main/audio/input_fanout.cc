@@ -0,0 +1,54 @@
+#include "input_fanout.h"
+
+const AudioSpan& AudioInputFrame::view(AudioInputView view) const {
+    switch (view) {
+    case kAudioInputViewMic:
+        return mic;
+    case kAudioInputViewReference:
+        return reference;
+    case kAudioInputViewMono:
+        return mono;
+    default:
+        return interleaved;
+    }
+}
+
+const AudioInputFrame& InputFanout::Split(const std::vector<int16_t>& data, int channels, bool reference, int sample_rate) {
+    size_t frames = data.size() / channels;
+    int mics = reference ? channels - 1 : channels;
+    frame_.channels = channels;
+    frame_.sample_rate = sample_rate;
+    frame_.interleaved = AudioSpan(data);
+    if (channels == 1) {
+        frame_.mic = frame_.interleaved;
+        frame_.mono = frame_.interleaved;
+        frame_.reference = AudioSpan();
+        return frame_;
+    }
+
+    mic_.resize(frames);
+    reference_.resize(reference ? frames : 0);
+    mono_.resize(mics > 1 ? frames : 0);
+    const int16_t* in = data.data();
+    for (size_t i = 0; i < frames; i++, in += channels) {
+        mic_[i] = in[0];
+        if (mics > 1) {
+            int32_t sum = 0;
+            for (int c = 0; c < mics; c++) {
+                sum += in[c];
+            }
+            mono_[i] = sum / mics;
+        }
+        if (reference) {
+            reference_[i] = in[channels - 1];
+        }
+    }
+    frame_.mic = AudioSpan(mic_);
+    frame_.reference = AudioSpan(reference_);
+    frame_.mono = mics > 1 ? AudioSpan(mono_) : frame_.mic;
+    return frame_;
+}
+
+void InputFanout::Reset(int slot) {
+    chunkers_[slot].Reset();
+}
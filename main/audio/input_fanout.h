@@ -0,0 +1,109 @@
+#ifndef INPUT_FANOUT_H
+#define INPUT_FANOUT_H
+
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+#include "dsp/frame_aggregator.h"
+
+/*
+ * Splits each block read from the mic into channel views once, for all the
+ * input consumers (wake word, audio processor, audio testing, input taps).
+ *
+ * The codec delivers the mic channels first and the reference last. A mono
+ * codec needs no split, every view points into the block itself. Otherwise
+ * one pass over the block fills the mic, reference and mono mix buffers,
+ * which are reused from block to block. The views are valid until the next
+ * Split.
+ *
+ * A consumer that wants other chunk sizes than the block gets them through
+ * its own FrameAggregator; one whose size matches is handed the view as is.
+ */
+
+#define INPUT_FANOUT_MAX_CONSUMERS 4
+
+// A run of samples that belongs to someone else
+struct AudioSpan {
+    const int16_t* data = nullptr;
+    size_t size = 0;
+
+    AudioSpan() = default;
+    AudioSpan(const int16_t* data, size_t size) : data(data), size(size) {}
+    AudioSpan(const std::vector<int16_t>& samples) : data(samples.data()), size(samples.size()) {}
+
+    inline bool empty() const { return size == 0; }
+    inline const int16_t* begin() const { return data; }
+    inline const int16_t* end() const { return data + size; }
+    inline int16_t operator[](size_t index) const { return data[index]; }
+};
+
+enum AudioInputView {
+    kAudioInputViewInterleaved,     // As read, all channels
+    kAudioInputViewMic,             // The first mic channel
+    kAudioInputViewReference,       // Empty without a reference channel
+    kAudioInputViewMono,            // Mix of the mic channels
+};
+
+struct AudioInputFrame {
+    AudioSpan interleaved;
+    AudioSpan mic;
+    AudioSpan reference;
+    AudioSpan mono;
+    int channels = 1;
+    int sample_rate = 0;
+
+    const AudioSpan& view(AudioInputView view) const;
+    inline size_t frames() const { return mic.size; }
+};
+
+class InputFanout {
+public:
+    InputFanout() = default;
+
+    const AudioInputFrame& Split(const std::vector<int16_t>& data, int channels, bool reference, int sample_rate);
+    // Hands the view of the last split to the consumer in chunks of feed_frames frames
+    template <typename Consumer>
+    void Deliver(int slot, AudioInputView view, size_t feed_frames, Consumer consumer);
+    // Drops what a consumer had buffered, when it stops or its chunk size changes
+    void Reset(int slot);
+    // Samples of the view a consumer holds back, they were captured after the chunk it is handed
+    inline size_t buffered(int slot) const { return chunkers_[slot].available(); }
+
+    inline const AudioInputFrame& frame() const { return frame_; }
+
+private:
+    AudioInputFrame frame_;
+    std::vector<int16_t> mic_;
+    std::vector<int16_t> reference_;
+    std::vector<int16_t> mono_;
+    std::array<FrameAggregator, INPUT_FANOUT_MAX_CONSUMERS> chunkers_;
+    std::vector<int16_t> chunk_;
+};
+
+template <typename Consumer>
+void InputFanout::Deliver(int slot, AudioInputView view, size_t feed_frames, Consumer consumer) {
+    const AudioSpan& data = frame_.view(view);
+    size_t feed_samples = feed_frames * (view == kAudioInputViewInterleaved ? frame_.channels : 1);
+    if (feed_samples == 0 || data.empty()) {
+        return;
+    }
+    auto& chunker = chunkers_[slot];
+    if (data.size == feed_samples && chunker.available() == 0) {
+        consumer(data);
+        return;
+    }
+    if (chunker.frame_samples() != feed_samples) {
+        chunker.Configure(feed_samples, feed_samples + data.size);
+    } else if (chunker.capacity() < feed_samples + data.size) {
+        // A larger block than before, the samples held back are still owed to the consumer
+        chunker.Reserve(feed_samples + data.size);
+    }
+    chunker.Write(data.data, data.size);
+    while (chunker.ReadFrame(chunk_)) {
+        consumer(AudioSpan(chunk_));
+    }
+}
+
+#endif // INPUT_FANOUT_H
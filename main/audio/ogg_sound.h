@@ -0,0 +1,24 @@
+#ifndef OGG_SOUND_H
+#define OGG_SOUND_H
+
+#include "protocol.h"
+
+#include <deque>
+#include <memory>
+#include <string_view>
+
+/*
+ * Demuxes the Opus packets of an embedded Ogg sound.
+ *
+ * The sound lane demuxes a sound only when it reaches the front of the queue,
+ * so a long playlist holds the packets of one sound at a time. One sound must
+ * fit in MAX_SOUND_PACKETS_IN_QUEUE, tests/host/ogg_sound_test checks the
+ * sounds of every locale against it.
+ */
+
+#define OGG_SOUND_FRAME_DURATION_MS 60
+#define MAX_SOUND_PACKETS_IN_QUEUE  (10000 / OGG_SOUND_FRAME_DURATION_MS)
+
+bool ParseOggSound(const std::string_view& ogg, std::deque<std::unique_ptr<AudioStreamPacket>>& packets);
+
+#endif // OGG_SOUND_H
@@ -0,0 +1,90 @@
+#include "opus_complexity_controller.h"
+#include "settings.h"
+#include "system_info.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "OpusComplexity"
+
+int OpusComplexityController::Initialize(int frame_duration_ms) {
+    budget_us_ = frame_duration_ms * 1000 * OPUS_COMPLEXITY_BUDGET_PERCENT / 100;
+
+    Settings settings("audio", false);
+    complexity_ = std::clamp<int>(settings.GetInt("opus_complexity", 0), 0, OPUS_COMPLEXITY_MAX);
+    saved_complexity_ = complexity_;
+
+    frames_ = 0;
+    max_encode_us_ = 0;
+    hold_windows_ = 0;
+    stable_windows_ = 0;
+    SystemInfo::GetIdleRunTime(last_idle_run_time_, last_total_run_time_);
+    ESP_LOGI(TAG, "Start with complexity %d, encode budget %lu us", complexity_, budget_us_);
+    return complexity_;
+}
+
+int OpusComplexityController::MeasureIdlePercent() {
+    uint32_t idle_run_time, total_run_time;
+    if (!SystemInfo::GetIdleRunTime(idle_run_time, total_run_time)) {
+        return -1;
+    }
+    uint32_t idle_elapsed = idle_run_time - last_idle_run_time_;
+    uint32_t total_elapsed = total_run_time - last_total_run_time_;
+    last_idle_run_time_ = idle_run_time;
+    last_total_run_time_ = total_run_time;
+    if (total_elapsed == 0) {
+        return -1;
+    }
+    return std::min<uint64_t>(100, (uint64_t)idle_elapsed * 100 / total_elapsed);
+}
+
+void OpusComplexityController::SaveIfStable() {
+    if (complexity_ == saved_complexity_ || ++stable_windows_ < OPUS_COMPLEXITY_SAVE_WINDOWS) {
+        return;
+    }
+    Settings settings("audio", true);
+    settings.SetInt("opus_complexity", complexity_);
+    saved_complexity_ = complexity_;
+    ESP_LOGI(TAG, "Saved complexity %d", complexity_);
+}
+
+bool OpusComplexityController::OnFrameEncoded(uint32_t encode_us) {
+    if (frames_ == 0) {
+        // Start the idle measurement with the window, pauses between conversations do not count
+        SystemInfo::GetIdleRunTime(last_idle_run_time_, last_total_run_time_);
+    }
+    max_encode_us_ = std::max(max_encode_us_, encode_us);
+
+    // A frame that blows the whole budget twice over cannot wait for the end of the window
+    bool overrun = encode_us > budget_us_ * 2;
+    if (!overrun && ++frames_ < OPUS_COMPLEXITY_WINDOW_FRAMES) {
+        return false;
+    }
+
+    last_max_encode_us_ = max_encode_us_;
+    last_idle_percent_ = MeasureIdlePercent();
+    frames_ = 0;
+    max_encode_us_ = 0;
+
+    int previous = complexity_;
+    bool idle_low = last_idle_percent_ >= 0 && last_idle_percent_ < OPUS_COMPLEXITY_MIN_IDLE_PERCENT;
+    bool idle_high = last_idle_percent_ < 0 || last_idle_percent_ >= OPUS_COMPLEXITY_RAISE_IDLE_PERCENT;
+    if ((overrun || last_max_encode_us_ > budget_us_ || idle_low) && complexity_ > 0) {
+        complexity_--;
+        hold_windows_ = OPUS_COMPLEXITY_HOLD_WINDOWS;
+    } else if (hold_windows_ > 0) {
+        hold_windows_--;
+    } else if (last_max_encode_us_ < budget_us_ * OPUS_COMPLEXITY_RAISE_PERCENT / 100 && idle_high &&
+        complexity_ < OPUS_COMPLEXITY_MAX) {
+        complexity_++;
+    }
+
+    if (complexity_ == previous) {
+        SaveIfStable();
+        return false;
+    }
+    stable_windows_ = 0;
+    ESP_LOGI(TAG, "Complexity %d -> %d (max encode %lu us, budget %lu us, idle %d%%)",
+        previous, complexity_, last_max_encode_us_, budget_us_, last_idle_percent_);
+    return true;
+}
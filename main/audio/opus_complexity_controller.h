@@ -0,0 +1,56 @@
+#ifndef OPUS_COMPLEXITY_CONTROLLER_H
+#define OPUS_COMPLEXITY_CONTROLLER_H
+
+#include <cstdint>
+
+/*
+ * Picks the Opus encoder complexity from the measured cost of encoding.
+ *
+ * Every OPUS_COMPLEXITY_WINDOW_FRAMES encoded frames, the slowest encode time is
+ * compared with the deadline budget (a share of the frame duration) and the CPU
+ * idle time is read from the FreeRTOS run time stats. The complexity is lowered
+ * at once when either limit is crossed, and raised one step when both have
+ * plenty of headroom. A level that stayed stable is saved to Settings("audio"),
+ * so the next boot starts from it.
+ */
+
+#define OPUS_COMPLEXITY_MAX                 10
+#define OPUS_COMPLEXITY_WINDOW_FRAMES       50      // 3 seconds of 60 ms frames
+#define OPUS_COMPLEXITY_BUDGET_PERCENT      25      // of the frame duration
+#define OPUS_COMPLEXITY_RAISE_PERCENT       50      // of the budget, max encode time to raise
+#define OPUS_COMPLEXITY_MIN_IDLE_PERCENT    15
+#define OPUS_COMPLEXITY_RAISE_IDLE_PERCENT  35
+#define OPUS_COMPLEXITY_HOLD_WINDOWS        10      // after a decrease, before trying to raise again
+#define OPUS_COMPLEXITY_SAVE_WINDOWS        10      // stable windows before the level is persisted
+
+class OpusComplexityController {
+public:
+    OpusComplexityController() = default;
+
+    // Loads the persisted level, returns the complexity to start with
+    int Initialize(int frame_duration_ms);
+    // Returns true if the complexity changed
+    bool OnFrameEncoded(uint32_t encode_us);
+
+    inline int complexity() const { return complexity_; }
+    inline uint32_t last_max_encode_us() const { return last_max_encode_us_; }
+    inline int last_idle_percent() const { return last_idle_percent_; }
+
+private:
+    int complexity_ = 0;
+    int saved_complexity_ = 0;
+    uint32_t budget_us_ = 0;
+    int frames_ = 0;
+    uint32_t max_encode_us_ = 0;
+    uint32_t last_max_encode_us_ = 0;
+    int last_idle_percent_ = -1;
+    uint32_t last_idle_run_time_ = 0;
+    uint32_t last_total_run_time_ = 0;
+    int hold_windows_ = 0;
+    int stable_windows_ = 0;
+
+    int MeasureIdlePercent();
+    void SaveIfStable();
+};
+
+#endif // OPUS_COMPLEXITY_CONTROLLER_H
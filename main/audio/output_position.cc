@@ -0,0 +1,78 @@
+#include "output_position.h"
+
+#include <esp_attr.h>
+#include <algorithm>
+
+void OutputPosition::Configure(int desc_num, int frame_num) {
+    if (slot_frames_.size() != (size_t)desc_num) {
+        slot_frames_.assign(desc_num, 0);
+        free_.assign(desc_num, 0);
+    }
+    frame_num_ = frame_num;
+}
+
+void OutputPosition::Reset() {
+    std::fill(slot_frames_.begin(), slot_frames_.end(), 0);
+    slot_ = 0;
+    free_head_ = 0;
+    free_count_ = 0;
+    filling_ = -1;
+    loaded_ = written_;
+    played_ = written_;
+}
+
+void OutputPosition::AddWritten(uint32_t frames) {
+    written_ += frames;
+    Load();
+}
+
+void IRAM_ATTR OutputPosition::Load() {
+    while (loaded_ != written_) {
+        if (filling_ < 0) {
+            if (free_count_ == 0) {
+                return;
+            }
+            filling_ = free_[free_head_];
+            free_head_ = (free_head_ + 1) % free_.size();
+            free_count_--;
+        }
+        uint32_t& frames = slot_frames_[filling_];
+        uint32_t count = std::min(written_ - loaded_, frame_num_ - frames);
+        frames += count;
+        loaded_ += count;
+        if (frames == frame_num_) {
+            filling_ = -1;
+        }
+    }
+}
+
+void IRAM_ATTR OutputPosition::OnSent(int loaded) {
+    if (slot_frames_.empty()) {
+        return;
+    }
+    size_t sent = slot_;
+    if (++slot_ == slot_frames_.size()) {
+        slot_ = 0;
+    }
+    played_ += slot_frames_[sent];
+    silent_ += frame_num_ - slot_frames_[sent];
+    slot_frames_[sent] = 0;
+
+    if (loaded >= 0) {
+        // The codec converted these frames and counted them before handing the buffer over
+        slot_frames_[sent] = std::min<uint32_t>(loaded, frame_num_);
+        loaded_ += slot_frames_[sent];
+        return;
+    }
+    // The buffer being filled was sent part full, the driver goes on filling it
+    if ((int)sent != filling_) {
+        if (free_count_ == free_.size() - 1) {
+            // The driver drops the oldest, it plays silence
+            free_head_ = (free_head_ + 1) % free_.size();
+            free_count_--;
+        }
+        free_[(free_head_ + free_count_) % free_.size()] = sent;
+        free_count_++;
+    }
+    Load();
+}
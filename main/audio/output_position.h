@@ -0,0 +1,59 @@
+#ifndef OUTPUT_POSITION_H
+#define OUTPUT_POSITION_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Follows which written output frames the TX DMA has played.
+ *
+ * The writer counts frames with AddWritten as they go into the DMA ring: per
+ * DMA buffer it is about to fill, or per period a codec converts for its
+ * on_sent callback. Every sent buffer calls OnSent, and its frames count as
+ * played. A codec that refills the buffer just sent itself says how many
+ * frames it put in. Otherwise the I2S driver refills the sent buffers in the
+ * order they were sent, keeping up to desc_num - 1 of them, and the counted
+ * frames are assigned to them the same way. After an underrun the next frames
+ * then land in the buffer that is sent soonest, not a whole ring later.
+ *
+ * Positions wrap at 2^32. The caller serializes the calls, the AudioCodec
+ * holds its clock_lock_ around them. tests/host/output_position_test drives
+ * it with a model of the I2S driver.
+ */
+
+class OutputPosition {
+public:
+    // Sizes the ring while no DMA callback runs, then Reset
+    void Configure(int desc_num, int frame_num);
+    // Everything written so far counts as played, for when the DMA buffers were dropped
+    void Reset();
+    void AddWritten(uint32_t frames);
+    // A TX DMA buffer was sent. loaded is the frames the codec put in it, -1 if the driver refills it
+    void OnSent(int loaded);
+
+    inline uint32_t written() const { return written_; }
+    inline uint32_t played() const { return played_; }
+    inline uint32_t queued() const { return written_ - played_; }
+    // Frames of silence sent in place of audio, wraps at 2^32
+    inline uint32_t silent() const { return silent_; }
+
+private:
+    std::vector<uint32_t> slot_frames_;     // Frames in each DMA buffer, in the order they are sent
+    size_t slot_ = 0;                       // The buffer sent next
+    uint32_t frame_num_ = 0;
+    // Sent buffers the driver has not refilled yet, oldest first, and the one it is filling
+    std::vector<size_t> free_;
+    size_t free_head_ = 0;
+    size_t free_count_ = 0;
+    int filling_ = -1;
+    volatile uint32_t written_ = 0;
+    volatile uint32_t loaded_ = 0;
+    volatile uint32_t played_ = 0;
+    uint32_t silent_ = 0;
+
+    // Puts the counted frames into the free buffers
+    void Load();
+};
+
+#endif // OUTPUT_POSITION_H
@@ -0,0 +1,177 @@
+#include "phrase_cache.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <cctype>
+
+#define TAG "PhraseCache"
+
+PhraseCache::~PhraseCache() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    DiscardRecordingLocked();
+    for (auto& entry : entries_) {
+        heap_caps_free(entry.data);
+    }
+}
+
+bool PhraseCache::IsValidKey(const std::string& key) {
+    if (key.empty() || key.size() > PHRASE_CACHE_MAX_KEY_LENGTH) {
+        return false;
+    }
+    for (char c : key) {
+        if (!isalnum((unsigned char)c) && c != '-' && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+void PhraseCache::BeginRecording(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CommitRecordingLocked();
+    if (!IsValidKey(key)) {
+        ESP_LOGW(TAG, "Invalid phrase key");
+        return;
+    }
+    recording_ = (uint8_t*)heap_caps_malloc(PHRASE_CACHE_MAX_PHRASE_BYTES, MALLOC_CAP_SPIRAM);
+    if (recording_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the recording buffer");
+        return;
+    }
+    recording_key_ = key;
+    recording_size_ = 0;
+    recording_ms_ = 0;
+    recording_overflow_ = false;
+}
+
+void PhraseCache::Record(const AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (recording_ == nullptr || recording_overflow_) {
+        return;
+    }
+    size_t size = sizeof(PacketHeader) + packet.payload.size();
+    if (recording_size_ + size > PHRASE_CACHE_MAX_PHRASE_BYTES) {
+        // Too long to be a common reply, it will not be stored
+        recording_overflow_ = true;
+        return;
+    }
+    PacketHeader header = {
+        .size = (uint16_t)packet.payload.size(),
+        .frame_duration = (uint16_t)packet.frame_duration,
+        .sample_rate = (uint16_t)packet.sample_rate,
+        .channels = (uint8_t)packet.channels,
+        .reserved = 0,
+    };
+    memcpy(recording_ + recording_size_, &header, sizeof(header));
+    memcpy(recording_ + recording_size_ + sizeof(header), packet.payload.data(), header.size);
+    recording_size_ += size;
+    recording_ms_ += packet.frame_duration;
+}
+
+void PhraseCache::CommitRecording() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CommitRecordingLocked();
+}
+
+void PhraseCache::CancelRecording() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    DiscardRecordingLocked();
+}
+
+void PhraseCache::CommitRecordingLocked() {
+    if (recording_ == nullptr) {
+        return;
+    }
+    if (recording_overflow_ || recording_size_ == 0) {
+        DiscardRecordingLocked();
+        return;
+    }
+
+    // Replace an older copy of the same phrase
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->key == recording_key_) {
+            bytes_ -= it->size;
+            heap_caps_free(it->data);
+            entries_.erase(it);
+            break;
+        }
+    }
+    Evict(recording_size_);
+    auto data = (uint8_t*)heap_caps_malloc(recording_size_, MALLOC_CAP_SPIRAM);
+    if (data == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for the phrase", recording_size_);
+        DiscardRecordingLocked();
+        return;
+    }
+    memcpy(data, recording_, recording_size_);
+    entries_.push_front(Entry{recording_key_, data, recording_size_, recording_ms_});
+    bytes_ += recording_size_;
+    ESP_LOGI(TAG, "Stored phrase %s, %lu ms in %u bytes, %u phrases in %u bytes", recording_key_.c_str(),
+        recording_ms_, recording_size_, entries_.size(), bytes_);
+    DiscardRecordingLocked();
+}
+
+void PhraseCache::DiscardRecordingLocked() {
+    if (recording_ != nullptr) {
+        heap_caps_free(recording_);
+        recording_ = nullptr;
+    }
+    recording_key_.clear();
+    recording_size_ = 0;
+    recording_ms_ = 0;
+    recording_overflow_ = false;
+}
+
+void PhraseCache::Evict(size_t size) {
+    while (!entries_.empty() && (bytes_ + size > PHRASE_CACHE_BYTES || entries_.size() >= PHRASE_CACHE_MAX_ENTRIES)) {
+        auto& entry = entries_.back();
+        ESP_LOGI(TAG, "Evicted phrase %s", entry.key.c_str());
+        bytes_ -= entry.size;
+        heap_caps_free(entry.data);
+        entries_.pop_back();
+    }
+}
+
+bool PhraseCache::Lookup(const std::string& key, std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    packets.clear();
+    auto it = entries_.begin();
+    while (it != entries_.end() && it->key != key) {
+        ++it;
+    }
+    if (it == entries_.end()) {
+        return false;
+    }
+    entries_.splice(entries_.begin(), entries_, it);
+
+    size_t offset = 0;
+    while (offset + sizeof(PacketHeader) <= it->size) {
+        PacketHeader header;
+        memcpy(&header, it->data + offset, sizeof(header));
+        offset += sizeof(header);
+        auto packet = std::make_unique<AudioStreamPacket>();
+        packet->sample_rate = header.sample_rate;
+        packet->frame_duration = header.frame_duration;
+        packet->channels = header.channels;
+        packet->timestamp = 0;
+        packet->payload.assign(it->data + offset, it->data + offset + header.size);
+        offset += header.size;
+        packets.push_back(std::move(packet));
+    }
+    return true;
+}
+
+void PhraseCache::CountLookup(bool hit) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (hit) {
+        hits_++;
+    } else {
+        misses_++;
+    }
+    uint32_t lookups = hits_ + misses_;
+    if (lookups % PHRASE_CACHE_REPORT_LOOKUPS == 0) {
+        ESP_LOGI(TAG, "%lu hits / %lu misses (%lu%%), %u phrases in %u bytes", hits_, misses_,
+            hits_ * 100 / lookups, entries_.size(), bytes_);
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef PHRASE_CACHE_H
+#define PHRASE_CACHE_H
+
+#include "protocol.h"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Keeps the Opus packets of short replies the server is likely to send again,
+ * keyed by a content hash the server chooses.
+ *
+ * A sentence_start message with a cache_key starts recording the downlink
+ * packets that follow, the next sentence or the end of the reply stores them.
+ * A later phrase message with the same key plays the stored packets without
+ * any network audio. Each phrase is one block in PSRAM, the least recently
+ * used phrases are evicted to stay within PHRASE_CACHE_BYTES.
+ */
+
+#define PHRASE_CACHE_BYTES              (256 * 1024)
+#define PHRASE_CACHE_MAX_PHRASE_BYTES   (24 * 1024)     // 8 s of Opus at 24 kbps
+#define PHRASE_CACHE_MAX_ENTRIES        64
+#define PHRASE_CACHE_MAX_KEY_LENGTH     64
+#define PHRASE_CACHE_REPORT_LOOKUPS     20
+
+class PhraseCache {
+public:
+    PhraseCache() = default;
+    ~PhraseCache();
+
+    // Keys are hashes, only letters, digits, '-' and '_' are accepted
+    static bool IsValidKey(const std::string& key);
+
+    // Stores the recording in progress and starts a new one
+    void BeginRecording(const std::string& key);
+    void Record(const AudioStreamPacket& packet);
+    void CommitRecording();
+    void CancelRecording();
+    // Copies the packets of a phrase and makes it the most recently used
+    bool Lookup(const std::string& key, std::vector<std::unique_ptr<AudioStreamPacket>>& packets);
+    // A lookup counts as a hit only if the phrase was played
+    void CountLookup(bool hit);
+
+    uint32_t hits() const { return hits_; }
+    uint32_t misses() const { return misses_; }
+
+private:
+    struct PacketHeader {
+        uint16_t size;
+        uint16_t frame_duration;
+        uint16_t sample_rate;
+        uint8_t channels;
+        uint8_t reserved;
+    };
+
+    struct Entry {
+        std::string key;
+        uint8_t* data;
+        size_t size;
+        uint32_t duration_ms;
+    };
+
+    std::mutex mutex_;
+    std::list<Entry> entries_;      // The most recently used first
+    size_t bytes_ = 0;
+
+    std::string recording_key_;
+    uint8_t* recording_ = nullptr;  // PHRASE_CACHE_MAX_PHRASE_BYTES while a phrase is recorded
+    size_t recording_size_ = 0;
+    uint32_t recording_ms_ = 0;
+    bool recording_overflow_ = false;
+
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+
+    void CommitRecordingLocked();
+    void DiscardRecordingLocked();
+    void Evict(size_t size);
+};
+
+#endif // PHRASE_CACHE_H
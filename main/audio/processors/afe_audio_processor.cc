@@ -14,9 +14,6 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms) {
     codec_ = codec;
     frame_samples_ = frame_duration_ms * 16000 / 1000;
 
-    // Pre-allocate output buffer capacity
-    output_buffer_.reserve(frame_samples_);
-
     int ref_num = codec_->input_reference() ? 1 : 0;
 
     std::string input_format;
@@ -62,6 +59,7 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms) {
 
     afe_iface_ = esp_afe_handle_from_config(afe_config);
     afe_data_ = afe_iface_->create_from_config(afe_config);
+    output_aggregator_.Configure(frame_samples_, frame_samples_ + afe_iface_->get_fetch_chunksize(afe_data_));
     
     xTaskCreate([](void* arg) {
         auto this_ = (AfeAudioProcessor*)arg;
@@ -84,11 +82,16 @@ size_t AfeAudioProcessor::GetFeedSize() {
     return afe_iface_->get_feed_chunksize(afe_data_);
 }
 
-void AfeAudioProcessor::Feed(std::vector<int16_t>&& data) {
+int AfeAudioProcessor::GetOutputDelayMs() {
+    // The AFE filters overlapping frames of one feed chunk, each output lags its input by a chunk
+    return GetFeedSize() * 1000 / 16000;
+}
+
+void AfeAudioProcessor::Feed(const AudioSpan& data) {
     if (afe_data_ == nullptr) {
         return;
     }
-    afe_iface_->feed(afe_data_, data.data());
+    afe_iface_->feed(afe_data_, data.data);
 }
 
 void AfeAudioProcessor::Start() {
@@ -147,22 +150,14 @@ void AfeAudioProcessor::AudioProcessorTask() {
 
         if (output_callback_) {
             size_t samples = res->data_size / sizeof(int16_t);
-            
-            // Add data to buffer
-            output_buffer_.insert(output_buffer_.end(), res->data, res->data + samples);
-            
-            // Output complete frames when buffer has enough data
-            while (output_buffer_.size() >= frame_samples_) {
-                if (output_buffer_.size() == frame_samples_) {
-                    // If buffer size equals frame size, move the entire buffer
-                    output_callback_(std::move(output_buffer_));
-                    output_buffer_.clear();
-                    output_buffer_.reserve(frame_samples_);
-                } else {
-                    // If buffer size exceeds frame size, copy one frame and remove it
-                    output_callback_(std::vector<int16_t>(output_buffer_.begin(), output_buffer_.begin() + frame_samples_));
-                    output_buffer_.erase(output_buffer_.begin(), output_buffer_.begin() + frame_samples_);
-                }
+            if (output_aggregator_.Write(res->data, samples) < samples) {
+                ESP_LOGW(TAG, "Output aggregator overflow, fetch of %u samples cut", samples);
+            }
+
+            // Output complete frames, the frame vector is handed over to the callback
+            std::vector<int16_t> frame;
+            while (output_aggregator_.ReadFrame(frame)) {
+                output_callback_(std::move(frame));
             }
         }
     }
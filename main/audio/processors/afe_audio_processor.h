@@ -12,6 +12,7 @@
 
 #include "audio_processor.h"
 #include "audio_codec.h"
+#include "dsp/frame_aggregator.h"
 
 class AfeAudioProcessor : public AudioProcessor {
 public:
@@ -19,7 +20,8 @@ public:
     ~AfeAudioProcessor();
 
     void Initialize(AudioCodec* codec, int frame_duration_ms) override;
-    void Feed(std::vector<int16_t>&& data) override;
+    void Feed(const AudioSpan& data) override;
+    AudioInputView GetFeedView() const override { return kAudioInputViewInterleaved; }
     void Start() override;
     void Stop() override;
     bool IsRunning() override;
@@ -27,6 +29,7 @@ public:
     void OnVadStateChange(std::function<void(bool speaking)> callback) override;
     size_t GetFeedSize() override;
     void EnableDeviceAec(bool enable) override;
+    int GetOutputDelayMs() override;
 
 private:
     EventGroupHandle_t event_group_ = nullptr;
@@ -37,7 +40,7 @@ private:
     AudioCodec* codec_ = nullptr;
     int frame_samples_ = 0;
     bool is_speaking_ = false;
-    std::vector<int16_t> output_buffer_;
+    FrameAggregator output_aggregator_;
 
     void AudioProcessorTask();
 };
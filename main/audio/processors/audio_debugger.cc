@@ -3,15 +3,87 @@
 
 #if CONFIG_USE_AUDIO_DEBUGGER
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
 #include <string>
+#include <algorithm>
+#include <cstdlib>
 #endif
 
 #define TAG "AudioDebugger"
 
+#if CONFIG_USE_AUDIO_DEBUGGER && CONFIG_AUDIO_DEBUG_ADPCM
+static const int16_t kImaStepTable[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+};
+
+static const int8_t kImaIndexTable[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+// Encode one channel of interleaved samples into a self-contained IMA-ADPCM block
+static uint8_t* EncodeImaAdpcm(const int16_t* data, int samples, int channels, uint8_t* out) {
+    int32_t predictor = samples > 0 ? data[0] : 0;
+    int index = 0;
+    // Pick an initial step close to the first sample delta so the block starts locked
+    if (samples > 1) {
+        int delta = std::abs(data[channels] - data[0]);
+        while (index < 88 && kImaStepTable[index] < delta) {
+            index++;
+        }
+    }
+    uint16_t initial = htons((uint16_t)predictor);
+    memcpy(out, &initial, sizeof(initial));
+    out[2] = index;
+    out[3] = 0;
+    out += 4;
+
+    for (int i = 0; i < samples; i++) {
+        int32_t diff = data[i * channels] - predictor;
+        uint8_t nibble = 0;
+        if (diff < 0) {
+            nibble = 8;
+            diff = -diff;
+        }
+        int32_t step = kImaStepTable[index];
+        int32_t vpdiff = step >> 3;
+        if (diff >= step) {
+            nibble |= 4;
+            diff -= step;
+            vpdiff += step;
+        }
+        step >>= 1;
+        if (diff >= step) {
+            nibble |= 2;
+            diff -= step;
+            vpdiff += step;
+        }
+        step >>= 1;
+        if (diff >= step) {
+            nibble |= 1;
+            vpdiff += step;
+        }
+        predictor += (nibble & 8) ? -vpdiff : vpdiff;
+        predictor = std::clamp<int32_t>(predictor, INT16_MIN, INT16_MAX);
+        index = std::clamp(index + kImaIndexTable[nibble & 7], 0, 88);
+
+        if (i & 1) {
+            out[i / 2] |= nibble << 4;
+        } else {
+            out[i / 2] = nibble;
+        }
+    }
+    return out + (samples + 1) / 2;
+}
+#endif
+
 
 AudioDebugger::AudioDebugger() {
 #if CONFIG_USE_AUDIO_DEBUGGER
@@ -51,18 +123,62 @@ AudioDebugger::~AudioDebugger() {
 #endif
 }
 
-void AudioDebugger::Feed(const std::vector<int16_t>& data) {
+void AudioDebugger::Feed(AudioDebugTap tap, const std::vector<int16_t>& data, int sample_rate, int channels) {
 #if CONFIG_USE_AUDIO_DEBUGGER
-    if (udp_sockfd_ >= 0) {
-        ssize_t sent = sendto(udp_sockfd_, data.data(), data.size() * sizeof(int16_t), 0,
-                             (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
-        if (sent < 0) {
-            ESP_LOGW(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
-        } else {
-            ESP_LOGD(TAG, "Sent %d bytes audio data to %s", sent, CONFIG_AUDIO_DEBUG_UDP_SERVER);
-        }
+    if (udp_sockfd_ < 0 || channels <= 0 || data.empty()) {
+        return;
+    }
+
+    // Split the frame so that every datagram fits in a single Wi-Fi MTU
+    int payload_size = AUDIO_DEBUG_MAX_PACKET_SIZE - sizeof(AudioDebugPacketHeader);
+#if CONFIG_AUDIO_DEBUG_ADPCM
+    int max_samples = (payload_size / channels - 4) * 2;
+#else
+    int max_samples = payload_size / channels / sizeof(int16_t);
+#endif
+    int total_samples = data.size() / channels;
+    int64_t timestamp = esp_timer_get_time();
+    for (int offset = 0; offset < total_samples; offset += max_samples) {
+        int samples = std::min(max_samples, total_samples - offset);
+        SendChunk(tap, data.data() + offset * channels, samples, sample_rate, channels,
+            timestamp + (int64_t)offset * 1000000 / sample_rate);
     }
 #endif
 }
 
- 
\ No newline at end of file
+void AudioDebugger::SendChunk(AudioDebugTap tap, const int16_t* data, int samples, int sample_rate, int channels, int64_t timestamp) {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto header = (AudioDebugPacketHeader*)packet_;
+    header->magic = AUDIO_DEBUG_MAGIC;
+    header->version = AUDIO_DEBUG_VERSION;
+    header->tap = tap;
+    header->sequence = htonl(sequences_[tap]++);
+    header->timestamp = htonl((uint32_t)timestamp);
+    header->sample_rate = htonl(sample_rate);
+    header->channels = htons(channels);
+    header->samples = htons(samples);
+
+    uint8_t* payload = packet_ + sizeof(AudioDebugPacketHeader);
+#if CONFIG_AUDIO_DEBUG_ADPCM
+    header->encoding = kAudioDebugEncodingImaAdpcm;
+    uint8_t* end = payload;
+    for (int ch = 0; ch < channels; ch++) {
+        end = EncodeImaAdpcm(data + ch, samples, channels, end);
+    }
+    size_t size = end - packet_;
+#else
+    header->encoding = kAudioDebugEncodingPcm16;
+    memcpy(payload, data, samples * channels * sizeof(int16_t));
+    size_t size = sizeof(AudioDebugPacketHeader) + samples * channels * sizeof(int16_t);
+#endif
+
+    ssize_t sent = sendto(udp_sockfd_, packet_, size, 0,
+                         (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
+    if (sent < 0) {
+        ESP_LOGW(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
+    } else {
+        ESP_LOGD(TAG, "Sent %d bytes of tap %d to %s", sent, tap, CONFIG_AUDIO_DEBUG_UDP_SERVER);
+    }
+#endif
+}
@@ -3,20 +3,64 @@
 
 #include <vector>
 #include <cstdint>
+#include <mutex>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+/*
+ * Every UDP datagram starts with an AudioDebugPacketHeader (network byte order).
+ * PCM payloads carry interleaved int16 samples. IMA-ADPCM payloads carry one
+ * block per channel: int16 predictor, uint8 step index, uint8 reserved, then
+ * (samples + 1) / 2 bytes of nibbles, low nibble first. Each datagram is
+ * decodable on its own, so a lost datagram only leaves a gap in its tap.
+ */
+#define AUDIO_DEBUG_MAGIC           0xAD
+#define AUDIO_DEBUG_VERSION         1
+#define AUDIO_DEBUG_MAX_PACKET_SIZE 1400
+
+enum AudioDebugTap : uint8_t {
+    kAudioDebugTapRawInput = 0,     // Codec input before resampling
+    kAudioDebugTapResampledInput,   // 16 kHz input fed to the processor / wake word
+    kAudioDebugTapProcessedInput,   // Audio processor output, encoded for uplink
+    kAudioDebugTapDecodedOutput,    // Opus decoder output
+    kAudioDebugTapSpeakerOutput,    // Final PCM handed to the codec
+    kAudioDebugTapCount,
+};
+
+enum AudioDebugEncoding : uint8_t {
+    kAudioDebugEncodingPcm16 = 0,
+    kAudioDebugEncodingImaAdpcm = 1,
+};
+
+struct AudioDebugPacketHeader {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t tap;
+    uint8_t encoding;
+    uint32_t sequence;      // Per tap, increases by one per datagram
+    uint32_t timestamp;     // esp_timer time of the first sample in microseconds (wraps)
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t samples;       // Samples per channel in this datagram
+} __attribute__((packed));
+
 class AudioDebugger {
 public:
     AudioDebugger();
     ~AudioDebugger();
 
-    void Feed(const std::vector<int16_t>& data);
+    void Feed(AudioDebugTap tap, const std::vector<int16_t>& data, int sample_rate, int channels);
 
 private:
     int udp_sockfd_ = -1;
     struct sockaddr_in udp_server_addr_;
+    uint32_t sequences_[kAudioDebugTapCount] = {};
+    // The taps are fed from the input, codec and output tasks, which share one datagram buffer
+    std::mutex mutex_;
+    uint8_t packet_[AUDIO_DEBUG_MAX_PACKET_SIZE];
+
+    void SendChunk(AudioDebugTap tap, const int16_t* data, int samples, int sample_rate, int channels, int64_t timestamp);
 };
 
-#endif 
\ No newline at end of file
+#endif
@@ -8,21 +8,12 @@ void NoAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms) {
     frame_samples_ = frame_duration_ms * 16000 / 1000;
 }
 
-void NoAudioProcessor::Feed(std::vector<int16_t>&& data) {
+void NoAudioProcessor::Feed(const AudioSpan& data) {
     if (!is_running_ || !output_callback_) {
         return;
     }
-
-    if (codec_->input_channels() == 2) {
-        // If input channels is 2, we need to fetch the left channel data
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-            mono_data[i] = data[j];
-        }
-        output_callback_(std::move(mono_data));
-    } else {
-        output_callback_(std::move(data));
-    }
+    // The mic channel, the output is queued for encoding and needs its own copy
+    output_callback_(std::vector<int16_t>(data.begin(), data.end()));
 }
 
 void NoAudioProcessor::Start() {
@@ -13,7 +13,7 @@ public:
     ~NoAudioProcessor() = default;
 
     void Initialize(AudioCodec* codec, int frame_duration_ms) override;
-    void Feed(std::vector<int16_t>&& data) override;
+    void Feed(const AudioSpan& data) override;
     void Start() override;
     void Stop() override;
     bool IsRunning() override;
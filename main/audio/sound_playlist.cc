@@ -0,0 +1,69 @@
+#include "sound_playlist.h"
+
+#include <chrono>
+
+void SoundCompletion::Finish(SoundResult result) {
+    std::function<void()> on_complete;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (result_ != kSoundPending) {
+            return;
+        }
+        result_ = result;
+        on_complete = std::move(on_complete_);
+        cancel_hook_ = nullptr;
+    }
+    cv_.notify_all();
+    if (on_complete) {
+        on_complete();
+    }
+}
+
+bool SoundCompletion::Wait(uint32_t timeout_ms) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto finished = [this]() { return result_ != kSoundPending; };
+    if (timeout_ms == UINT32_MAX) {
+        cv_.wait(lock, finished);
+        return true;
+    }
+    return cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), finished);
+}
+
+SoundResult SoundCompletion::result() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return result_;
+}
+
+void SoundCompletion::RequestCancel() {
+    std::function<void()> hook;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (result_ != kSoundPending || cancel_requested_) {
+            return;
+        }
+        cancel_requested_ = true;
+        hook = cancel_hook_;
+    }
+    if (hook) {
+        hook();
+    }
+}
+
+bool SoundCompletion::cancel_requested() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cancel_requested_;
+}
+
+bool SoundHandle::Wait(uint32_t timeout_ms) const {
+    return completion_ == nullptr || completion_->Wait(timeout_ms);
+}
+
+void SoundHandle::Cancel() const {
+    if (completion_ != nullptr) {
+        completion_->RequestCancel();
+    }
+}
+
+SoundResult SoundHandle::result() const {
+    return completion_ == nullptr ? kSoundDropped : completion_->result();
+}
@@ -0,0 +1,90 @@
+#ifndef SOUND_PLAYLIST_H
+#define SOUND_PLAYLIST_H
+
+#include <string_view>
+#include <functional>
+#include <condition_variable>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+/*
+ * Sounds and silences queued as one unit on the sound lane.
+ *
+ * AudioService::PlaySounds never blocks. It returns a SoundHandle that reports
+ * how the playlist ended. The handle can be waited on from a worker task, or
+ * cancelled from anywhere. The main loop should not wait on it; it passes an
+ * on_complete callback and Schedules from there instead.
+ */
+
+enum SoundResult {
+    kSoundPending,
+    kSoundPlayed,       // The last frame, with the tail the segment joiner held, has been handed to the codec
+    kSoundCancelled,
+    kSoundDropped,      // The sound queue was full, or the service stopped
+};
+
+class SoundPlaylist {
+public:
+    struct Item {
+        std::string_view ogg;       // Empty for a silence
+        uint32_t silence_ms;
+    };
+
+    // The Ogg data must outlive the playback, like the embedded assets do
+    SoundPlaylist& AddSound(const std::string_view& ogg) {
+        items_.push_back(Item{ogg, 0});
+        return *this;
+    }
+    SoundPlaylist& AddSilence(uint32_t duration_ms) {
+        items_.push_back(Item{std::string_view(), duration_ms});
+        return *this;
+    }
+
+    inline const std::vector<Item>& items() const { return items_; }
+    inline bool empty() const { return items_.empty(); }
+
+private:
+    std::vector<Item> items_;
+};
+
+/* State shared by the handles and the sound lane, the first Finish wins */
+class SoundCompletion {
+public:
+    explicit SoundCompletion(std::function<void()> on_complete) : on_complete_(std::move(on_complete)) {}
+
+    void Finish(SoundResult result);
+    bool Wait(uint32_t timeout_ms);
+    SoundResult result();
+    // Called by SoundHandle::Cancel, the service drops the remaining sounds
+    void RequestCancel();
+    bool cancel_requested();
+    void SetCancelHook(std::function<void()> hook) { cancel_hook_ = std::move(hook); }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    SoundResult result_ = kSoundPending;
+    bool cancel_requested_ = false;
+    std::function<void()> on_complete_;
+    std::function<void()> cancel_hook_;
+};
+
+class SoundHandle {
+public:
+    SoundHandle() = default;
+    explicit SoundHandle(std::shared_ptr<SoundCompletion> completion) : completion_(std::move(completion)) {}
+
+    // True once the playlist has ended, in any way. Do not call from the main loop
+    bool Wait(uint32_t timeout_ms = UINT32_MAX) const;
+    void Cancel() const;
+    SoundResult result() const;
+    bool done() const { return result() != kSoundPending; }
+    explicit operator bool() const { return completion_ != nullptr; }
+
+private:
+    std::shared_ptr<SoundCompletion> completion_;
+};
+
+#endif // SOUND_PLAYLIST_H
@@ -6,13 +6,16 @@
 #include <functional>
 
 #include "audio_codec.h"
+#include "input_fanout.h"
 
 class WakeWord {
 public:
     virtual ~WakeWord() = default;
     
     virtual bool Initialize(AudioCodec* codec) = 0;
-    virtual void Feed(const std::vector<int16_t>& data) = 0;
+    // GetFeedSize frames of the GetFeedView channels
+    virtual void Feed(const AudioSpan& data) = 0;
+    virtual AudioInputView GetFeedView() const { return kAudioInputViewMic; }
     virtual void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) = 0;
     virtual void Start() = 0;
     virtual void Stop() = 0;
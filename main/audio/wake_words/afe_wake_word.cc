@@ -100,11 +100,11 @@ void AfeWakeWord::Stop() {
     }
 }
 
-void AfeWakeWord::Feed(const std::vector<int16_t>& data) {
+void AfeWakeWord::Feed(const AudioSpan& data) {
     if (afe_data_ == nullptr) {
         return;
     }
-    afe_iface_->feed(afe_data_, data.data());
+    afe_iface_->feed(afe_data_, data.data);
 }
 
 size_t AfeWakeWord::GetFeedSize() {
@@ -75,25 +75,14 @@ void CustomWakeWord::Stop() {
     running_ = false;
 }
 
-void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
+void CustomWakeWord::Feed(const AudioSpan& data) {
     if (multinet_model_data_ == nullptr || !running_) {
         return;
     }
 
-    esp_mn_state_t mn_state;
-    // If input channels is 2, we need to fetch the left channel data
-    if (codec_->input_channels() == 2) {
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-            mono_data[i] = data[j];
-        }
-
-        StoreWakeWordData(mono_data);
-        mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(mono_data.data()));
-    } else {
-        StoreWakeWordData(data);
-        mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(data.data()));
-    }
+    // The mic channel, split from the reference by the AudioService
+    StoreWakeWordData(data);
+    esp_mn_state_t mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(data.data));
     
     if (mn_state == ESP_MN_STATE_DETECTING) {
         return;
@@ -124,9 +113,9 @@ size_t CustomWakeWord::GetFeedSize() {
     return multinet_->get_samp_chunksize(multinet_model_data_);
 }
 
-void CustomWakeWord::StoreWakeWordData(const std::vector<int16_t>& data) {
+void CustomWakeWord::StoreWakeWordData(const AudioSpan& data) {
     // store audio data to wake_word_pcm_
-    wake_word_pcm_.push_back(data);
+    wake_word_pcm_.emplace_back(data.begin(), data.end());
     // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
     while (wake_word_pcm_.size() > 2000 / 30) {
         wake_word_pcm_.pop_front();
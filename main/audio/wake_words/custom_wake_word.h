@@ -23,7 +23,7 @@ public:
     ~CustomWakeWord();
 
     bool Initialize(AudioCodec* codec);
-    void Feed(const std::vector<int16_t>& data);
+    void Feed(const AudioSpan& data);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
     void Start();
     void Stop();
@@ -52,7 +52,7 @@ private:
     std::mutex wake_word_mutex_;
     std::condition_variable wake_word_cv_;
 
-    void StoreWakeWordData(const std::vector<int16_t>& data);
+    void StoreWakeWordData(const AudioSpan& data);
 };
 
 #endif
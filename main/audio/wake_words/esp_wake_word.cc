@@ -51,12 +51,12 @@ void EspWakeWord::Stop() {
     running_ = false;
 }
 
-void EspWakeWord::Feed(const std::vector<int16_t>& data) {
+void EspWakeWord::Feed(const AudioSpan& data) {
     if (wakenet_data_ == nullptr || !running_) {
         return;
     }
 
-    int res = wakenet_iface_->detect(wakenet_data_, (int16_t *)data.data());
+    int res = wakenet_iface_->detect(wakenet_data_, const_cast<int16_t*>(data.data));
     if (res > 0) {
         last_detected_wake_word_ = wakenet_iface_->get_word_name(wakenet_data_, res);
         running_ = false;
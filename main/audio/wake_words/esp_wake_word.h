@@ -19,7 +19,8 @@ public:
     ~EspWakeWord();
 
     bool Initialize(AudioCodec* codec);
-    void Feed(const std::vector<int16_t>& data);
+    void Feed(const AudioSpan& data);
+    AudioInputView GetFeedView() const { return kAudioInputViewInterleaved; }
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
     void Start();
     void Stop();
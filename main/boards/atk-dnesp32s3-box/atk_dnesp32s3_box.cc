@@ -34,13 +34,12 @@ public:
         i2s_chan_config_t chan_cfg = {
             .id = I2S_NUM_0,
             .role = I2S_ROLE_MASTER,
-            .dma_desc_num = AUDIO_CODEC_DMA_DESC_NUM,
-            .dma_frame_num = AUDIO_CODEC_DMA_FRAME_NUM,
+            .dma_desc_num = (uint32_t)dma_desc_num_,
+            .dma_frame_num = (uint32_t)dma_frame_num_,
             .auto_clear_after_cb = true,
             .auto_clear_before_cb = false,
             .intr_priority = 0,
         };
-        ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, &tx_handle_, &rx_handle_));
     
         i2s_std_config_t std_cfg = {
             .clk_cfg = {
@@ -78,8 +77,9 @@ public:
                 }
             }
         };
-        ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
-        ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
+        tx_chan_cfg_ = rx_chan_cfg_ = chan_cfg;
+        tx_std_cfg_ = rx_std_cfg_ = std_cfg;
+        CreateChannels();
         ESP_LOGI(TAG, "Duplex channels created");
     }
 };
@@ -99,11 +99,13 @@ private:
         //不插耳机
         phone_button_.OnPressDown([this]() {
             gpio_set_level(SPK_EN_PIN, 1);
+            GetAudioCodec()->SetMaxOutputChannels(1);
         });
 
-        //插入耳机
+        //插入耳机，耳机是立体声的
         phone_button_.OnPressUp([this]() {
             gpio_set_level(SPK_EN_PIN, 0);
+            GetAudioCodec()->SetMaxOutputChannels(2);
         });
     }
 
@@ -207,7 +209,8 @@ public:
             AUDIO_I2S_GPIO_DOUT, 
             AUDIO_I2S_GPIO_DIN,
             GPIO_NUM_NC, 
-            AUDIO_CODEC_ES8388_ADDR
+            AUDIO_CODEC_ES8388_ADDR,
+            gpio_get_level(PHONE_CK_PIN) != 0  // 插入耳机时输出立体声
         );
         return &audio_codec;
     }
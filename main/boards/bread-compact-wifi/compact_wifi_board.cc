@@ -184,6 +184,10 @@ public:
         return &audio_codec;
     }
 
+    virtual std::string GetAudioPlaybackEq() override {
+        return AUDIO_PLAYBACK_EQ;
+    }
+
     virtual Display* GetDisplay() override {
         return display_;
     }
@@ -6,6 +6,9 @@
 #define AUDIO_INPUT_SAMPLE_RATE  16000
 #define AUDIO_OUTPUT_SAMPLE_RATE 24000
 
+// 小喇叭低频衰减，提升人声清晰度
+#define AUDIO_PLAYBACK_EQ "hp,200,0,0.707;peak,3000,4,1.2"
+
 // 如果使用 Duplex I2S 模式，请注释下面一行
 #define AUDIO_I2S_METHOD_SIMPLEX
 
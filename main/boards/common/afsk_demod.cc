@@ -1,6 +1,8 @@
 #include "afsk_demod.h"
 #include <cstring>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
 #include "esp_log.h"
 #include "display.h"
 
@@ -14,92 +16,79 @@ namespace audio_wifi_config
 
     void ReceiveWifiCredentialsFromAudio(Application *app,
                                         WifiConfigurationAp *wifi_ap,
-                                        Display *display,
-                                        size_t input_channels
-                                    )
+                                        Display *display)
     {
         const int kInputSampleRate = 16000;                                    // Input sampling rate
         const float kDownsampleStep = static_cast<float>(kInputSampleRate) / static_cast<float>(kAudioSampleRate); // Downsampling step
-        std::vector<int16_t> audio_data;
         AudioSignalProcessor signal_processor(kAudioSampleRate, kMarkFrequency, kSpaceFrequency, kBitRate, kWindowSize);
         AudioDataBuffer data_buffer;
-
-        while (true)
-        {
-            // 检查Application状态，只有在WiFi配置模式下才处理音频
-            if (app->GetDeviceState() != kDeviceStateWifiConfiguring) {
-                // 不在WiFi配置状态，休眠100ms后再检查
-                vTaskDelay(pdMS_TO_TICKS(100));
-                continue;
-            }
-            
-            if (!app->GetAudioService().ReadAudioData(audio_data, 16000, 480)) { // 16kHz, 480 samples corresponds to 30ms data
-                // 读取音频失败，短暂延迟后重试
-                ESP_LOGI(kLogTag, "Failed to read audio data, retrying.");
-                vTaskDelay(pdMS_TO_TICKS(10));
-                continue;
+        std::vector<float> downsampled_data;
+        float downsample_position = 0.0f;
+        std::mutex received_mutex;
+        std::condition_variable received_cv;
+        std::optional<std::string> received_text;
+
+        // 解调在音频输入任务中进行，直接使用拆分好的单声道数据，本任务只负责连接 WiFi
+        app->GetAudioService().SetInputTap([&](const AudioInputFrame& frame) {
+            // 只有在WiFi配置模式下才处理音频
+            if (app->GetDeviceState() != kDeviceStateWifiConfiguring || frame.sample_rate != kInputSampleRate) {
+                return;
             }
 
-            if (input_channels == 2) { // 如果是双声道输入，转换为单声道
-                auto mono_data = std::vector<int16_t>(audio_data.size() / 2);
-                for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                    mono_data[i] = audio_data[j];
-                }
-                audio_data = std::move(mono_data);
-            }
-            
-            // Downsample the audio data
-            std::vector<float> downsampled_data;
-            size_t last_index = 0;
-
-            if (kDownsampleStep > 1.0f) {
-                downsampled_data.reserve(audio_data.size() / static_cast<size_t>(kDownsampleStep));
-                for (size_t i = 0; i < audio_data.size(); ++i) {
-                    size_t sample_index = static_cast<size_t>(i / kDownsampleStep);
-                    if ((sample_index + 1) > last_index) {
-                        downsampled_data.push_back(static_cast<float>(audio_data[i]));
-                        last_index = sample_index + 1;
-                    }
-                }
-            } else {
-                downsampled_data.reserve(audio_data.size());
-                for (int16_t sample : audio_data) {
+            // Downsample the audio data, the position carries over to the next block
+            downsampled_data.clear();
+            for (int16_t sample : frame.mono) {
+                if (downsample_position <= 0.0f) {
                     downsampled_data.push_back(static_cast<float>(sample));
+                    downsample_position += kDownsampleStep;
                 }
+                downsample_position -= 1.0f;
             }
-            
+
             // Process audio samples to get probability data
             auto probabilities = signal_processor.ProcessAudioSamples(downsampled_data);
-            
+
             // Feed probability data to the data buffer
-            if (data_buffer.ProcessProbabilityData(probabilities, 0.5f)) {
-                // If complete data was received, extract WiFi credentials
-                if (data_buffer.decoded_text.has_value()) {
-                    ESP_LOGI(kLogTag, "Received text data: %s", data_buffer.decoded_text->c_str());
-                    display->SetChatMessage("system", data_buffer.decoded_text->c_str());
-                    
-                    // Split SSID and password by newline character
-                    std::string wifi_ssid, wifi_password;
-                    size_t newline_position = data_buffer.decoded_text->find('\n');
-                    if (newline_position != std::string::npos) {
-                        wifi_ssid = data_buffer.decoded_text->substr(0, newline_position);
-                        wifi_password = data_buffer.decoded_text->substr(newline_position + 1);
-                        ESP_LOGI(kLogTag, "WiFi SSID: %s, Password: %s", wifi_ssid.c_str(), wifi_password.c_str());
-                    } else {
-                        ESP_LOGE(kLogTag, "Invalid data format, no newline character found");
-                        continue;
-                    }
-                    
-                    if (wifi_ap->ConnectToWifi(wifi_ssid, wifi_password)) {
-                        wifi_ap->Save(wifi_ssid, wifi_password);  // Save WiFi credentials
-                        esp_restart();                            // Restart device to apply new WiFi configuration
-                    } else {
-                        ESP_LOGE(kLogTag, "Failed to connect to WiFi with received credentials");
-                    }
-                    data_buffer.decoded_text.reset();  // Clear processed data
-                }
+            if (data_buffer.ProcessProbabilityData(probabilities, 0.5f) && data_buffer.decoded_text.has_value()) {
+                std::lock_guard<std::mutex> lock(received_mutex);
+                received_text = std::move(data_buffer.decoded_text);
+                data_buffer.decoded_text.reset();  // Clear processed data
+                received_cv.notify_one();
+            }
+        });
+
+        while (true)
+        {
+            std::string text;
+            {
+                std::unique_lock<std::mutex> lock(received_mutex);
+                received_cv.wait(lock, [&received_text]() { return received_text.has_value(); });
+                text = std::move(*received_text);
+                received_text.reset();
+            }
+
+            // If complete data was received, extract WiFi credentials
+            ESP_LOGI(kLogTag, "Received text data: %s", text.c_str());
+            display->SetChatMessage("system", text.c_str());
+
+            // Split SSID and password by newline character
+            std::string wifi_ssid, wifi_password;
+            size_t newline_position = text.find('\n');
+            if (newline_position != std::string::npos) {
+                wifi_ssid = text.substr(0, newline_position);
+                wifi_password = text.substr(newline_position + 1);
+                ESP_LOGI(kLogTag, "WiFi SSID: %s, Password: %s", wifi_ssid.c_str(), wifi_password.c_str());
+            } else {
+                ESP_LOGE(kLogTag, "Invalid data format, no newline character found");
+                continue;
+            }
+
+            if (wifi_ap->ConnectToWifi(wifi_ssid, wifi_password)) {
+                wifi_ap->Save(wifi_ssid, wifi_password);  // Save WiFi credentials
+                esp_restart();                            // Restart device to apply new WiFi configuration
+            } else {
+                ESP_LOGE(kLogTag, "Failed to connect to WiFi with received credentials");
             }
-            vTaskDelay(pdMS_TO_TICKS(1));  // 1ms delay
         }
     }
 
@@ -3,11 +3,13 @@
 #include "settings.h"
 #include "display/display.h"
 #include "assets/lang_config.h"
+#include "downlink_buffer.h"
 
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_chip_info.h>
 #include <esp_random.h>
+#include <esp_heap_caps.h>
 
 #define TAG "Board"
 
@@ -52,6 +54,17 @@ bool Board::GetTemperature(float& esp32temp){
     return false;
 }
 
+uint32_t Board::GetDownlinkBufferMs() {
+    if (heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0) {
+        return DOWNLINK_BUFFER_PSRAM_MS;
+    }
+#if CONFIG_IDF_TARGET_ESP32C3
+    return DOWNLINK_BUFFER_SMALL_MS;
+#else
+    return DOWNLINK_BUFFER_INTERNAL_MS;
+#endif
+}
+
 Display* Board::GetDisplay() {
     static NoDisplay display;
     return &display;
@@ -39,6 +39,10 @@ public:
     virtual Backlight* GetBacklight() { return nullptr; }
     virtual Led* GetLed();
     virtual AudioCodec* GetAudioCodec() = 0;
+    // Default playback EQ bands for the speaker, see audio/dsp/biquad_eq.h for the format
+    virtual std::string GetAudioPlaybackEq() { return ""; }
+    // Received audio that may be buffered ahead of playback, see audio/downlink_buffer.h
+    virtual uint32_t GetDownlinkBufferMs();
     virtual bool GetTemperature(float& esp32temp);
     virtual Display* GetDisplay();
     virtual Camera* GetCamera();
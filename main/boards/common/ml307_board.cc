@@ -6,6 +6,7 @@
 #include "assets/lang_config.h"
 
 #include <esp_log.h>
+#include <cmath>
 #include <esp_timer.h>
 #include <opus_encoder.h>
 
@@ -117,7 +118,14 @@ std::string Ml307Board::GetDeviceStatusJson() {
      * 返回的JSON结构如下：
      * {
      *     "audio_speaker": {
-     *         "volume": 70
+     *         "volume": 70,
+     *         "speaking_speed": 100
+     *     },
+     *     "audio_encoder": {
+     *         "complexity": 3
+     *     },
+     *     "aec": {
+     *         "reference_delay_ms": 3.25
      *     },
      *     "screen": {
      *         "brightness": 100,
@@ -143,8 +151,25 @@ std::string Ml307Board::GetDeviceStatusJson() {
     if (audio_codec) {
         cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
     }
+#if CONFIG_USE_PLAYBACK_TIME_STRETCH
+    cJSON_AddNumberToObject(audio_speaker, "speaking_speed", Application::GetInstance().GetAudioService().GetSpeakingSpeed());
+#endif
     cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
 
+    // Audio encoder
+    auto audio_encoder = cJSON_CreateObject();
+    cJSON_AddNumberToObject(audio_encoder, "complexity", Application::GetInstance().GetAudioService().GetEncoderComplexity());
+    cJSON_AddItemToObject(root, "audio_encoder", audio_encoder);
+
+    // Echo reference alignment, only on boards with a reference channel
+    float echo_delay_ms;
+    if (audio_codec && audio_codec->input_reference() &&
+        Application::GetInstance().GetAudioService().GetEchoReferenceDelay(echo_delay_ms)) {
+        auto aec = cJSON_CreateObject();
+        cJSON_AddNumberToObject(aec, "reference_delay_ms", roundf(echo_delay_ms * 100) / 100);
+        cJSON_AddItemToObject(root, "aec", aec);
+    }
+
     // Screen brightness
     auto backlight = board.GetBacklight();
     auto screen = cJSON_CreateObject();
@@ -11,6 +11,7 @@
 #include <freertos/task.h>
 #include <esp_network.h>
 #include <esp_log.h>
+#include <cmath>
 
 #include <wifi_station.h>
 #include <wifi_configuration_ap.h>
@@ -53,13 +54,8 @@ void WifiBoard::EnterWifiConfigMode() {
 
     #if CONFIG_USE_ACOUSTIC_WIFI_PROVISIONING
     auto display = Board::GetInstance().GetDisplay();
-    auto codec = Board::GetInstance().GetAudioCodec();
-    int channel = 1;
-    if (codec) {
-        channel = codec->input_channels();
-    }
-    ESP_LOGI(TAG, "Start receiving WiFi credentials from audio, input channels: %d", channel);
-    audio_wifi_config::ReceiveWifiCredentialsFromAudio(&application, &wifi_ap, display, channel);
+    ESP_LOGI(TAG, "Start receiving WiFi credentials from audio");
+    audio_wifi_config::ReceiveWifiCredentialsFromAudio(&application, &wifi_ap, display);
     #endif
     
     // Wait forever until reset after configuration
@@ -177,7 +173,14 @@ std::string WifiBoard::GetDeviceStatusJson() {
      * 返回的JSON结构如下：
      * {
      *     "audio_speaker": {
-     *         "volume": 70
+     *         "volume": 70,
+     *         "speaking_speed": 100
+     *     },
+     *     "audio_encoder": {
+     *         "complexity": 3
+     *     },
+     *     "aec": {
+     *         "reference_delay_ms": 3.25
      *     },
      *     "screen": {
      *         "brightness": 100,
@@ -206,8 +209,25 @@ std::string WifiBoard::GetDeviceStatusJson() {
     if (audio_codec) {
         cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
     }
+#if CONFIG_USE_PLAYBACK_TIME_STRETCH
+    cJSON_AddNumberToObject(audio_speaker, "speaking_speed", Application::GetInstance().GetAudioService().GetSpeakingSpeed());
+#endif
     cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
 
+    // Audio encoder
+    auto audio_encoder = cJSON_CreateObject();
+    cJSON_AddNumberToObject(audio_encoder, "complexity", Application::GetInstance().GetAudioService().GetEncoderComplexity());
+    cJSON_AddItemToObject(root, "audio_encoder", audio_encoder);
+
+    // Echo reference alignment, only on boards with a reference channel
+    float echo_delay_ms;
+    if (audio_codec && audio_codec->input_reference() &&
+        Application::GetInstance().GetAudioService().GetEchoReferenceDelay(echo_delay_ms)) {
+        auto aec = cJSON_CreateObject();
+        cJSON_AddNumberToObject(aec, "reference_delay_ms", roundf(echo_delay_ms * 100) / 100);
+        cJSON_AddItemToObject(root, "aec", aec);
+    }
+
     // Screen brightness
     auto backlight = board.GetBacklight();
     auto screen = cJSON_CreateObject();
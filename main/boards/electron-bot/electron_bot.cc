@@ -115,6 +115,10 @@ public:
         return &audio_codec;
     }
 
+    virtual std::string GetAudioPlaybackEq() override {
+        return AUDIO_PLAYBACK_EQ;
+    }
+
     virtual Display* GetDisplay() override { return display_; }
 
     virtual Backlight* GetBacklight() override {
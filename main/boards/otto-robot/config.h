@@ -16,6 +16,9 @@
 
 #define AUDIO_INPUT_SAMPLE_RATE 16000
 #define AUDIO_OUTPUT_SAMPLE_RATE 24000
+
+// 小喇叭低频衰减，提升人声清晰度
+#define AUDIO_PLAYBACK_EQ "hp,250,0,0.707;peak,2800,5,1.0"
 #define AUDIO_I2S_METHOD_SIMPLEX
 
 #define AUDIO_I2S_MIC_GPIO_WS GPIO_NUM_4
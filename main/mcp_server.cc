@@ -8,11 +8,13 @@
 #include <esp_app_desc.h>
 #include <algorithm>
 #include <cstring>
+#include <cmath>
 #include <esp_pthread.h>
 
 #include "application.h"
 #include "display.h"
 #include "board.h"
+#include "system_info.h"
 
 #define TAG "MCP"
 
@@ -55,6 +57,73 @@ void McpServer::AddCommonTools() {
             codec->SetOutputVolume(properties["volume"].value<int>());
             return true;
         });
+
+    AddTool("self.audio.get_i2s_health",
+        "Counts the audio lost at the microphone and the speaker in the current session. "
+        "Only use this tool when the user asks about stuttering, choppy audio or missed wake words.\n"
+        "Return:\n"
+        "  A JSON object with the microphone overruns and the milliseconds they lost, and the speaker underruns and the milliseconds of silence they caused.",
+        PropertyList(),
+        [codec = board.GetAudioCodec()](const PropertyList& properties) -> ReturnValue {
+            I2sHealth health;
+            if (!SystemInfo::GetI2sHealth(health)) {
+                return "{\"success\": false, \"message\": \"No audio codec\"}";
+            }
+            cJSON* root = cJSON_CreateObject();
+            cJSON_AddBoolToObject(root, "success", true);
+            cJSON_AddNumberToObject(root, "input_overruns", health.rx_overruns);
+            cJSON_AddNumberToObject(root, "input_lost_ms", (uint64_t)health.rx_frames_lost * 1000 / codec->input_sample_rate());
+            cJSON_AddNumberToObject(root, "output_underruns", health.tx_underruns);
+            cJSON_AddNumberToObject(root, "output_silence_ms", (uint64_t)health.tx_frames_starved * 1000 / codec->output_sample_rate());
+            auto json_str = cJSON_PrintUnformatted(root);
+            std::string json(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(root);
+            return json;
+        });
+
+#if CONFIG_USE_PLAYBACK_TIME_STRETCH
+    AddTool("self.audio_speaker.set_speaking_speed",
+        "Set the speaking speed of the assistant voice in percent, 100 is the normal speed. If the current speed is unknown, you must call `self.get_device_status` tool first and then call this tool.",
+        PropertyList({
+            Property("speed", kPropertyTypeInteger, MIN_SPEAKING_SPEED, MAX_SPEAKING_SPEED)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& audio_service = Application::GetInstance().GetAudioService();
+            return audio_service.SetSpeakingSpeed(properties["speed"].value<int>());
+        });
+#endif
+
+#if CONFIG_USE_LATENCY_SELF_TEST
+    AddTool("self.audio_speaker.measure_latency",
+        "Measure the acoustic round-trip latency of the device. Plays a few short chirps through the speaker and listens for them with the microphone, "
+        "so the room should be quiet. Only use this tool when the user asks for an audio latency test.\n"
+        "Return:\n"
+        "  A JSON object with the round trip, its jitter and the output buffer, acoustic and input buffer parts in milliseconds.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& audio_service = Application::GetInstance().GetAudioService();
+            LatencyTestReport report;
+            if (!audio_service.RunLatencyTest(report)) {
+                return "{\"success\": false, \"message\": \"The test chirps were not heard by the microphone\"}";
+            }
+            cJSON* root = cJSON_CreateObject();
+            cJSON_AddBoolToObject(root, "success", true);
+            cJSON_AddNumberToObject(root, "bursts", report.bursts);
+            cJSON_AddNumberToObject(root, "round_trip_ms", roundf(report.round_trip_ms * 10) / 10);
+            cJSON_AddNumberToObject(root, "min_ms", roundf(report.min_ms * 10) / 10);
+            cJSON_AddNumberToObject(root, "max_ms", roundf(report.max_ms * 10) / 10);
+            cJSON_AddNumberToObject(root, "jitter_ms", roundf(report.jitter_ms * 10) / 10);
+            cJSON_AddNumberToObject(root, "output_buffer_ms", roundf(report.output_buffer_ms * 10) / 10);
+            cJSON_AddNumberToObject(root, "acoustic_ms", roundf(report.acoustic_ms * 10) / 10);
+            cJSON_AddNumberToObject(root, "input_buffer_ms", roundf(report.input_buffer_ms * 10) / 10);
+            auto json_str = cJSON_PrintUnformatted(root);
+            std::string json(json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(root);
+            return json;
+        });
+#endif
     
     auto backlight = board.GetBacklight();
     if (backlight) {
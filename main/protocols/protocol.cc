@@ -1,4 +1,7 @@
 #include "protocol.h"
+#include "board.h"
+#include "audio_codec.h"
+#include "application.h"
 
 #include <esp_log.h>
 
@@ -24,6 +27,77 @@ void Protocol::OnNetworkError(std::function<void(const std::string& message)> ca
     on_network_error_ = callback;
 }
 
+void Protocol::CountIncomingAudio(const AudioStreamPacket& packet, size_t bytes_copied) {
+    incoming_audio_ms_ += packet.frame_duration;
+    incoming_audio_bytes_copied_ += bytes_copied;
+    if (incoming_audio_ms_ >= INCOMING_AUDIO_REPORT_MS) {
+        ESP_LOGI(TAG, "Downlink transport copied %llu bytes per second of audio",
+            incoming_audio_bytes_copied_ * 1000 / incoming_audio_ms_);
+        incoming_audio_ms_ = 0;
+        incoming_audio_bytes_copied_ = 0;
+    }
+}
+
+void Protocol::AddMusicModeParams(cJSON* audio_params) {
+#if CONFIG_USE_MUSIC_PLAYBACK_MODE
+    // Only offered when the codec can drive a stereo speaker pair
+    auto codec = Board::GetInstance().GetAudioCodec();
+    if (codec == nullptr || codec->max_output_channels() < MUSIC_MODE_CHANNELS) {
+        return;
+    }
+    cJSON* music = cJSON_CreateObject();
+    cJSON_AddNumberToObject(music, "sample_rate", MUSIC_MODE_SAMPLE_RATE);
+    cJSON_AddNumberToObject(music, "channels", MUSIC_MODE_CHANNELS);
+    cJSON_AddItemToObject(audio_params, "music", music);
+#endif
+}
+
+void Protocol::AddFeatures(cJSON* features) {
+#if CONFIG_USE_SERVER_AEC
+    cJSON_AddBoolToObject(features, "aec", true);
+#endif
+    cJSON_AddBoolToObject(features, "mcp", true);
+#if CONFIG_USE_PHRASE_CACHE
+    // A recording starts at its sentence_start, over MQTT+UDP the audio of other sentences could slip in
+    if (IsAudioOrderedWithJson()) {
+        cJSON_AddBoolToObject(features, "phrase_cache", true);
+    }
+#endif
+}
+
+void Protocol::AddDownlinkBufferParams(cJSON* audio_params) {
+#if CONFIG_USE_DOWNLINK_FLOW_CONTROL
+    auto& buffer = Application::GetInstance().GetAudioService().GetDownlinkBuffer();
+    if (buffer.capacity_ms() == 0) {
+        return;
+    }
+    cJSON* downlink = cJSON_CreateObject();
+    cJSON_AddNumberToObject(downlink, "capacity_ms", buffer.capacity_ms());
+    cJSON_AddNumberToObject(downlink, "high_watermark_ms", buffer.high_watermark_ms());
+    cJSON_AddNumberToObject(downlink, "low_watermark_ms", buffer.low_watermark_ms());
+    cJSON_AddItemToObject(audio_params, "downlink_buffer", downlink);
+#endif
+}
+
+void Protocol::ParseServerAudioParams(const cJSON* audio_params) {
+    auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
+    if (cJSON_IsNumber(sample_rate)) {
+        server_sample_rate_ = sample_rate->valueint;
+    }
+    auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
+    if (cJSON_IsNumber(frame_duration)) {
+        server_frame_duration_ = frame_duration->valueint;
+    }
+    auto flow_control = cJSON_GetObjectItem(audio_params, "flow_control");
+    server_flow_control_ = cJSON_IsTrue(flow_control);
+    auto channels = cJSON_GetObjectItem(audio_params, "channels");
+    server_channels_ = 1;
+    if (cJSON_IsNumber(channels) && channels->valueint == 2) {
+        server_channels_ = 2;
+        ESP_LOGI(TAG, "Music mode: %d Hz stereo downlink", server_sample_rate_);
+    }
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
@@ -65,6 +139,26 @@ void Protocol::SendStopListening() {
     SendText(message);
 }
 
+void Protocol::SendAudioGap(uint32_t duration_ms) {
+    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"audio_gap\",\"duration_ms\":" +
+        std::to_string(duration_ms) + "}";
+    SendText(message);
+}
+
+void Protocol::SendDownlinkFlow(bool pause) {
+    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"downlink_flow\",\"state\":\"" +
+        (pause ? "pause" : "resume") + "\"}";
+    SendText(message);
+}
+
+void Protocol::SendPhraseResult(const std::string& key, bool hit, uint32_t hits, uint32_t misses) {
+    // The key was checked by PhraseCache::IsValidKey, it needs no escaping
+    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"phrase\",\"key\":\"" + key +
+        "\",\"hit\":" + (hit ? "true" : "false") + ",\"hits\":" + std::to_string(hits) +
+        ",\"misses\":" + std::to_string(misses) + "}";
+    SendText(message);
+}
+
 void Protocol::SendMcpMessage(const std::string& payload) {
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":" + payload + "}";
     SendText(message);
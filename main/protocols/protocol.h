@@ -4,16 +4,22 @@
 #include <cJSON.h>
 #include <string>
 #include <functional>
+#include <memory>
 #include <chrono>
 #include <vector>
 
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
+    int channels = 1;
     uint32_t timestamp = 0;
     std::vector<uint8_t> payload;
 };
 
+#define INCOMING_AUDIO_REPORT_MS 10000
+#define MUSIC_MODE_SAMPLE_RATE 48000
+#define MUSIC_MODE_CHANNELS 2
+
 struct BinaryProtocol2 {
     uint16_t version;
     uint16_t type;          // Message type (0: OPUS, 1: JSON)
@@ -51,6 +57,13 @@ public:
     inline int server_frame_duration() const {
         return server_frame_duration_;
     }
+    inline int server_channels() const {
+        return server_channels_;
+    }
+    // The server paces the downlink by the flow messages
+    inline bool server_flow_control() const {
+        return server_flow_control_;
+    }
     inline const std::string& session_id() const {
         return session_id_;
     }
@@ -65,12 +78,18 @@ public:
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    // The audio arrives in order with the JSON messages, needed to tell which sentence a packet belongs to
+    virtual bool IsAudioOrderedWithJson() const { return false; }
+    // Does not keep the packet, so a caller can still hold on to it if sending failed
+    virtual bool SendAudio(const AudioStreamPacket& packet) = 0;
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
+    virtual void SendAudioGap(uint32_t duration_ms);
     virtual void SendAbortSpeaking(AbortReason reason);
     virtual void SendMcpMessage(const std::string& message);
+    virtual void SendDownlinkFlow(bool pause);
+    virtual void SendPhraseResult(const std::string& key, bool hit, uint32_t hits, uint32_t misses);
 
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
@@ -81,13 +100,23 @@ protected:
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
+    int server_channels_ = 1;
+    bool server_flow_control_ = false;
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    // Downlink copy accounting, reported every INCOMING_AUDIO_REPORT_MS of received audio
+    uint32_t incoming_audio_ms_ = 0;
+    uint64_t incoming_audio_bytes_copied_ = 0;
 
     virtual bool SendText(const std::string& text) = 0;
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    void CountIncomingAudio(const AudioStreamPacket& packet, size_t bytes_copied);
+    void AddMusicModeParams(cJSON* audio_params);
+    void AddDownlinkBufferParams(cJSON* audio_params);
+    void AddFeatures(cJSON* features);
+    void ParseServerAudioParams(const cJSON* audio_params);
 };
 
 #endif // PROTOCOL_H
@@ -0,0 +1,126 @@
+#include "uplink_spool.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "UplinkSpool"
+
+UplinkSpool::UplinkSpool() {
+}
+
+UplinkSpool::~UplinkSpool() {
+    if (slots_ != nullptr) {
+        heap_caps_free(slots_);
+    }
+}
+
+void UplinkSpool::Push(std::unique_ptr<AudioStreamPacket> packet) {
+    if (slots_ == nullptr) {
+        // Allocated on the first failed send, most sessions never need it
+        capacity_ = UPLINK_SPOOL_SLOTS;
+        slots_ = (Slot*)heap_caps_calloc(capacity_, sizeof(Slot), MALLOC_CAP_SPIRAM);
+        if (slots_ == nullptr) {
+            capacity_ = UPLINK_SPOOL_FALLBACK_SLOTS;
+            slots_ = (Slot*)heap_caps_calloc(capacity_, sizeof(Slot), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        }
+        if (slots_ == nullptr) {
+            capacity_ = 0;
+            ESP_LOGE(TAG, "Failed to allocate the spool");
+            return;
+        }
+        ESP_LOGI(TAG, "Spool of %u slots allocated", capacity_);
+    }
+
+    if (packet->payload.size() > UPLINK_SPOOL_SLOT_SIZE) {
+        ESP_LOGW(TAG, "Packet of %u bytes does not fit a slot", packet->payload.size());
+        pending_gap_ms_ += packet->frame_duration;
+        dropped_ms_ += packet->frame_duration;
+        return;
+    }
+
+    if (count_ == capacity_) {
+        // Drop the oldest packet, the one after it reports the gap
+        Slot& oldest = slots_[head_];
+        uint32_t lost_ms = oldest.gap_ms + oldest.frame_duration;
+        dropped_ms_ += oldest.frame_duration;
+        depth_ms_ -= oldest.frame_duration;
+        head_ = (head_ + 1) % capacity_;
+        count_--;
+        if (count_ > 0) {
+            slots_[head_].gap_ms += lost_ms;
+        } else {
+            pending_gap_ms_ += lost_ms;
+        }
+    }
+
+    Slot& slot = slots_[(head_ + count_) % capacity_];
+    slot.timestamp = packet->timestamp;
+    slot.gap_ms = pending_gap_ms_;
+    slot.sample_rate = packet->sample_rate;
+    slot.frame_duration = packet->frame_duration;
+    slot.size = packet->payload.size();
+    memcpy(slot.payload, packet->payload.data(), slot.size);
+    pending_gap_ms_ = 0;
+    count_++;
+    depth_ms_ += slot.frame_duration;
+    max_depth_ms_ = std::max(max_depth_ms_, depth_ms_);
+}
+
+int UplinkSpool::Flush(Protocol& protocol, bool force) {
+    int64_t now = esp_timer_get_time();
+    uint64_t earned_ms = (now - last_flush_time_) / 1000 * UPLINK_SPOOL_BURST_RATE;
+    tokens_ms_ = std::min<uint64_t>(UPLINK_SPOOL_BURST_MAX_MS, tokens_ms_ + earned_ms);
+    last_flush_time_ = now;
+
+    while (count_ > 0) {
+        Slot& slot = slots_[head_];
+        if (!force && tokens_ms_ < slot.frame_duration) {
+            return (slot.frame_duration - tokens_ms_ + UPLINK_SPOOL_BURST_RATE - 1) / UPLINK_SPOOL_BURST_RATE;
+        }
+
+        if (slot.gap_ms > 0) {
+            protocol.SendAudioGap(slot.gap_ms);
+            gaps_++;
+            slot.gap_ms = 0;
+        }
+
+        // The slot is only released once the packet made it out
+        resend_.sample_rate = slot.sample_rate;
+        resend_.frame_duration = slot.frame_duration;
+        resend_.timestamp = slot.timestamp;
+        resend_.payload.assign(slot.payload, slot.payload + slot.size);
+        if (!protocol.SendAudio(resend_)) {
+            if (!holding_) {
+                holding_ = true;
+                ESP_LOGW(TAG, "Failed to send audio, spooling");
+            }
+            return UPLINK_SPOOL_RETRY_MS;
+        }
+
+        tokens_ms_ -= std::min<uint32_t>(tokens_ms_, slot.frame_duration);
+        depth_ms_ -= slot.frame_duration;
+        head_ = (head_ + 1) % capacity_;
+        count_--;
+    }
+
+    if (holding_) {
+        holding_ = false;
+        ESP_LOGI(TAG, "Spool drained, max depth %lu ms, dropped %lu ms in %lu gaps", max_depth_ms_, dropped_ms_, gaps_);
+    }
+    return 0;
+}
+
+void UplinkSpool::Clear() {
+    if (count_ > 0) {
+        ESP_LOGW(TAG, "Discarding %u spooled packets (%lu ms)", count_, depth_ms_);
+        dropped_ms_ += depth_ms_;
+    }
+    head_ = 0;
+    count_ = 0;
+    depth_ms_ = 0;
+    pending_gap_ms_ = 0;
+    holding_ = false;
+}
@@ -0,0 +1,77 @@
+#ifndef UPLINK_SPOOL_H
+#define UPLINK_SPOOL_H
+
+#include "protocol.h"
+
+#include <memory>
+#include <cstdint>
+
+/*
+ * Holds encoded uplink packets while they cannot be sent, so a short outage
+ * does not cost the user an utterance.
+ *
+ * While the channel works packets are sent straight through and never touch the
+ * spool. A packet that fails to send, and every packet after it until the spool
+ * is empty again, queues up in fixed size slots in PSRAM and is sent again at up
+ * to UPLINK_SPOOL_BURST_RATE times real time once the channel recovers. When the spool is full the oldest packet is dropped, and
+ * the lost duration is announced to the server with an audio_gap message just
+ * before the packet that follows it.
+ *
+ * If the channel closes while packets are still spooled, the application keeps
+ * them for UPLINK_SPOOL_RECONNECT_MS. Listening again within that time sends them
+ * first, after the new listen message. A wake word or the timeout discards them.
+ */
+
+#define UPLINK_SPOOL_SLOTS              500     // 30 seconds of 60 ms frames
+#define UPLINK_SPOOL_FALLBACK_SLOTS     16      // in internal RAM if there is no PSRAM
+#define UPLINK_SPOOL_SLOT_SIZE          512
+#define UPLINK_SPOOL_BURST_RATE         3       // times real time while draining
+#define UPLINK_SPOOL_BURST_MAX_MS       600     // audio that may be sent back to back
+#define UPLINK_SPOOL_RETRY_MS           200
+#define UPLINK_SPOOL_RECONNECT_MS       15000   // an utterance cut off by a dropped channel is kept this long
+
+class UplinkSpool {
+public:
+    UplinkSpool();
+    ~UplinkSpool();
+
+    // Queues a packet that could not be sent, or that must wait behind the spooled ones
+    void Push(std::unique_ptr<AudioStreamPacket> packet);
+    // Sends as much as the rate limit allows, without a limit if force is set.
+    // Returns the time in ms after which it should be called again, 0 if the spool is empty
+    int Flush(Protocol& protocol, bool force = false);
+    void Clear();
+
+    inline bool empty() const { return count_ == 0; }
+    inline size_t depth() const { return count_; }
+    inline uint32_t depth_ms() const { return depth_ms_; }
+    inline uint32_t max_depth_ms() const { return max_depth_ms_; }
+    inline uint32_t dropped_ms() const { return dropped_ms_; }
+    inline uint32_t gaps() const { return gaps_; }
+
+private:
+    struct Slot {
+        uint32_t timestamp;
+        uint32_t gap_ms;            // Audio lost right before this packet
+        uint16_t sample_rate;
+        uint16_t frame_duration;
+        uint16_t size;
+        uint8_t payload[UPLINK_SPOOL_SLOT_SIZE];
+    };
+
+    Slot* slots_ = nullptr;
+    AudioStreamPacket resend_;      // Reused for every spooled packet sent
+    size_t capacity_ = 0;
+    size_t head_ = 0;
+    size_t count_ = 0;
+    uint32_t depth_ms_ = 0;
+    uint32_t max_depth_ms_ = 0;
+    uint32_t pending_gap_ms_ = 0;   // Lost before any slot could carry it
+    uint32_t dropped_ms_ = 0;
+    uint32_t gaps_ = 0;
+    uint32_t tokens_ms_ = UPLINK_SPOOL_BURST_MAX_MS;
+    int64_t last_flush_time_ = 0;
+    bool holding_ = false;
+};
+
+#endif // UPLINK_SPOOL_H
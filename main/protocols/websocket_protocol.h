@@ -16,10 +16,12 @@ public:
     ~WebsocketProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudio(const AudioStreamPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    // Audio and JSON share the one connection
+    bool IsAudioOrderedWithJson() const override { return true; }
 
 private:
     EventGroupHandle_t event_group_handle_;
@@ -1,4 +1,6 @@
 #include "system_info.h"
+#include "board.h"
+#include "audio_codec.h"
 
 #include <freertos/task.h>
 #include <esp_log.h>
@@ -132,6 +134,19 @@ exit:    //Common return path
     return ret;
 }
 
+bool SystemInfo::GetIdleRunTime(uint32_t& idle_run_time, uint32_t& total_run_time) {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    idle_run_time = 0;
+    for (int core = 0; core < CONFIG_FREERTOS_NUMBER_OF_CORES; core++) {
+        idle_run_time += ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+    }
+    total_run_time = portGET_RUN_TIME_COUNTER_VALUE() * CONFIG_FREERTOS_NUMBER_OF_CORES;
+    return true;
+#else
+    return false;
+#endif
+}
+
 void SystemInfo::PrintTaskList() {
     char buffer[1000];
     vTaskList(buffer);
@@ -143,3 +158,12 @@ void SystemInfo::PrintHeapStats() {
     int min_free_sram = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
     ESP_LOGI(TAG, "free sram: %u minimal sram: %u", free_sram, min_free_sram);
 }
+
+bool SystemInfo::GetI2sHealth(I2sHealth& health) {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    if (codec == nullptr) {
+        return false;
+    }
+    health = codec->GetI2sHealth();
+    return true;
+}
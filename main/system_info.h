@@ -6,6 +6,8 @@
 #include <esp_err.h>
 #include <freertos/FreeRTOS.h>
 
+struct I2sHealth;
+
 class SystemInfo {
 public:
     static size_t GetFlashSize();
@@ -14,8 +16,12 @@ public:
     static std::string GetMacAddress();
     static std::string GetChipModelName();
     static esp_err_t PrintTaskCpuUsage(TickType_t xTicksToWait);
+    // Run time counters of the idle tasks and of all cores, in run time stats clock periods
+    static bool GetIdleRunTime(uint32_t& idle_run_time, uint32_t& total_run_time);
     static void PrintTaskList();
     static void PrintHeapStats();
+    // Overruns and underruns of the audio codec I2S channels in the current session, false without a codec
+    static bool GetI2sHealth(I2sHealth& health);
 };
 
 #endif // _SYSTEM_INFO_H_
@@ -1,54 +1,209 @@
 import socket
+import struct
 import wave
 import argparse
 
 
 '''
   Create a UDP socket and bind it to the server's IP:8000.
-  Listen for incoming messages and print them to the console.
-  Save the audio to a WAV file.
+  Receive the tapped audio streams sent by AudioDebugger (main/audio/processors/audio_debugger.h).
+  Save every tap to its own WAV file, and all taps sharing a sample rate to one multi-track WAV.
+  All files are aligned to the first received datagram, lost datagrams are filled with silence.
 '''
-def main(samplerate, channels):
+
+MAGIC = 0xAD
+VERSION = 1
+HEADER = struct.Struct('!BBBBIIIHH')
+
+ENCODING_PCM16 = 0
+ENCODING_IMA_ADPCM = 1
+
+TAP_NAMES = ['raw_input', 'resampled_input', 'processed_input', 'decoded_output', 'speaker_output']
+
+IMA_STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+]
+IMA_INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8]
+
+
+def decode_ima_adpcm(payload, offset, samples):
+    predictor, index = struct.unpack_from('!hB', payload, offset)
+    offset += 4
+    output = []
+    for i in range(samples):
+        byte = payload[offset + i // 2]
+        nibble = (byte >> 4) if (i & 1) else (byte & 0x0F)
+        step = IMA_STEP_TABLE[index]
+        vpdiff = step >> 3
+        if nibble & 4:
+            vpdiff += step
+        if nibble & 2:
+            vpdiff += step >> 1
+        if nibble & 1:
+            vpdiff += step >> 2
+        predictor += -vpdiff if (nibble & 8) else vpdiff
+        predictor = max(-32768, min(32767, predictor))
+        index = max(0, min(88, index + IMA_INDEX_TABLE[nibble & 7]))
+        output.append(predictor)
+    return output, offset + (samples + 1) // 2
+
+
+def decode_payload(encoding, payload, channels, samples):
+    if encoding == ENCODING_PCM16:
+        return list(struct.unpack_from(f'<{samples * channels}h', payload))
+
+    blocks = []
+    offset = 0
+    for _ in range(channels):
+        block, offset = decode_ima_adpcm(payload, offset, samples)
+        blocks.append(block)
+    # Interleave the channel blocks
+    return [blocks[ch][i] for i in range(samples) for ch in range(channels)]
+
+
+class Track:
+    def __init__(self, tap, sample_rate, channels, start_time):
+        self.tap = tap
+        self.sample_rate = sample_rate
+        self.channels = channels
+        self.start_time = start_time
+        self.samples = []
+        self.next_sequence = None
+        self.next_time = None
+        self.lost = 0
+
+    def append(self, sequence, timestamp, data):
+        frames = len(data) // self.channels
+        if self.next_sequence is not None and sequence != self.next_sequence:
+            lost = (sequence - self.next_sequence) & 0xFFFFFFFF
+            self.lost += lost
+            # Fill the gap using the timestamp, the lost datagrams did not tell us their length
+            gap = int((timestamp - self.next_time) * self.sample_rate / 1000000)
+            if gap > 0:
+                self.samples.extend([0] * (gap * self.channels))
+            print(f"Tap {self.name()} lost {lost} packets, filled {max(gap, 0)} frames")
+        elif self.next_sequence is None and self.next_time is not None:
+            # Resumed after another format, keep the track aligned without counting a loss
+            gap = int((timestamp - self.next_time) * self.sample_rate / 1000000)
+            if gap > 0:
+                self.samples.extend([0] * (gap * self.channels))
+        self.samples.extend(data)
+        self.next_sequence = (sequence + 1) & 0xFFFFFFFF
+        self.next_time = timestamp + frames * 1000000 // self.sample_rate
+
+    def resync(self):
+        # The tap was sending another format in between, its sequence numbers went to that track
+        self.next_sequence = None
+
+    def name(self):
+        return TAP_NAMES[self.tap] if self.tap < len(TAP_NAMES) else f'tap{self.tap}'
+
+    def aligned_samples(self, origin):
+        # Pad the head so that every track starts at the time of the first datagram
+        offset = int((self.start_time - origin) * self.sample_rate / 1000000)
+        return [0] * (max(offset, 0) * self.channels) + self.samples
+
+
+def write_wav(filename, sample_rate, channels, samples):
+    with wave.open(filename, 'wb') as wav_file:
+        wav_file.setnchannels(channels)
+        wav_file.setsampwidth(2)            # 2 bytes per sample (16-bit)
+        wav_file.setframerate(sample_rate)
+        wav_file.writeframes(struct.pack(f'<{len(samples)}h', *samples))
+
+
+def save_tracks(tracks, prefix):
+    if not tracks:
+        print("No audio received")
+        return
+    origin = min(track.start_time for track in tracks.values())
+
+    groups = {}
+    for track in tracks.values():
+        filename = f"{prefix}{track.name()}_{track.sample_rate}_{track.channels}.wav"
+        samples = track.aligned_samples(origin)
+        write_wav(filename, track.sample_rate, track.channels, samples)
+        print(f"WAV file '{filename}' saved successfully, lost {track.lost} packets")
+        groups.setdefault(track.sample_rate, []).append((track, samples))
+
+    for sample_rate, members in groups.items():
+        if len(members) < 2:
+            continue
+        channels = sum(track.channels for track, _ in members)
+        frames = max(len(samples) // track.channels for track, samples in members)
+        mixed = [0] * (frames * channels)
+        base = 0
+        for track, samples in members:
+            for i in range(len(samples) // track.channels):
+                for ch in range(track.channels):
+                    mixed[i * channels + base + ch] = samples[i * track.channels + ch]
+            base += track.channels
+        filename = f"{prefix}multitrack_{sample_rate}.wav"
+        write_wav(filename, sample_rate, channels, mixed)
+        names = ', '.join(track.name() for track, _ in members)
+        print(f"WAV file '{filename}' saved successfully, tracks: {names}")
+
+
+def main(port, prefix):
     # Create a UDP socket
     server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-    server_socket.bind(('0.0.0.0', 8000))
-
-    # Create WAV file with parameters
-    filename = f"{samplerate}_{channels}.wav"
-    wav_file = wave.open(filename, "wb")
-    wav_file.setnchannels(channels)     # channels parameter
-    wav_file.setsampwidth(2)            # 2 bytes per sample (16-bit)
-    wav_file.setframerate(samplerate)   # samplerate parameter
+    server_socket.bind(('0.0.0.0', port))
 
-    print(f"Start saving audio from 0.0.0.0:8000 to {filename}...")
+    print(f"Start receiving audio taps from 0.0.0.0:{port}...")
 
+    tracks = {}
+    tap_formats = {}
+    last_timestamp = None
+    timestamp_base = 0
     try:
         while True:
             # Receive a message from the client
-            message, address = server_socket.recvfrom(8000)
-            
-            # Write PCM data to WAV file
-            wav_file.writeframes(message)
-
-            # Print length of the message
-            print(f"Received {len(message)} bytes from {address}")
-    
+            message, address = server_socket.recvfrom(2048)
+            if len(message) < HEADER.size:
+                continue
+            magic, version, tap, encoding, sequence, timestamp, sample_rate, channels, samples = \
+                HEADER.unpack_from(message)
+            if magic != MAGIC or version != VERSION:
+                print(f"Drop unknown packet from {address}, did you update the firmware?")
+                continue
+
+            # The device sends the low 32 bits of its microsecond clock
+            if last_timestamp is not None and timestamp < last_timestamp and last_timestamp - timestamp > 0x80000000:
+                timestamp_base += 1 << 32
+            last_timestamp = timestamp
+            timestamp += timestamp_base
+
+            data = decode_payload(encoding, message[HEADER.size:], channels, samples)
+            key = (tap, sample_rate, channels)
+            if key not in tracks:
+                tracks[key] = Track(tap, sample_rate, channels, timestamp)
+                print(f"New tap {tracks[key].name()}: {sample_rate} Hz, {channels} channels")
+            elif tap_formats.get(tap) != key:
+                tracks[key].resync()
+            tap_formats[tap] = key
+            tracks[key].append(sequence, timestamp, data)
+
     except KeyboardInterrupt:
         print("\nStopping recording...")
-    
+
     finally:
-        # Close files and socket
-        wav_file.close()
+        # Close socket and save files
         server_socket.close()
-        print(f"WAV file '{filename}' saved successfully")
+        save_tracks(tracks, prefix)
 
 
 if __name__ == "__main__":
-    parser = argparse.ArgumentParser(description='UDP音频数据接收器，保存为WAV文件')
-    parser.add_argument('--samplerate', '-s', type=int, default=16000, 
-                        help='采样率 (默认: 16000)')
-    parser.add_argument('--channels', '-c', type=int, default=2, 
-                        help='声道数 (默认: 2)')
-    
+    parser = argparse.ArgumentParser(description='UDP音频调试数据接收器，按采集点保存为对齐的WAV文件')
+    parser.add_argument('--port', '-p', type=int, default=8000,
+                        help='UDP端口 (默认: 8000)')
+    parser.add_argument('--prefix', type=str, default='',
+                        help='输出文件名前缀')
+
     args = parser.parse_args()
-    main(args.samplerate, args.channels)
+    main(args.port, args.prefix)
@@ -0,0 +1,187 @@
+#include "host_test.h"
+#include "biquad_eq.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycles"
+static inline uint64_t Now() { return __rdtsc(); }
+#else
+#define BENCH_UNIT "ns"
+static inline uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+static const int kSampleRate = 24000;
+static const int kFrameSamples = kSampleRate * 60 / 1000;
+static const int kFrames = 2000;
+
+static std::vector<int16_t> Noise(size_t samples) {
+    std::vector<int16_t> pcm(samples);
+    uint32_t seed = 12345;
+    for (auto& sample : pcm) {
+        seed = seed * 1664525 + 1013904223;
+        sample = (int16_t)((int32_t)(seed >> 16) - 32768) / 4;
+    }
+    return pcm;
+}
+
+// The same Q28 direct form I arithmetic with one band run over the whole frame at a time, to
+// compare against the sample-at-a-time order of BiquadEq
+struct BandMajorCascade {
+    struct Band {
+        int32_t b0, b1, b2, a1, a2;
+        int32_t x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+    };
+    std::vector<Band> bands;
+    std::vector<int32_t> work;
+
+    void AddPeak(double frequency, double gain_db, double q) {
+        double a = pow(10.0, gain_db / 40.0);
+        double w0 = 2 * M_PI * frequency / kSampleRate;
+        double alpha = sin(w0) / (2 * q);
+        double a0 = 1 + alpha / a;
+        const double scale = 1 << BIQUAD_EQ_COEF_SHIFT;
+        Band band;
+        band.b0 = lround((1 + alpha * a) / a0 * scale);
+        band.b1 = lround(-2 * cos(w0) / a0 * scale);
+        band.b2 = lround((1 - alpha * a) / a0 * scale);
+        band.a1 = band.b1;
+        band.a2 = lround((1 - alpha / a) / a0 * scale);
+        bands.push_back(band);
+    }
+
+    void Process(std::vector<int16_t>& pcm) {
+        const int64_t round = 1LL << (BIQUAD_EQ_COEF_SHIFT - 1);
+        work.assign(pcm.begin(), pcm.end());
+        for (auto& band : bands) {
+            const int32_t b0 = band.b0, b1 = band.b1, b2 = band.b2, a1 = band.a1, a2 = band.a2;
+            int32_t x1 = band.x1, x2 = band.x2, y1 = band.y1, y2 = band.y2;
+            for (auto& sample : work) {
+                int32_t x = sample;
+                int64_t acc = round + (int64_t)b0 * x + (int64_t)b1 * x1 + (int64_t)b2 * x2
+                    - (int64_t)a1 * y1 - (int64_t)a2 * y2;
+                int32_t y = (int32_t)std::clamp<int64_t>(acc >> BIQUAD_EQ_COEF_SHIFT, INT32_MIN / 2, INT32_MAX / 2);
+                x2 = x1;
+                x1 = x;
+                y2 = y1;
+                y1 = y;
+                sample = y;
+            }
+            band.x1 = x1;
+            band.x2 = x2;
+            band.y1 = y1;
+            band.y2 = y2;
+        }
+        for (size_t i = 0; i < pcm.size(); i++) {
+            pcm[i] = (int16_t)std::clamp<int32_t>(work[i], INT16_MIN, INT16_MAX);
+        }
+    }
+};
+
+template <typename Processor>
+static double Measure(Processor& processor, const std::vector<int16_t>& input) {
+    std::vector<int16_t> frame;
+    uint64_t best = UINT64_MAX;
+    // The fastest of a few runs, the others include scheduler noise
+    for (int run = 0; run < 5; run++) {
+        uint64_t start = Now();
+        for (int i = 0; i < kFrames; i++) {
+            frame.assign(input.begin(), input.end());
+            processor.Process(frame);
+        }
+        best = std::min(best, Now() - start);
+    }
+    return (double)best / ((double)kFrames * kFrameSamples);
+}
+
+static double GainDb(const char* description, double frequency) {
+    BiquadEq eq;
+    CHECK(eq.Configure(description, kSampleRate));
+    std::vector<int16_t> pcm(kSampleRate);
+    for (size_t i = 0; i < pcm.size(); i++) {
+        pcm[i] = (int16_t)(8000 * sin(2 * M_PI * frequency * i / kSampleRate));
+    }
+    double in = 0, out = 0;
+    std::vector<int16_t> original = pcm;
+    eq.Process(pcm);
+    // Skip the first 100 ms while the filters settle
+    for (size_t i = kSampleRate / 10; i < pcm.size(); i++) {
+        in += (double)original[i] * original[i];
+        out += (double)pcm[i] * pcm[i];
+    }
+    return 10 * log10(out / in);
+}
+
+static void CheckResponse() {
+    double hp_low = GainDb("hp,180,0,0.707", 50);
+    double hp_pass = GainDb("hp,180,0,0.707", 1000);
+    CHECK_MSG(hp_low < -15, "hp at 50 Hz: %.1f dB", hp_low);
+    CHECK_MSG(fabs(hp_pass) < 0.5, "hp at 1 kHz: %.1f dB", hp_pass);
+    double peak = GainDb("peak,3000,4,1.2", 3000);
+    CHECK_MSG(fabs(peak - 4) < 0.3, "peak at 3 kHz: %.1f dB", peak);
+    BiquadEq eq;
+    CHECK(!eq.Configure("peak,30000,4,1.2", kSampleRate));
+    CHECK(eq.Configure("", kSampleRate) && !eq.enabled());
+}
+
+// The bench runs peaks that both cascades design the same way, so their outputs must match exactly
+static std::string PeakDescription(int bands) {
+    std::string description;
+    for (int i = 0; i < bands; i++) {
+        char band[32];
+        snprintf(band, sizeof(band), "%speak,%d,3,1.0", i > 0 ? ";" : "", 1000 + 500 * i);
+        description += band;
+    }
+    return description;
+}
+
+static void CheckOrder(const std::vector<int16_t>& input) {
+    for (int bands = 1; bands <= BIQUAD_EQ_MAX_BANDS; bands++) {
+        BiquadEq eq;
+        CHECK(eq.Configure(PeakDescription(bands), kSampleRate));
+        BandMajorCascade cascade;
+        for (int i = 0; i < bands; i++) {
+            cascade.AddPeak(1000 + 500 * i, 3, 1.0);
+        }
+        // A few frames, so the state carried between them is compared too
+        for (int frame = 0; frame < 3; frame++) {
+            std::vector<int16_t> expected = input, actual = input;
+            cascade.Process(expected);
+            eq.Process(actual);
+            CHECK_MSG(expected == actual, "%d bands differ from the band-at-a-time order in frame %d", bands, frame);
+        }
+    }
+}
+
+int main() {
+    CheckResponse();
+
+    std::vector<int16_t> input = Noise(kFrameSamples);
+    CheckOrder(input);
+    printf("BiquadEq, %d Hz, %d sample frames, host %s per sample\n", kSampleRate, kFrameSamples, BENCH_UNIT);
+    for (int bands = 1; bands <= BIQUAD_EQ_MAX_BANDS; bands++) {
+        BiquadEq eq;
+        CHECK(eq.Configure(PeakDescription(bands), kSampleRate));
+        double sample_major = Measure(eq, input);
+
+        BandMajorCascade cascade;
+        for (int i = 0; i < bands; i++) {
+            cascade.AddPeak(1000 + 500 * i, 3, 1.0);
+        }
+        double band_major = Measure(cascade, input);
+        printf("  %d band%s: %6.2f sample at a time, %6.2f band at a time\n",
+            bands, bands == 1 ? " " : "s", sample_major, band_major);
+    }
+    return 0;
+}
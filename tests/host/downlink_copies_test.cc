@@ -0,0 +1,79 @@
+#include "host_test.h"
+#include "downlink_buffer.h"
+
+#include <esp_timer.h>
+#include <cstring>
+#include <string>
+
+// The MQTT+UDP datagram header in front of the encrypted payload
+static const size_t kUdpHeaderSize = 16;
+// The size of a DownlinkBuffer record header
+static const size_t kRingHeaderSize = 12;
+
+struct CopyCounts {
+    uint64_t transport = 0;
+    uint64_t ring = 0;
+    uint32_t audio_ms = 0;
+};
+
+// Moves packets of one size through the same copies as the receive path of a transport,
+// then through the downlink ring, and returns what each layer copied
+static CopyCounts RunStream(bool mqtt, size_t payload_size, int frame_duration, int packets) {
+    DownlinkBuffer buffer;
+    CHECK(buffer.Initialize(DOWNLINK_BUFFER_INTERNAL_MS));
+    CopyCounts counts;
+    std::string network_buffer(kUdpHeaderSize + payload_size, '\x5a');
+    DownlinkFlowEvent event;
+    for (int i = 0; i < packets; i++) {
+        host_timer_now_us += frame_duration * 1000;
+        auto packet = std::make_unique<AudioStreamPacket>();
+        packet->sample_rate = 24000;
+        packet->frame_duration = frame_duration;
+        packet->timestamp = i;
+        if (mqtt) {
+            // The UDP callback receives the datagram as a std::string, then decrypts into the payload
+            std::string data(network_buffer.data(), network_buffer.size());
+            packet->payload.resize(data.size() - kUdpHeaderSize);
+            memcpy(packet->payload.data(), data.data() + kUdpHeaderSize, packet->payload.size());
+            counts.transport += data.size() + packet->payload.size();
+        } else {
+            // The websocket frame is copied out of the receive buffer of the client
+            packet->payload.assign(network_buffer.begin(), network_buffer.begin() + payload_size);
+            counts.transport += payload_size;
+        }
+        CHECK(buffer.Push(packet, event));
+        CHECK(packet == nullptr);
+        auto popped = buffer.Pop(event);
+        CHECK(popped != nullptr && popped->payload.size() == payload_size && popped->timestamp == (uint32_t)i);
+        counts.audio_ms += frame_duration;
+    }
+    host_timer_now_us += DOWNLINK_BUFFER_REPORT_MS * 1000LL;
+    DownlinkOccupancy report;
+    CHECK(buffer.GetOccupancyReport(report));
+    CHECK_MSG(report.received_ms == counts.audio_ms, "received %u ms", report.received_ms);
+    counts.ring = report.copied_bytes;
+    return counts;
+}
+
+int main() {
+    const size_t sizes[] = {60, 120, 240};
+    printf("Downlink copies per second of audio, 60 ms packets\n");
+    for (bool mqtt : {true, false}) {
+        for (size_t size : sizes) {
+            const int packets = 100;
+            CopyCounts counts = RunStream(mqtt, size, 60, packets);
+            // In through the header and the payload, and back out to a new packet
+            uint64_t expected_ring = 2 * (kRingHeaderSize + size) * packets;
+            CHECK_MSG(counts.ring == expected_ring, "ring copied %llu bytes, expected %llu",
+                (unsigned long long)counts.ring, (unsigned long long)expected_ring);
+            uint64_t payload = size * 1000 / 60;
+            uint64_t transport = counts.transport * 1000 / counts.audio_ms;
+            uint64_t ring = counts.ring * 1000 / counts.audio_ms;
+            printf("  %-9s %3u byte packets: payload %4llu, transport %5llu, ring %5llu, total %5llu B/s (%.1fx)\n",
+                mqtt ? "MQTT+UDP" : "Websocket", (unsigned)size, (unsigned long long)payload,
+                (unsigned long long)transport, (unsigned long long)ring, (unsigned long long)(transport + ring),
+                (double)(transport + ring) / payload);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "host_test.h"
+#include "biquad_eq.h"
+#include "echo_reference.h"
+#include "loudness_limiter.h"
+#include "segment_joiner.h"
+#include "time_stretcher.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+/*
+ * Measures the heap each playback DSP block keeps once it has run for a while, for the
+ * memory budget in main/audio/README.md. Replaces the global allocator to count the live
+ * bytes, so it is built without the sanitizers.
+ */
+
+static size_t live_bytes = 0;
+
+void* operator new(size_t size) {
+    size_t* block = (size_t*)malloc(size + sizeof(size_t) * 2);
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    block[0] = size;
+    live_bytes += size;
+    return block + 2;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    size_t* block = (size_t*)ptr - 2;
+    live_bytes -= block[0];
+    free(block);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+static const int kOutputRate = 24000;
+static const int kInputRate = 16000;
+static const int kFrameSamples = kOutputRate * 60 / 1000;
+
+static std::vector<int16_t> Speech(int frame) {
+    std::vector<int16_t> pcm(kFrameSamples);
+    for (int i = 0; i < kFrameSamples; i++) {
+        double t = (double)(frame * kFrameSamples + i) / kOutputRate;
+        pcm[i] = (int16_t)(12000 * sin(2 * M_PI * (150 + 30 * sin(2 * M_PI * 3 * t)) * t));
+    }
+    return pcm;
+}
+
+// Heap plus the object itself, after 5 s of 60 ms frames
+template <typename Block, typename Run>
+static size_t Measure(const char* name, Run run) {
+    size_t before = live_bytes;
+    size_t total;
+    {
+        Block* block = new Block();
+        run(*block);
+        total = live_bytes - before;
+        delete block;
+    }
+    CHECK_MSG(live_bytes == before, "%s leaked %d bytes", name, (int)(live_bytes - before));
+    printf("  %-16s %6u bytes\n", name, (unsigned)total);
+    return total;
+}
+
+int main() {
+    printf("Playback DSP state at %d Hz output, %d Hz input\n", kOutputRate, kInputRate);
+    size_t sum = 0;
+    sum += Measure<BiquadEq>("BiquadEq", [](BiquadEq& eq) {
+        CHECK(eq.Configure("hp,180,0,0.707;peak,3000,4,1.2;lowshelf,300,-3,0.707;highshelf,6000,2,0.707;"
+            "peak,1000,-2,1.0;lp,10000,0,0.707", kOutputRate));
+        for (int frame = 0; frame < 83; frame++) {
+            auto pcm = Speech(frame);
+            eq.Process(pcm);
+        }
+    });
+    sum += Measure<LoudnessLimiter>("LoudnessLimiter", [](LoudnessLimiter& limiter) {
+        limiter.Configure(kOutputRate);
+        for (int frame = 0; frame < 83; frame++) {
+            auto pcm = Speech(frame);
+            limiter.Process(pcm);
+        }
+    });
+    sum += Measure<TimeStretcher>("TimeStretcher", [](TimeStretcher& stretcher) {
+        stretcher.Configure(kOutputRate);
+        // The slowest speed buffers the most input
+        for (int speed : {TIME_STRETCH_MIN_SPEED, 150, 80}) {
+            stretcher.SetSpeed(speed);
+            for (int frame = 0; frame < 30; frame++) {
+                auto pcm = Speech(frame);
+                std::vector<int16_t> output;
+                stretcher.Process(pcm, output);
+            }
+        }
+    });
+    sum += Measure<SegmentJoiner>("SegmentJoiner", [](SegmentJoiner& joiner) {
+        joiner.Configure(kOutputRate, 1);
+        for (int frame = 0; frame < 83; frame++) {
+            auto pcm = Speech(frame);
+            joiner.Join(pcm);
+        }
+    });
+    printf("  %-16s %6u bytes\n", "total", (unsigned)sum);
+    // Only with CONFIG_USE_SOFTWARE_ECHO_REFERENCE, which needs the audio processor
+    Measure<EchoReference>("EchoReference", [](EchoReference& reference) {
+        reference.Configure(kInputRate, kOutputRate);
+        for (int i = 0; i < ECHO_REFERENCE_CLOCKS * 2; i++) {
+            reference.AddOutputClock({ i * 10000LL, (uint32_t)i * 240, 1440 });
+        }
+    });
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "host_test.h"
+#include "echo_reference.h"
+
+#include <cmath>
+#include <vector>
+
+static const int kOutputRate = 24000;
+static const int kInputRate = 16000;
+static const int kDmaFrames = 240;         // 10 ms per TX DMA interrupt
+static const int kDmaBuffers = 6;
+static const int kInputFrames = 160;       // 10 ms blocks of mic frames
+static const int kAmplitude = 10000;
+
+struct Alignment {
+    double delay_ms;        // Positive if the reference lags the played signal
+    double gain_db;
+    double residual_db;     // What is left after removing the fitted sine, relative to it
+};
+
+// Plays a sine from first_position on, with the TX clock of an ideal DMA, and reads the
+// reference of 10 ms mic blocks captured backlog_ms earlier. Fits a sine to the reference
+// of the last second
+static Alignment Run(double frequency, uint32_t first_position, int backlog_ms, int seconds = 2) {
+    EchoReference reference;
+    reference.Configure(kInputRate, kOutputRate);
+    const int steps = seconds * 100;
+    const int ahead = kDmaBuffers * kDmaFrames;
+    std::vector<int16_t> pcm(kDmaFrames);
+    std::vector<int16_t> block(kInputFrames);
+    std::vector<int16_t> captured;
+    uint32_t written = 0;   // Frames written, relative to first_position
+    auto write = [&]() {
+        for (int i = 0; i < kDmaFrames; i++) {
+            pcm[i] = (int16_t)lround(kAmplitude * sin(2 * M_PI * frequency * (written + i) / kOutputRate));
+        }
+        reference.Write(pcm.data(), pcm.size(), 1, first_position + written);
+        written += kDmaFrames;
+    };
+    while (written < (uint32_t)ahead) {
+        write();
+    }
+    int64_t captured_until_us = 0;
+    for (int step = 0; step < steps; step++) {
+        // Frame step * kDmaFrames starts to play at step * 10 ms
+        int64_t now_us = step * 10000LL;
+        uint32_t played = step * kDmaFrames;
+        reference.AddOutputClock({ now_us, first_position + played, written - played });
+        write();
+
+        // Reads lag the capture by backlog_ms
+        while (captured_until_us + 10000 + backlog_ms * 1000LL <= now_us) {
+            reference.Read(block.data(), block.size(), 1, captured_until_us);
+            captured.insert(captured.end(), block.begin(), block.end());
+            captured_until_us += 10000;
+        }
+    }
+
+    // Project the last second on the sine and cosine of the played signal
+    size_t start = captured.size() - kInputRate;
+    double s = 0, c = 0, energy = 0;
+    for (size_t n = start; n < captured.size(); n++) {
+        double phase = 2 * M_PI * frequency * n / kInputRate;
+        s += captured[n] * sin(phase);
+        c += captured[n] * cos(phase);
+    }
+    double count = captured.size() - start;
+    double amplitude = 2 * sqrt(s * s + c * c) / count;
+    double phase = atan2(c, s);
+    for (size_t n = start; n < captured.size(); n++) {
+        double fitted = amplitude * sin(2 * M_PI * frequency * n / kInputRate + phase);
+        energy += (captured[n] - fitted) * (captured[n] - fitted);
+    }
+    Alignment alignment;
+    alignment.delay_ms = -phase / (2 * M_PI * frequency) * 1000;
+    alignment.gain_db = 20 * log10(amplitude / kAmplitude);
+    alignment.residual_db = 10 * log10(energy / count / (amplitude * amplitude / 2));
+    return alignment;
+}
+
+static void TestAlignment() {
+    // The band limit starts to roll off above 5 kHz, the alignment must hold everywhere
+    const double frequencies[] = {200, 1000, 3000, 5000, 6500};
+    for (double frequency : frequencies) {
+        Alignment a = Run(frequency, 1000, 30);
+        printf("  %4.0f Hz: delay %+.4f ms, gain %+.2f dB, residual %.1f dB\n",
+            frequency, a.delay_ms, a.gain_db, a.residual_db);
+        CHECK_MSG(fabs(a.delay_ms) < 0.01, "%.0f Hz: delay %.4f ms", frequency, a.delay_ms);
+        CHECK_MSG(fabs(a.gain_db) < (frequency < 5000 ? 0.5 : 3.0), "%.0f Hz: gain %.2f dB", frequency, a.gain_db);
+        CHECK_MSG(a.residual_db < -40, "%.0f Hz: residual %.1f dB", frequency, a.residual_db);
+    }
+}
+
+static void TestPositionWrap() {
+    // The output position passes 2^32 half way through, the history must stay continuous
+    uint32_t first = UINT32_MAX - kOutputRate + 1;
+    Alignment wrapped = Run(1000, first, 30, 2);
+    printf("  across the 2^32 wrap: delay %+.4f ms, residual %.1f dB\n", wrapped.delay_ms, wrapped.residual_db);
+    CHECK_MSG(fabs(wrapped.delay_ms) < 0.01, "delay %.4f ms", wrapped.delay_ms);
+    CHECK_MSG(wrapped.residual_db < -40, "residual %.1f dB", wrapped.residual_db);
+}
+
+static void TestSilenceWhenDry() {
+    EchoReference reference;
+    reference.Configure(kInputRate, kOutputRate);
+    std::vector<int16_t> pcm(kDmaFrames, 8000);
+    reference.Write(pcm.data(), pcm.size(), 1, 0);
+    // Only the written frames were queued, 10 ms later the output was sending silence
+    reference.AddOutputClock({ 0, 0, kDmaFrames });
+    std::vector<int16_t> block(kInputFrames, 1);
+    reference.Read(block.data(), block.size(), 1, 15000);
+    for (auto sample : block) {
+        CHECK(sample == 0);
+    }
+    // Before the first clock nothing was playing either
+    reference.Read(block.data(), block.size(), 1, -20000);
+    for (auto sample : block) {
+        CHECK(sample == 0);
+    }
+    // While it played, the stride leaves the mic channel alone
+    std::vector<int16_t> interleaved(kInputFrames * 2, 77);
+    reference.Read(interleaved.data() + 1, kInputFrames / 2, 2, 1000);
+    for (int i = 0; i < kInputFrames / 2; i++) {
+        CHECK(interleaved[i * 2] == 77);
+    }
+    CHECK_MSG(abs(interleaved[kInputFrames / 2 + 1] - 8000) < 100, "%d", interleaved[kInputFrames / 2 + 1]);
+}
+
+int main() {
+    printf("EchoReference, %d Hz output to %d Hz input\n", kOutputRate, kInputRate);
+    TestAlignment();
+    TestPositionWrap();
+    TestSilenceWhenDry();
+    printf("echo_reference_test passed\n");
+    return 0;
+}
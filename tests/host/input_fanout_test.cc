@@ -0,0 +1,166 @@
+#include "host_test.h"
+#include "input_fanout.h"
+
+#include <vector>
+
+// A ramp that tells every sample apart, so a lost, repeated or reordered sample shows
+static std::vector<int16_t> Ramp(int16_t first, size_t samples) {
+    std::vector<int16_t> pcm(samples);
+    for (size_t i = 0; i < samples; i++) {
+        pcm[i] = (int16_t)(first + i);
+    }
+    return pcm;
+}
+
+// Chunks of odd sizes go through a ring that is not a multiple of them, so reads and writes
+// keep stepping over its end
+static void CheckWraparound() {
+    FrameAggregator ring;
+    ring.Configure(5, 9);
+    const size_t chunks[] = { 3, 1, 4, 2, 5, 3 };
+    int16_t written = 0, expected = 0;
+    std::vector<int16_t> frame;
+    for (int round = 0; round < 200; round++) {
+        size_t samples = chunks[round % 6];
+        auto chunk = Ramp(written, samples);
+        CHECK(ring.Write(chunk.data(), samples) == samples);
+        written += samples;
+        while (ring.ReadFrame(frame)) {
+            for (auto sample : frame) {
+                CHECK_MSG(sample == expected, "round %d: read %d, expected %d", round, sample, expected);
+                expected++;
+            }
+        }
+        CHECK(ring.available() == (size_t)(written - expected) && ring.available() < 5);
+    }
+
+    // A write that does not fit is cut short, and silence wraps like samples
+    ring.Reset();
+    auto chunk = Ramp(100, 4);
+    CHECK(ring.Write(chunk.data(), 4) == 4);
+    CHECK(ring.Read(frame.data(), 3) == 3 && frame[0] == 100);
+    CHECK(ring.WriteSilence(8) == 8);
+    CHECK(ring.Write(chunk.data(), 4) == 0);
+    int16_t out[10] = {};
+    CHECK(ring.Read(out, 10) == 9);
+    CHECK(out[0] == 103 && out[1] == 0 && out[8] == 0);
+    CHECK(ring.available() == 0);
+}
+
+// One channel of an interleaved block goes in and out without a copy of its own
+static void CheckStride() {
+    FrameAggregator ring;
+    ring.Configure(4, 6);
+    std::vector<int16_t> stereo;
+    for (int i = 0; i < 5; i++) {
+        stereo.push_back(i);
+        stereo.push_back(1000 + i);
+    }
+    int16_t skip[2];
+    CHECK(ring.Write(stereo.data(), 2) == 2);
+    CHECK(ring.Read(skip, 2) == 2);
+    // The ring now starts 2 samples in, the 5 right channel samples wrap
+    CHECK(ring.Write(stereo.data() + 1, 5, 2) == 5);
+    std::vector<int16_t> out(10, -1);
+    CHECK(ring.Read(out.data() + 1, 5, 2) == 5);
+    for (int i = 0; i < 5; i++) {
+        CHECK_MSG(out[i * 2 + 1] == 1000 + i, "frame %d: %d", i, out[i * 2 + 1]);
+        CHECK(out[i * 2] == -1);
+    }
+}
+
+// Growing the ring unwraps what it holds, nothing is dropped or reordered
+static void CheckReserve() {
+    FrameAggregator ring;
+    ring.Configure(4, 6);
+    auto chunk = Ramp(0, 5);
+    int16_t out[16];
+    CHECK(ring.Write(chunk.data(), 5) == 5);
+    CHECK(ring.Read(out, 4) == 4);
+    chunk = Ramp(5, 4);
+    CHECK(ring.Write(chunk.data(), 4) == 4);
+    ring.Reserve(12);
+    CHECK(ring.capacity() == 12 && ring.available() == 5);
+    chunk = Ramp(9, 7);
+    CHECK(ring.Write(chunk.data(), 7) == 7);
+    CHECK(ring.Read(out, 16) == 12);
+    for (int i = 0; i < 12; i++) {
+        CHECK_MSG(out[i] == 4 + i, "sample %d: %d", i, out[i]);
+    }
+    ring.Reserve(4);
+    CHECK(ring.capacity() == 12);
+}
+
+// A mic, a second mic and the reference, each view holds its own channel
+static void CheckSplit() {
+    InputFanout fanout;
+    std::vector<int16_t> block;
+    for (int i = 0; i < 4; i++) {
+        block.push_back(100 + i);
+        block.push_back(300 + i);
+        block.push_back(-i);
+    }
+    auto& frame = fanout.Split(block, 3, true, 16000);
+    CHECK(frame.frames() == 4 && frame.view(kAudioInputViewInterleaved).size == 12);
+    for (int i = 0; i < 4; i++) {
+        CHECK(frame.mic[i] == 100 + i);
+        CHECK(frame.mono[i] == 200 + i);
+        CHECK(frame.reference[i] == -i);
+    }
+
+    std::vector<int16_t> mono = Ramp(0, 8);
+    auto& mono_frame = fanout.Split(mono, 1, false, 16000);
+    CHECK(mono_frame.mic.data == mono.data() && mono_frame.reference.empty());
+}
+
+// The blocks grow past what the chunker was sized for while it holds samples back. Every
+// sample must still reach the consumer once and in order
+static void CheckDeliverGrowingBlocks() {
+    InputFanout fanout;
+    const size_t feed = 512;
+    const size_t blocks[] = { 160, 160, 960, 512, 1440, 100, 2048, 512 };
+    int16_t captured = 0, expected = 0;
+    size_t calls = 0, passed_through = 0;
+    for (size_t samples : blocks) {
+        std::vector<int16_t> stereo;
+        for (size_t i = 0; i < samples; i++) {
+            stereo.push_back((int16_t)(captured + i));
+            stereo.push_back(0);
+        }
+        captured += samples;
+        auto& frame = fanout.Split(stereo, 2, true, 16000);
+        fanout.Deliver(0, kAudioInputViewMic, feed, [&](const AudioSpan& chunk) {
+            CHECK(chunk.size == feed);
+            if (chunk.data == frame.mic.data) {
+                passed_through++;
+            }
+            for (auto sample : chunk) {
+                CHECK_MSG(sample == expected, "chunk %u: read %d, expected %d", (unsigned)calls, sample, expected);
+                expected++;
+            }
+            calls++;
+        });
+        CHECK(fanout.buffered(0) == (size_t)(captured - expected));
+    }
+    CHECK(calls == (size_t)captured / feed);
+
+    // A block of the feed size with nothing held back is handed over as is
+    fanout.Reset(0);
+    std::vector<int16_t> block = Ramp(0, feed);
+    auto& frame = fanout.Split(block, 1, false, 16000);
+    fanout.Deliver(0, kAudioInputViewMono, feed, [&](const AudioSpan& chunk) {
+        CHECK(chunk.data == frame.mono.data);
+        passed_through++;
+    });
+    CHECK(passed_through >= 1);
+}
+
+int main() {
+    CheckWraparound();
+    CheckStride();
+    CheckReserve();
+    CheckSplit();
+    CheckDeliverGrowingBlocks();
+    printf("FrameAggregator and InputFanout: wraparound, stride, growth and delivery ok\n");
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include "host_test.h"
+#include "latency_probe.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+static const int kSampleRate = 16000;
+static const int kCaptureMs = 400;
+
+// The probe as the mic would hear it, delayed by a fraction of a sample. Evaluates the same
+// chirp as LatencyProbe::Generate at shifted times, which is what an ideal resampler produces
+static float ProbeAt(double t) {
+    const double duration = LATENCY_PROBE_DURATION_MS / 1000.0;
+    const double fade = LATENCY_PROBE_FADE_MS / 1000.0;
+    if (t < 0 || t > duration) {
+        return 0;
+    }
+    const double sweep = (LATENCY_PROBE_END_HZ - LATENCY_PROBE_START_HZ) / (2 * duration);
+    double phase = 2 * M_PI * (LATENCY_PROBE_START_HZ * t + sweep * t * t);
+    double gain = std::min(1.0, std::min(t, duration - t) / fade);
+    return LATENCY_PROBE_AMPLITUDE * gain * sin(phase);
+}
+
+struct Capture {
+    double delay_ms;
+    float gain;             // Negative for a speaker that inverts the polarity
+    double echo_ms;         // A reflection this much later, at a quarter of the level, 0 for none
+    int noise;              // Peak of the uniform noise
+};
+
+static std::vector<int16_t> Render(const Capture& capture, bool with_probe) {
+    std::vector<int16_t> pcm(kSampleRate * kCaptureMs / 1000);
+    uint32_t seed = 1;
+    for (size_t n = 0; n < pcm.size(); n++) {
+        double t = (double)n / kSampleRate;
+        double value = 0;
+        if (with_probe) {
+            value += capture.gain * ProbeAt(t - capture.delay_ms / 1000);
+            if (capture.echo_ms > 0) {
+                value += capture.gain / 4 * ProbeAt(t - (capture.delay_ms + capture.echo_ms) / 1000);
+            }
+        }
+        seed = seed * 1664525 + 1013904223;
+        value += (double)((int32_t)(seed >> 16) - 32768) * capture.noise / 32768;
+        pcm[n] = (int16_t)std::lround(std::clamp(value, -32768.0, 32767.0));
+    }
+    return pcm;
+}
+
+static void TestFindsFractionalDelays() {
+    const Capture captures[] = {
+        {50.0, 1.0f, 0, 0},
+        {73.4, 1.0f, 0, 200},
+        {120.77, -0.5f, 0, 500},
+        {91.03, 0.3f, 5.0, 800},
+        {200.31, -0.2f, 5.0, 1000},
+    };
+    LatencyProbe probe;
+    for (auto& capture : captures) {
+        probe.Configure(kSampleRate, kCaptureMs);
+        auto pcm = Render(capture, true);
+        probe.Capture(pcm.data(), pcm.size());
+        CHECK(probe.full());
+        float lag;
+        CHECK_MSG(probe.Find(0, pcm.size(), lag), "%.2f ms: coherence %.2f", capture.delay_ms, probe.coherence());
+        double error_ms = lag * 1000.0 / kSampleRate - capture.delay_ms;
+        printf("  delay %7.2f ms, gain %5.2f, echo %3.1f ms, noise %4d: error %+.4f ms, coherence %.2f\n",
+            capture.delay_ms, capture.gain, capture.echo_ms, capture.noise, error_ms, probe.coherence());
+        CHECK_MSG(fabs(error_ms) < 0.01, "%.2f ms: error %.4f ms", capture.delay_ms, error_ms);
+    }
+}
+
+static void TestStrideTakesOneChannel() {
+    // The mic channel of an interleaved mic and reference block
+    Capture capture = {64.5, 1.0f, 0, 100};
+    auto mono = Render(capture, true);
+    std::vector<int16_t> interleaved(mono.size() * 2);
+    for (size_t i = 0; i < mono.size(); i++) {
+        interleaved[i * 2] = mono[i];
+        interleaved[i * 2 + 1] = 20000;
+    }
+    LatencyProbe probe;
+    probe.Configure(kSampleRate, kCaptureMs);
+    probe.Capture(interleaved.data(), mono.size(), 2);
+    float lag;
+    CHECK(probe.Find(0, mono.size(), lag));
+    CHECK_MSG(fabs(lag * 1000.0 / kSampleRate - capture.delay_ms) < 0.01, "lag %.3f", lag);
+}
+
+static void TestRejectsNoiseAndLagsOutOfRange() {
+    LatencyProbe probe;
+    probe.Configure(kSampleRate, kCaptureMs);
+    auto noise = Render({0, 1.0f, 0, 3000}, false);
+    probe.Capture(noise.data(), noise.size());
+    float lag;
+    CHECK_MSG(!probe.Find(0, noise.size(), lag), "found %.1f in noise, coherence %.2f", lag, probe.coherence());
+
+    // The probe starts before the lags searched
+    probe.Configure(kSampleRate, kCaptureMs);
+    auto pcm = Render({150, 1.0f, 0, 300}, true);
+    probe.Capture(pcm.data(), pcm.size());
+    CHECK(!probe.Find(0, kSampleRate * 100 / 1000, lag));
+
+    // Less captured than one probe
+    probe.Configure(kSampleRate, kCaptureMs);
+    probe.Capture(pcm.data(), kSampleRate * LATENCY_PROBE_DURATION_MS / 1000 - 1);
+    CHECK(!probe.Find(0, pcm.size(), lag));
+}
+
+int main() {
+    printf("LatencyProbe at %d Hz\n", kSampleRate);
+    TestFindsFractionalDelays();
+    TestStrideTakesOneChannel();
+    TestRejectsNoiseAndLagsOutOfRange();
+    printf("latency_probe_test passed\n");
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include "host_test.h"
+#include "loudness_limiter.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+// Peaks may pass the threshold by what the attack has not caught up yet
+static const int kPeakTolerance = LOUDNESS_LIMITER_THRESHOLD + LOUDNESS_LIMITER_THRESHOLD / 50;
+
+// Runs a signal through the limiter in frames, returns the highest output level
+// after the first settle_ms
+static int RunSignal(int sample_rate, int frame_ms, int duration_ms, int settle_ms,
+                     const std::function<int16_t(int)>& signal) {
+    LoudnessLimiter limiter;
+    limiter.Configure(sample_rate);
+    const int frame_samples = sample_rate * frame_ms / 1000;
+    const int total = sample_rate * duration_ms / 1000;
+    const int settle = sample_rate * settle_ms / 1000;
+    std::vector<int16_t> frame;
+    int peak = 0;
+    for (int start = 0; start < total; start += frame_samples) {
+        frame.resize(frame_samples);
+        for (int i = 0; i < frame_samples; i++) {
+            frame[i] = signal(start + i);
+        }
+        limiter.Process(frame);
+        for (int i = 0; i < frame_samples; i++) {
+            if (start + i >= settle) {
+                peak = std::max(peak, std::abs((int)frame[i]));
+            }
+        }
+    }
+    return peak;
+}
+
+static void TestLowFrequencySines() {
+    const int rates[] = {16000, 24000, 48000};
+    const double frequencies[] = {5.0, 20.0, 50.0};
+    for (int rate : rates) {
+        for (double frequency : frequencies) {
+            // Full scale, so every cycle climbs and falls monotonically for many look-ahead windows
+            int peak = RunSignal(rate, 60, 3000, 500, [=](int n) {
+                return (int16_t)(32767.0 * sin(2.0 * M_PI * frequency * n / rate));
+            });
+            CHECK_MSG(peak <= kPeakTolerance, "%d Hz at %d Hz: peak %d", (int)frequency, rate, peak);
+            CHECK_MSG(peak > LOUDNESS_LIMITER_THRESHOLD / 2, "%d Hz at %d Hz: peak %d", (int)frequency, rate, peak);
+        }
+    }
+}
+
+static void TestMonotonicRamps() {
+    const int rates[] = {16000, 24000, 48000};
+    for (int rate : rates) {
+        const int length = rate * 2;
+        // Rising, falling and held ramps, in frames that do not divide the look-ahead
+        RunSignal(rate, 10, 2000, 0, [=](int n) { return (int16_t)(-32768 + (int64_t)65535 * n / length); });
+        RunSignal(rate, 10, 2000, 0, [=](int n) { return (int16_t)(32767 - (int64_t)65535 * n / length); });
+        RunSignal(rate, 20, 2000, 0, [=](int n) { return (int16_t)((int64_t)32767 * n / length); });
+        RunSignal(rate, 20, 2000, 0, [=](int n) { return (int16_t)(32767 - (int64_t)32767 * n / length); });
+        int peak = RunSignal(rate, 60, 2000, 0, [](int) { return (int16_t)32767; });
+        CHECK_MSG(peak <= kPeakTolerance, "DC at %d Hz: peak %d", rate, peak);
+    }
+}
+
+static void TestQuietSignalIsNotLimited() {
+    // -12 dBFS at 1 kHz stays below the threshold even after the +6 dB normalization
+    int peak = RunSignal(16000, 60, 2000, 500, [](int n) {
+        return (int16_t)(8192.0 * sin(2.0 * M_PI * 1000.0 * n / 16000));
+    });
+    CHECK_MSG(peak < LOUDNESS_LIMITER_THRESHOLD, "peak %d", peak);
+}
+
+int main() {
+    TestLowFrequencySines();
+    TestMonotonicRamps();
+    TestQuietSignalIsNotLimited();
+    printf("loudness_limiter_test passed\n");
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "host_test.h"
+#include "ogg_sound.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+namespace fs = std::filesystem;
+
+static std::string ReadFile(const fs::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    CHECK_MSG(file, "cannot open %s", path.c_str());
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Demuxes one sound and checks that the sound lane can hold it
+static size_t DemuxSound(const fs::path& path) {
+    std::string ogg = ReadFile(path);
+    std::deque<std::unique_ptr<AudioStreamPacket>> packets;
+    CHECK_MSG(ParseOggSound(ogg, packets), "%s", path.c_str());
+    for (auto& packet : packets) {
+        CHECK_MSG(!packet->payload.empty() && packet->sample_rate > 0, "%s", path.c_str());
+        CHECK(packet->frame_duration == OGG_SOUND_FRAME_DURATION_MS);
+    }
+    CHECK_MSG(packets.size() <= MAX_SOUND_PACKETS_IN_QUEUE, "%s: %u packets, the lane holds %u",
+        path.c_str(), (unsigned)packets.size(), (unsigned)MAX_SOUND_PACKETS_IN_QUEUE);
+    return packets.size();
+}
+
+// The activation playlist is the sound, a pause and six digits. The lane demuxes one
+// sound at a time, so each of them must fit, not their sum
+static void TestActivationPlaylist(const fs::path& locale, size_t& longest_playlist, std::string& longest_locale) {
+    size_t activation = DemuxSound(locale / "activation.ogg");
+    size_t longest_digit = 0;
+    for (int digit = 0; digit <= 9; digit++) {
+        size_t packets = DemuxSound(locale / (std::to_string(digit) + ".ogg"));
+        longest_digit = std::max(longest_digit, packets);
+    }
+    CHECK(std::max(activation, longest_digit) <= MAX_SOUND_PACKETS_IN_QUEUE);
+
+    size_t playlist = activation + 6 * longest_digit;
+    if (playlist > longest_playlist) {
+        longest_playlist = playlist;
+        longest_locale = locale.filename().string();
+    }
+}
+
+int main() {
+    size_t locales = 0, sounds = 0;
+    size_t longest_playlist = 0;
+    std::string longest_locale;
+    for (auto& entry : fs::directory_iterator(fs::path(ASSETS_DIR) / "locales")) {
+        if (!entry.is_directory()) {
+            continue;
+        }
+        TestActivationPlaylist(entry.path(), longest_playlist, longest_locale);
+        locales++;
+    }
+    CHECK(locales > 0);
+    // Every other sound goes through the same lane
+    for (auto& entry : fs::recursive_directory_iterator(ASSETS_DIR)) {
+        if (entry.path().extension() == ".ogg") {
+            DemuxSound(entry.path());
+            sounds++;
+        }
+    }
+    printf("ogg_sound_test passed: %u sounds, the longest activation playlist is %u packets (%s), "
+        "the lane holds %u at a time\n", (unsigned)sounds, (unsigned)longest_playlist, longest_locale.c_str(),
+        (unsigned)MAX_SOUND_PACKETS_IN_QUEUE);
+    return 0;
+}
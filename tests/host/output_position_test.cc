@@ -0,0 +1,258 @@
+#include "host_test.h"
+#include "output_position.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+static const int kDescNum = 6;
+static const int kFrameNum = 240;
+
+// The accounting before OutputPosition, for comparison: the frames counted once the write
+// returned, and each sent buffer credited with at most what it was loaded with
+struct LegacyPosition {
+    std::vector<uint32_t> slot_frames = std::vector<uint32_t>(kDescNum, 0);
+    size_t slot = 0;
+    uint32_t written = 0;
+    uint32_t loaded = 0;
+    uint32_t played = 0;
+
+    void OnSent(int loaded_frames) {
+        uint32_t& frames = slot_frames[slot];
+        slot = (slot + 1) % kDescNum;
+        played += frames;
+        uint32_t limit = kFrameNum;
+        if (loaded_frames >= 0 && (uint32_t)loaded_frames < limit) {
+            limit = loaded_frames;
+        }
+        frames = std::min(written - loaded, limit);
+        loaded += frames;
+    }
+};
+
+// The I2S TX DMA ring and a writer task, one DMA period per tick. The blocking writer goes
+// through the driver's queue of sent buffers like i2s_channel_write, the async writer converts
+// into two slots that the on_sent callback copies into the buffer just sent
+class OutputModel {
+public:
+    explicit OutputModel(bool async) : async_(async) {
+        content_.assign(kDescNum, 0);
+        // Start near the wrap of the positions
+        position_.AddWritten(0xfffff000);
+        position_.Configure(kDescNum, kFrameNum);
+        position_.Reset();
+        ideal_played_ = handed_ = position_.played();
+        legacy_.written = legacy_.loaded = legacy_.played = ideal_played_;
+    }
+
+    void AddWrite(int tick, int frames) { writes_.push_back({tick, frames}); }
+
+    // Runs until the writes are played out, checks the position after every DMA period
+    void Run() {
+        for (tick_ = 0; !writes_.empty() || remaining_ > 0 || tick_ < last_write_tick_ + 3 * kDescNum; tick_++) {
+            SendBuffer();
+            int32_t error = (int32_t)(position_.played() - ideal_played_);
+            max_error_ = std::max(max_error_, std::abs(error));
+            legacy_max_error_ = std::max(legacy_max_error_, std::abs((int32_t)(legacy_.played - ideal_played_)));
+            CHECK_MSG((int32_t)position_.queued() >= 0, "tick %d: queued %d", tick_, (int32_t)position_.queued());
+            CHECK_MSG(std::abs(error) <= kFrameNum, "tick %d: played %d frames off", tick_, error);
+            RunWriter();
+        }
+    }
+
+    inline int max_error() const { return max_error_; }
+    inline int legacy_max_error() const { return legacy_max_error_; }
+    inline uint32_t legacy_behind() const { return legacy_.written - legacy_.played; }
+    inline int underruns() const { return underruns_; }
+    inline uint32_t starved() const { return starved_; }
+    inline int real_underruns() const { return real_underruns_; }
+    inline uint32_t real_starved() const { return real_starved_; }
+    inline bool drained() const { return position_.played() == position_.written() && position_.played() == ideal_played_; }
+
+private:
+    struct Write {
+        int tick;
+        int frames;
+    };
+
+    bool async_;
+    OutputPosition position_;
+    LegacyPosition legacy_;
+    std::vector<int> content_;          // Audio frames in each DMA buffer
+    int sending_ = 0;
+    std::deque<int> free_;              // Sent buffers the blocking driver refills, in order
+    int current_ = -1;                  // The buffer it is filling
+    int fill_ = 0;
+    bool chunk_counted_ = false;
+    bool slot_ready_[2] = {};
+    int slot_frames_[2] = {};
+    int slot_write_ = 0;
+    int slot_read_ = 0;
+    std::deque<Write> writes_;
+    int remaining_ = 0;
+    int write_frames_ = 0;
+    int tick_ = 0;
+    int last_write_tick_ = 0;
+    bool stream_open_ = false;
+    uint32_t silent_mark_ = 0;
+    uint32_t ideal_played_ = 0;
+    int max_error_ = 0;
+    int legacy_max_error_ = 0;
+    int underruns_ = 0;
+    uint32_t starved_ = 0;
+    uint32_t handed_ = 0;
+    uint32_t real_silent_ = 0;
+    uint32_t real_silent_mark_ = 0;
+    int real_underruns_ = 0;
+    uint32_t real_starved_ = 0;
+
+    void SendBuffer() {
+        ideal_played_ += content_[sending_];
+        real_silent_ += kFrameNum - content_[sending_];
+        content_[sending_] = 0;
+        int loaded = -1;
+        if (async_) {
+            loaded = 0;
+            if (slot_ready_[slot_read_]) {
+                loaded = content_[sending_] = slot_frames_[slot_read_];
+                slot_ready_[slot_read_] = false;
+                slot_read_ ^= 1;
+            }
+        } else if (sending_ != current_) {
+            // The driver keeps desc_num - 1 sent buffers, the oldest is dropped
+            if (free_.size() == kDescNum - 1) {
+                free_.pop_front();
+            }
+            free_.push_back(sending_);
+        }
+        position_.OnSent(loaded);
+        legacy_.OnSent(loaded);
+        sending_ = (sending_ + 1) % kDescNum;
+    }
+
+    void StartWrite() {
+        auto write = writes_.front();
+        writes_.pop_front();
+        // AudioCodec::OutputData
+        if (stream_open_ && position_.queued() == 0) {
+            underruns_++;
+            starved_ += position_.silent() - silent_mark_;
+        }
+        silent_mark_ = position_.silent();
+        // What really ran dry
+        if (stream_open_ && ideal_played_ == handed_) {
+            real_underruns_++;
+            real_starved_ += real_silent_ - real_silent_mark_;
+        }
+        real_silent_mark_ = real_silent_;
+        handed_ += write.frames;
+        stream_open_ = true;
+        remaining_ = write_frames_ = write.frames;
+        last_write_tick_ = tick_;
+    }
+
+    void FinishWrite() {
+        legacy_.written += write_frames_;
+        if (writes_.empty() && async_ && fill_ > 0 && !slot_ready_[slot_write_]) {
+            // EndOutputStream hands the partial slot over
+            slot_frames_[slot_write_] = fill_;
+            slot_ready_[slot_write_] = true;
+            slot_write_ ^= 1;
+            fill_ = 0;
+        }
+    }
+
+    void RunWriter() {
+        while (true) {
+            if (remaining_ == 0) {
+                if (writes_.empty() || writes_.front().tick > tick_) {
+                    return;
+                }
+                StartWrite();
+            }
+            int count = std::min(kFrameNum - fill_, remaining_);
+            if (async_) {
+                if (slot_ready_[slot_write_]) {
+                    return;
+                }
+                fill_ += count;
+                position_.AddWritten(count);
+                if (fill_ == kFrameNum) {
+                    slot_frames_[slot_write_] = kFrameNum;
+                    slot_ready_[slot_write_] = true;
+                    slot_write_ ^= 1;
+                    fill_ = 0;
+                }
+            } else {
+                if (!chunk_counted_) {
+                    position_.AddWritten(count);
+                }
+                chunk_counted_ = true;
+                if (current_ < 0) {
+                    if (free_.empty()) {
+                        return;
+                    }
+                    current_ = free_.front();
+                    free_.pop_front();
+                }
+                content_[current_] += count;
+                fill_ += count;
+                chunk_counted_ = false;
+                if (fill_ == kFrameNum) {
+                    current_ = -1;
+                    fill_ = 0;
+                }
+            }
+            remaining_ -= count;
+            if (remaining_ == 0) {
+                FinishWrite();
+            }
+        }
+    }
+};
+
+struct Scenario {
+    const char* name;
+    int writes;
+    int frames;
+    int interval_frames;    // Between the arrivals of the writes, 0 for all at once
+    bool underruns;
+};
+
+// 60 ms writes at 24 kHz are 6 DMA periods of 10 ms
+static const Scenario kScenarios[] = {
+    {"ahead", 30, 1440, 0, false},
+    {"real time", 30, 1440, 1440, false},
+    {"late", 30, 1440, 2 * 1440, true},
+    {"odd sizes", 40, 1000, 1000, false},
+};
+
+static void RunScenario(const Scenario& scenario, bool async) {
+    OutputModel model(async);
+    for (int i = 0; i < scenario.writes; i++) {
+        model.AddWrite(i * scenario.interval_frames / kFrameNum, scenario.frames);
+    }
+    model.Run();
+    CHECK_MSG(model.drained(), "%s: the played position did not catch up", scenario.name);
+    // The underruns are the ones the DMA really had, with the silence it sent for them
+    CHECK_MSG(model.underruns() == model.real_underruns(), "%s: %d underruns, %d real",
+        scenario.name, model.underruns(), model.real_underruns());
+    CHECK_MSG(model.starved() == model.real_starved(), "%s: %u frames starved, %u real",
+        scenario.name, model.starved(), model.real_starved());
+    CHECK_MSG((model.underruns() > 0) == scenario.underruns, "%s: %d underruns", scenario.name, model.underruns());
+    printf("  %-8s %-10s %4d, before %5d, with %4d frames never credited\n", async ? "async" : "blocking",
+        scenario.name, model.max_error(), model.legacy_max_error(), model.legacy_behind());
+}
+
+int main() {
+    printf("Played position error, %d x %d frame DMA buffers, at most (frames)\n", kDescNum, kFrameNum);
+    for (bool async : {false, true}) {
+        for (auto& scenario : kScenarios) {
+            RunScenario(scenario, async);
+        }
+    }
+    printf("output_position_test passed\n");
+    return 0;
+}
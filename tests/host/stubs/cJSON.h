@@ -0,0 +1,8 @@
+#ifndef HOST_STUB_CJSON_H
+#define HOST_STUB_CJSON_H
+
+/* Only the type, for headers that pass cJSON pointers around */
+
+typedef struct cJSON cJSON;
+
+#endif // HOST_STUB_CJSON_H
@@ -0,0 +1,6 @@
+#ifndef HOST_STUB_ESP_ATTR_H
+#define HOST_STUB_ESP_ATTR_H
+
+#define IRAM_ATTR
+
+#endif // HOST_STUB_ESP_ATTR_H
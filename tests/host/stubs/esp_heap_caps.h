@@ -0,0 +1,16 @@
+#ifndef HOST_STUB_ESP_HEAP_CAPS_H
+#define HOST_STUB_ESP_HEAP_CAPS_H
+
+#include <cstdlib>
+#include <cstddef>
+
+/* Host stand-in for the capability allocator, there is only one kind of memory */
+
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_8BIT     (1 << 2)
+
+inline void* heap_caps_malloc(size_t size, int caps) { return malloc(size); }
+inline void heap_caps_free(void* ptr) { free(ptr); }
+
+#endif // HOST_STUB_ESP_HEAP_CAPS_H
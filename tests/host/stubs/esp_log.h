@@ -0,0 +1,15 @@
+#ifndef HOST_STUB_ESP_LOG_H
+#define HOST_STUB_ESP_LOG_H
+
+#include <cstdio>
+
+/* Host stand-in for the ESP-IDF log macros, warnings and errors go to stderr */
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+// Info and debug are dropped, the arguments are still used like on the device
+static inline void host_log_discard(const char*, ...) {}
+#define ESP_LOGI(tag, format, ...) host_log_discard(format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) host_log_discard(format, ##__VA_ARGS__)
+
+#endif // HOST_STUB_ESP_LOG_H
@@ -0,0 +1,6 @@
+#ifndef HOST_STUB_ESP_MEMORY_UTILS_H
+#define HOST_STUB_ESP_MEMORY_UTILS_H
+
+inline bool esp_ptr_external_ram(const void* ptr) { return false; }
+
+#endif // HOST_STUB_ESP_MEMORY_UTILS_H
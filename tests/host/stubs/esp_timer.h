@@ -0,0 +1,12 @@
+#ifndef HOST_STUB_ESP_TIMER_H
+#define HOST_STUB_ESP_TIMER_H
+
+#include <cstdint>
+
+/* Host stand-in for the esp_timer clock, the tests move it by hand */
+
+inline int64_t host_timer_now_us = 0;
+
+inline int64_t esp_timer_get_time() { return host_timer_now_us; }
+
+#endif // HOST_STUB_ESP_TIMER_H
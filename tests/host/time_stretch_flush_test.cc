@@ -0,0 +1,72 @@
+#include "host_test.h"
+#include "downlink_buffer.h"
+#include "time_stretcher.h"
+
+#include <cmath>
+
+static const int kSampleRate = 24000;
+static const int kFrameMs = 60;
+static const int kFrameSamples = kSampleRate * kFrameMs / 1000;
+static const int kSentenceFrames = 50;
+
+// Plays sentences whose packets arrive one at a time, so the queue runs dry after every packet,
+// the worst case for a playback that is faster than real time. Returns output / input
+static double RunSentences(int speed, int sentences, bool flush_when_dry) {
+    DownlinkBuffer buffer;
+    CHECK(buffer.Initialize(DOWNLINK_BUFFER_INTERNAL_MS));
+    TimeStretcher stretcher;
+    stretcher.Configure(kSampleRate);
+    stretcher.SetSpeed(speed);
+    size_t input_samples = 0;
+    size_t output_samples = 0;
+    int segment_ends = 0;
+    uint32_t n = 0;
+    for (int sentence = 0; sentence < sentences; sentence++) {
+        for (int frame = 0; frame < kSentenceFrames; frame++) {
+            DownlinkFlowEvent event;
+            auto packet = std::make_unique<AudioStreamPacket>();
+            packet->frame_duration = kFrameMs;
+            packet->sample_rate = kSampleRate;
+            packet->payload.resize(40);
+            CHECK(buffer.Push(packet, event));
+            if (frame == kSentenceFrames - 1) {
+                CHECK(buffer.MarkSegmentEnd());
+            }
+
+            bool segment_end = false;
+            CHECK(buffer.Pop(event, &segment_end) != nullptr);
+            CHECK(!buffer.MarkSegmentEnd());
+            // Stands in for the decoder, voiced speech with a moving pitch
+            std::vector<int16_t> pcm(kFrameSamples);
+            for (auto& sample : pcm) {
+                double t = (double)n++ / kSampleRate;
+                sample = (int16_t)(8000 * sin(2 * M_PI * (150 + 30 * sin(2 * M_PI * 3 * t)) * t));
+            }
+            input_samples += pcm.size();
+            std::vector<int16_t> output;
+            stretcher.Process(pcm, output);
+            if (segment_end || (flush_when_dry && buffer.empty())) {
+                stretcher.Flush(output);
+            }
+            segment_ends += segment_end;
+            output_samples += output.size();
+        }
+    }
+    CHECK_MSG(segment_ends == sentences, "%d segment ends for %d sentences", segment_ends, sentences);
+    CHECK(stretcher.empty());
+    return (double)output_samples / input_samples;
+}
+
+int main() {
+    const int speeds[] = {150, 80, 120, 100};
+    printf("Effective speed with the queue running dry after every 60 ms packet\n");
+    for (int speed : speeds) {
+        double ratio = RunSentences(speed, 4, false);
+        double dry_ratio = RunSentences(speed, 4, true);
+        double expected = 100.0 / speed;
+        printf("  %3d%%: flushed at the sentence end %.3f, flushed when dry %.3f, expected %.3f\n",
+            speed, ratio, dry_ratio, expected);
+        CHECK_MSG(fabs(ratio - expected) < expected * 0.02, "%d%%: ratio %.3f", speed, ratio);
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include "host_test.h"
+#include "time_stretcher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycles"
+static inline uint64_t Now() { return __rdtsc(); }
+#else
+#define BENCH_UNIT "ns"
+static inline uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+static const int kSampleRate = 24000;
+static const int kFrameMs = 60;
+static const int kFrameSamples = kSampleRate * kFrameMs / 1000;
+static const int kFrames = 500;
+
+// Voiced speech with a moving pitch, so the segment search does real work
+static std::vector<int16_t> Speech(size_t samples) {
+    std::vector<int16_t> pcm(samples);
+    for (size_t n = 0; n < samples; n++) {
+        double t = (double)n / kSampleRate;
+        pcm[n] = (int16_t)(8000 * sin(2 * M_PI * (150 + 30 * sin(2 * M_PI * 3 * t)) * t));
+    }
+    return pcm;
+}
+
+struct Result {
+    double per_frame;
+    double us_per_frame;
+};
+
+static Result Measure(int speed, const std::vector<int16_t>& input) {
+    uint64_t best = UINT64_MAX;
+    double best_us = 1e30;
+    // The fastest of a few runs, the others include scheduler noise
+    for (int run = 0; run < 5; run++) {
+        TimeStretcher stretcher;
+        stretcher.Configure(kSampleRate);
+        stretcher.SetSpeed(speed);
+        std::vector<int16_t> frame(kFrameSamples);
+        std::vector<int16_t> output;
+        size_t output_samples = 0;
+        auto wall_start = std::chrono::steady_clock::now();
+        uint64_t start = Now();
+        for (int i = 0; i < kFrames; i++) {
+            std::copy(input.begin() + i * kFrameSamples, input.begin() + (i + 1) * kFrameSamples, frame.begin());
+            output.clear();
+            stretcher.Process(frame, output);
+            output_samples += output.size();
+        }
+        best = std::min(best, Now() - start);
+        best_us = std::min(best_us, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - wall_start).count());
+        output.clear();
+        stretcher.Flush(output);
+        output_samples += output.size();
+        double ratio = (double)output_samples / input.size();
+        CHECK_MSG(fabs(ratio * speed / 100 - 1) < 0.02, "%d%%: output is %.3f of the input", speed, ratio);
+    }
+    return Result{(double)best / kFrames, best_us / kFrames};
+}
+
+int main() {
+    std::vector<int16_t> input = Speech((size_t)kFrames * kFrameSamples);
+    printf("TimeStretcher, %d Hz, %d ms input frames, host %s\n", kSampleRate, kFrameMs, BENCH_UNIT);
+    for (int speed : {80, 100, 115, 150}) {
+        Result result = Measure(speed, input);
+        printf("  %3d%%: %8.0f per frame, %6.1f per input sample, %5.1f us per frame\n", speed, result.per_frame,
+            result.per_frame / kFrameSamples, result.us_per_frame);
+    }
+    return 0;
+}